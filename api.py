@@ -13,6 +13,7 @@
 # limitations under the License.
 
 import logging
+import time
 import webapp2
 
 from google.appengine.api import channel
@@ -70,14 +71,53 @@ def Poll(google_user, client, client_address, instance_id, args):
       'event_type': 'logout',
     })
 
-  for subscription in instance.GetSubscriptions():
-    events.extend(subscription.GetEvents(args['ack']))
-
-  return {
+  # Hanging poll: hold the request open until there are events to deliver or
+  # the client's deadline passes.
+  timeout_ms = args.get('timeout_ms', 0)
+  if not isinstance(timeout_ms, (int, long)):
+    timeout_ms = 0
+  timeout_ms = max(0, min(timeout_ms, config.HANGING_POLL_MAX_MS))
+  deadline = time.time() + timeout_ms / 1000.0
+  acks = args['ack']
+  # Per subscription, the highest sequence number the client has seen.
+  ack_cursors = args.get('ack_cursors', {})
+  # Read before scanning, so that events put during a scan still wake us.
+  events_version = instance.GetEventsVersion()
+  while True:
+    subscription_events = []
+    for subscription in instance.GetSubscriptions():
+      subscription_events.extend(subscription.GetEvents(
+          acks, ack_cursors.get(str(subscription.key()))))
+    last_scan = time.time()
+    acks = []
+    ack_cursors = {}
+    remaining = deadline - time.time()
+    if subscription_events or remaining <= 0:
+      break
+    # Only the memcache version is checked between scans; the datastore is
+    # rescanned when SendMessage() changes it, or now and then in case
+    # memcache dropped the change.
+    while (remaining > 0 and
+           time.time() - last_scan < config.HANGING_POLL_RESCAN_SECONDS):
+      time.sleep(min(remaining, config.HANGING_POLL_INTERVAL_SECONDS))
+      remaining = deadline - time.time()
+      new_version = instance.GetEventsVersion()
+      if new_version != events_version:
+        events_version = new_version
+        break
+  events.extend(subscription_events)
+
+  ret = {
     'result': 'ok',
     'instance_generation': instance.generation,
+    # Tells the client that subscribe takes this many subjects at once.
+    'max_subscribe_subjects': config.MAX_SUBSCRIBE_SUBJECTS,
     'events': events,
   }
+  if 'timeout_ms' in args and config.HANGING_POLL_MAX_MS > 0:
+    # Tells the client that we support hanging polls.
+    ret['timeout_ms'] = timeout_ms
+  return ret
 
 
 def Pin(google_user, client, client_address, instance_id, args):
@@ -89,7 +129,7 @@ def Pin(google_user, client, client_address, instance_id, args):
     }
 
   subject = args['subject']
-  message = args['message']
+  message = utils.MessageFromArgs(args)
   sender_message_id = args['sender_message_id']
 
   try:
@@ -120,7 +160,7 @@ def Pin(google_user, client, client_address, instance_id, args):
 
 def SendMessage(google_user, client, client_address, instance_id, args):
   subject = args['subject']
-  message = args['message']
+  message = utils.MessageFromArgs(args)
   sender_message_id = args['sender_message_id']
 
   try:
@@ -148,8 +188,7 @@ def SendMessage(google_user, client, client_address, instance_id, args):
   }
 
 
-def Subscribe(google_user, client, client_address, instance_id, args):
-  instance = models.Instance.FromID(instance_id)
+def _SubscribeOne(client, instance, args):
   subject = models.Subject.FindOrCreate(args['subject'], client)
   messages = args.get('messages', 0)
   last_id = args.get('last_id', None)
@@ -176,6 +215,58 @@ def Subscribe(google_user, client, client_address, instance_id, args):
   }
 
 
+def Subscribe(google_user, client, client_address, instance_id, args):
+  instance = models.Instance.FromID(instance_id)
+  if 'subjects' not in args:
+    return _SubscribeOne(client, instance, args)
+
+  # Many subjects in one command, each with its own messages and last_id, so
+  # that a client can resubscribe to all of them in a few commands. Results
+  # are in the same order. Unlike _SubscribeOne(), the datastore work is done
+  # in batches across the subjects.
+  if len(args['subjects']) > config.MAX_SUBSCRIBE_SUBJECTS:
+    return {
+      'result': 'too_many_subjects',
+    }
+  subjects = models.Subject.FindOrCreateMulti(
+      [subject_args['subject'] for subject_args in args['subjects']], client)
+  profile = models.Client.profile.get_value_for_datastore(client)
+  # Probably a race with the channel opening
+  active = instance and instance.active
+  results = []
+  subscribes = []
+  event_requests = []
+  for subject, subject_args in zip(subjects, args['subjects']):
+    try:
+      subject.VerifyReadable(profile)
+    except models.AccessDenied:
+      logging.warning('Subscribe access denied')
+      results.append({
+        'result': 'access_denied',
+      })
+      continue
+    results.append({
+      'result': 'ok' if active else 'retry',
+    })
+    if active:
+      subscribes.append((subject, subject_args['subject']))
+    event_requests.append((
+        subject,
+        subject_args.get('messages', 0),
+        subject_args.get('last_id', None),
+        subject_args['subject'],
+        active))
+
+  # Subscribed before reading events, so that none fall in between.
+  if subscribes:
+    models.Subscription.FindOrCreateMulti(subscribes, instance)
+  return {
+    'result': 'ok',
+    'results': results,
+    'events': models.Subject.GetEventsMulti(event_requests),
+  }
+
+
 def Unpin(google_user, client, client_address, instance_id, args):
   instance = models.Instance.FromID(instance_id)
   subject = args['subject']
@@ -235,6 +326,11 @@ class APIWrapper(webapp2.RequestHandler):
         'responses': [],
         'events': [],
     }
+    # Clients that ask for it get message bodies as embedded JSON instead of
+    # JSON-encoded strings.
+    embed_messages = self.request_json.get('message_encoding') == 'json'
+    if embed_messages:
+      ret['message_encoding'] = 'json'
     for command in self.request_json['commands']:
       logging.info('Command: %s', command)
       callback = self._COMMANDS[command['command']]
@@ -248,6 +344,12 @@ class APIWrapper(webapp2.RequestHandler):
       # client can see them as a single stream.
       ret['events'].extend(result.pop('events', []))
       ret['responses'].append(result)
+    if embed_messages:
+      for event in ret['events']:
+        utils.EmbedMessage(event)
+      for response in ret['responses']:
+        utils.EmbedMessage(response.get('message'))
+        utils.EmbedMessage(response.get('pin'))
     return ret
 
 
@@ -0,0 +1,1022 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include "cosmopolite.h"
+#include "cosmopolite-int.h"
+#include "mock-server.h"
+
+#define RUN_BENCH(func) run_bench(#func, func)
+
+#define ANSI_COLOR_YELLOW  "\x1b[33m"
+#define ANSI_COLOR_RESET   "\x1b[0m"
+
+#define NS_PER_S 1000000000ULL
+
+#define min_size(a, b) ((a) < (b) ? (a) : (b))
+
+// Set unless COSMO_BENCH_URL points at a real server.
+static mock_server *bench_server;
+
+static const char *bench_base_url() {
+  return bench_server ? mock_server_base_url(bench_server) : getenv("COSMO_BENCH_URL");
+}
+
+static long bench_env(const char *name) {
+  const char *value = getenv(name);
+  return value ? strtol(value, NULL, 10) : 0;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  assert(timespec_get(&ts, TIME_UTC) == TIME_UTC);
+  return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+static json_t *bench_subject(size_t i) {
+  char name[64];
+  sprintf(name, "/bench/%zu", i);
+  return cosmo_subject(name, NULL, NULL);
+}
+
+// One no other run has used, for benchmarks that fill it with messages.
+static json_t *bench_random_subject() {
+  char uuid[COSMO_UUID_SIZE];
+  cosmo_uuid(uuid);
+  char name[COSMO_UUID_SIZE + 20];
+  sprintf(name, "/bench/%s", uuid);
+  return cosmo_subject(name, NULL, NULL);
+}
+
+static json_t *bench_payload(size_t size) {
+  char *payload = malloc(size + 1);
+  assert(payload);
+  memset(payload, 'x', size);
+  payload[size] = '\0';
+  json_t *ret = json_string(payload);
+  free(payload);
+  return ret;
+}
+
+static void run_bench(const char *func_name, void (*bench)()) {
+  printf(ANSI_COLOR_YELLOW "%s" ANSI_COLOR_RESET ":\n", func_name);
+  bench();
+  printf("\n");
+}
+
+// What cosmo_find_subscription() used to do: json_equal() against every subject.
+static json_t *linear_find(json_t *subjects, json_t *subject) {
+  size_t i;
+  json_t *iter;
+  json_array_foreach(subjects, i, iter) {
+    if (json_equal(iter, subject)) {
+      return iter;
+    }
+  }
+  return NULL;
+}
+
+static void bench_subscription_lookup() {
+  const size_t sizes[] = {100, 1000, 10000, 100000};
+#define LOOKUPS 100000
+#define LINEAR_LOOKUPS 1000
+#define LINEAR_MAX_SUBJECTS 10000
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    size_t num_subjects = sizes[s];
+
+    struct cosmo_subscriptions subscriptions;
+    cosmo_subscriptions_init(&subscriptions, NULL);
+    json_t *subjects = json_array();
+    for (size_t i = 0; i < num_subjects; i++) {
+      json_t *subject = bench_subject(i);
+      cosmo_subscriptions_add(&subscriptions, subject);
+      json_array_append_new(subjects, subject);
+    }
+
+    // Probe with distinct but equal objects, like subjects parsed off the wire.
+    json_t *probes = json_array();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+      json_array_append_new(probes, bench_subject((i * 7919) % num_subjects));
+    }
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+      assert(cosmo_subscriptions_find(&subscriptions, json_array_get(probes, i)));
+    }
+    uint64_t indexed_ns = (now_ns() - start) / LOOKUPS;
+
+    printf("%7zu subjects: %8ju ns/lookup indexed", num_subjects, (uintmax_t) indexed_ns);
+    if (num_subjects <= LINEAR_MAX_SUBJECTS) {
+      start = now_ns();
+      for (size_t i = 0; i < LINEAR_LOOKUPS; i++) {
+        assert(linear_find(subjects, json_array_get(probes, i)));
+      }
+      uint64_t linear_ns = (now_ns() - start) / LINEAR_LOOKUPS;
+      printf(", %8ju ns/lookup linear scan", (uintmax_t) linear_ns);
+    }
+    printf("\n");
+
+    json_decref(probes);
+    json_decref(subjects);
+    cosmo_subscriptions_destroy(&subscriptions);
+  }
+}
+
+// What cosmo_handle_message() used to do: walk the json array backwards.
+static bool linear_insert(json_t *messages, json_int_t id, json_t *event) {
+  ssize_t insert_after;
+  for (insert_after = json_array_size(messages) - 1; insert_after >= 0; insert_after--) {
+    json_int_t message_id = json_integer_value(json_object_get(json_array_get(messages, insert_after), "id"));
+    if (message_id == id) {
+      return false;
+    }
+    if (message_id < id) {
+      break;
+    }
+  }
+  json_array_insert(messages, insert_after + 1, event);
+  return true;
+}
+
+static void bench_message_store() {
+#define STORE_MESSAGES 20000
+  json_t *events = json_array();
+  for (json_int_t id = 1; id <= STORE_MESSAGES; id++) {
+    json_array_append_new(events, json_pack("{sI}", "id", id));
+  }
+
+  const struct {
+    const char *name;
+    size_t stride;
+  } orders[] = {
+    {"in order", 1},
+    // Visits every id exactly once, mostly out of order.
+    {"shuffled", 7919},
+  };
+
+  for (size_t o = 0; o < sizeof(orders) / sizeof(*orders); o++) {
+    struct cosmo_message_store store;
+    cosmo_message_store_init(&store, NULL);
+    json_t *linear = json_array();
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < STORE_MESSAGES; i++) {
+      json_t *event = json_array_get(events, (i * orders[o].stride) % STORE_MESSAGES);
+      assert(cosmo_message_store_insert(&store, json_integer_value(json_object_get(event, "id")), event));
+    }
+    uint64_t store_ns = (now_ns() - start) / STORE_MESSAGES;
+
+    start = now_ns();
+    for (size_t i = 0; i < STORE_MESSAGES; i++) {
+      json_t *event = json_array_get(events, (i * orders[o].stride) % STORE_MESSAGES);
+      assert(linear_insert(linear, json_integer_value(json_object_get(event, "id")), event));
+    }
+    uint64_t linear_ns = (now_ns() - start) / STORE_MESSAGES;
+    printf("%s insert: %8ju ns/message store, %8ju ns/message json array\n", orders[o].name, (uintmax_t) store_ns, (uintmax_t) linear_ns);
+
+    // Full-history replay, as after a resubscribe with messages = -1.
+    start = now_ns();
+    for (size_t i = 0; i < STORE_MESSAGES; i++) {
+      json_t *event = json_array_get(events, i);
+      assert(!cosmo_message_store_insert(&store, json_integer_value(json_object_get(event, "id")), event));
+    }
+    store_ns = (now_ns() - start) / STORE_MESSAGES;
+
+    start = now_ns();
+    for (size_t i = 0; i < STORE_MESSAGES; i++) {
+      json_t *event = json_array_get(events, i);
+      assert(!linear_insert(linear, json_integer_value(json_object_get(event, "id")), event));
+    }
+    linear_ns = (now_ns() - start) / STORE_MESSAGES;
+    printf("%s replay: %8ju ns/message store, %8ju ns/message json array\n", orders[o].name, (uintmax_t) store_ns, (uintmax_t) linear_ns);
+
+    json_decref(linear);
+    cosmo_message_store_destroy(&store);
+  }
+
+  json_decref(events);
+}
+
+static void bench_snapshot() {
+#define SNAPSHOT_MESSAGES 10000
+#define SNAPSHOT_ITERATIONS 100
+  struct cosmo_message_store store;
+  cosmo_message_store_init(&store, NULL);
+  for (json_int_t id = 1; id <= SNAPSHOT_MESSAGES; id++) {
+    json_t *event = json_pack("{sIs{sss[iiii]}}", "id", id, "message", "body", "0123456789abcdef0123456789abcdef", "values", 1, 2, 3, 4);
+    assert(cosmo_message_store_insert(&store, id, event));
+    json_decref(event);
+  }
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < SNAPSHOT_ITERATIONS; i++) {
+    cosmo_snapshot *snapshot = cosmo_message_store_snapshot(&store);
+    assert(cosmo_snapshot_length(snapshot) == SNAPSHOT_MESSAGES);
+    cosmo_snapshot_destroy(snapshot);
+  }
+  uint64_t snapshot_ns = (now_ns() - start) / SNAPSHOT_ITERATIONS;
+
+  // What cosmo_get_messages() does with the lock held for its full duration
+  // before snapshots.
+  start = now_ns();
+  for (size_t i = 0; i < SNAPSHOT_ITERATIONS; i++) {
+    json_t *copy = json_array();
+    for (size_t j = 0; j < store.block->length; j++) {
+      json_array_append_new(copy, json_deep_copy(store.block->messages[j].event));
+    }
+    json_decref(copy);
+  }
+  uint64_t copy_ns = (now_ns() - start) / SNAPSHOT_ITERATIONS;
+
+  printf("%d messages: %10ju ns/snapshot, %10ju ns/deep copy\n", SNAPSHOT_MESSAGES, (uintmax_t) snapshot_ns, (uintmax_t) copy_ns);
+
+  // Appends while a snapshot is held share the block until it fills.
+  cosmo_snapshot *snapshot = cosmo_message_store_snapshot(&store);
+  start = now_ns();
+  for (json_int_t id = SNAPSHOT_MESSAGES + 1; id <= SNAPSHOT_MESSAGES * 2; id++) {
+    json_t *event = json_pack("{sI}", "id", id);
+    assert(cosmo_message_store_insert(&store, id, event));
+    json_decref(event);
+  }
+  uint64_t append_ns = (now_ns() - start) / SNAPSHOT_MESSAGES;
+  assert(cosmo_snapshot_length(snapshot) == SNAPSHOT_MESSAGES);
+  cosmo_snapshot_destroy(snapshot);
+  printf("append with snapshot held: %ju ns/message\n", (uintmax_t) append_ns);
+
+  cosmo_message_store_destroy(&store);
+}
+
+static size_t gunzip(const char *in, size_t in_len, char *out, size_t out_len) {
+  z_stream stream = {
+    .next_in = (unsigned char *) in,
+    .avail_in = in_len,
+    .next_out = (unsigned char *) out,
+    .avail_out = out_len,
+  };
+  assert(inflateInit2(&stream, MAX_WBITS + 16) == Z_OK);
+  assert(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+  size_t ret = stream.total_out;
+  assert(inflateEnd(&stream) == Z_OK);
+  return ret;
+}
+
+// Shaped like real traffic: repeated envelopes, subjects and uuids around
+// small bodies.
+static json_t *bench_message_event(size_t i) {
+  char uuid[COSMO_UUID_SIZE], event_id[COSMO_UUID_SIZE];
+  cosmo_uuid(uuid);
+  cosmo_uuid(event_id);
+  return json_pack("{sssIs{ss}sssfsssisss{sssi}}",
+      "event_type", "message",
+      "id", (json_int_t) i,
+      "subject", "name", "/chat/rooms/lobby",
+      "sender", "5629499534213120",
+      "created", 1412345678.0 + i,
+      "sender_message_id", uuid,
+      "random_value", (int) (i * 2654435761u % 1000000),
+      "event_id", event_id,
+      "message_json", "text", "hello there, how is everybody doing today?", "seq", (int) i);
+}
+
+static json_t *bench_send_command(size_t i) {
+  char uuid[COSMO_UUID_SIZE];
+  cosmo_uuid(uuid);
+  return json_pack("{sss{s{ss}s{sssi}ss}}",
+      "command", "sendMessage",
+      "arguments",
+      "subject", "name", "/chat/rooms/lobby",
+      "message_json", "text", "hello there, how is everybody doing today?", "seq", (int) i,
+      "sender_message_id", uuid);
+}
+
+static void bench_compression() {
+  const size_t sizes[] = {1, 10, 100, 1000};
+#define COMPRESSION_ITERATIONS 20
+  const struct {
+    const char *name;
+    json_t *(*item)(size_t);
+    const char *key;
+  } batches[] = {
+    {"events", bench_message_event, "events"},
+    {"sendMessage", bench_send_command, "commands"},
+  };
+
+  for (size_t b = 0; b < sizeof(batches) / sizeof(*batches); b++) {
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+      json_t *items = json_array();
+      for (size_t i = 0; i < sizes[s]; i++) {
+        json_array_append_new(items, batches[b].item(i));
+      }
+      json_t *batch = json_pack("{ssso}", "status", "ok", batches[b].key, items);
+      char *raw = json_dumps(batch, 0);
+      size_t raw_len = strlen(raw);
+      json_decref(batch);
+
+      char *compressed = NULL;
+      size_t compressed_len = 0;
+      uint64_t start = now_ns();
+      for (size_t i = 0; i < COMPRESSION_ITERATIONS; i++) {
+        free(compressed);
+        compressed_len = cosmo_gzip(NULL, raw, raw_len, &compressed);
+      }
+      uint64_t compress_ns = (now_ns() - start) / COMPRESSION_ITERATIONS;
+
+      char *decompressed = malloc(raw_len);
+      start = now_ns();
+      for (size_t i = 0; i < COMPRESSION_ITERATIONS; i++) {
+        assert(gunzip(compressed, compressed_len, decompressed, raw_len) == raw_len);
+      }
+      uint64_t decompress_ns = (now_ns() - start) / COMPRESSION_ITERATIONS;
+      assert(!memcmp(raw, decompressed, raw_len));
+
+      printf("%11s x%-4zu %8zu -> %7zu bytes (%3zu%% saved), %7ju ns gzip, %7ju ns gunzip\n",
+          batches[b].name, sizes[s], raw_len, compressed_len,
+          (raw_len - min_size(raw_len, compressed_len)) * 100 / raw_len,
+          (uintmax_t) compress_ns, (uintmax_t) decompress_ns);
+
+      free(decompressed);
+      free(compressed);
+      free(raw);
+    }
+  }
+}
+
+static void on_bench_send(void *passthrough, void *result) {
+  *(uint64_t *) passthrough = now_ns();
+}
+
+static void bench_batching() {
+  const char *base_url = bench_base_url();
+
+  const int lingers[] = {0, 1, 5, 20, 50};
+  const size_t max_batches[] = {0, 10, 100};
+#define BATCHING_MESSAGES 500
+#define BATCHING_INTERVAL_US 200
+
+  for (size_t b = 0; b < sizeof(max_batches) / sizeof(*max_batches); b++) {
+    for (size_t l = 0; l < sizeof(lingers) / sizeof(*lingers); l++) {
+      cosmo_callbacks callbacks = {NULL};
+      cosmo_options options = {
+        .allow_http_loopback = true,
+        .linger_ms = lingers[l],
+        .max_batch_commands = max_batches[b],
+      };
+      cosmo *client = cosmo_create(base_url, NULL, &callbacks, &options, NULL);
+      json_t *subject = bench_subject(0);
+
+      // A steady stream of sends, as from a busy producer.
+      uint64_t sent_ns[BATCHING_MESSAGES], done_ns[BATCHING_MESSAGES];
+      promise *promises[BATCHING_MESSAGES];
+      uint64_t start = now_ns();
+      for (size_t i = 0; i < BATCHING_MESSAGES; i++) {
+        json_t *message = json_integer(i);
+        promises[i] = promise_create(on_bench_send, NULL, &done_ns[i]);
+        sent_ns[i] = now_ns();
+        cosmo_send_message(client, subject, message, promises[i]);
+        json_decref(message);
+        thrd_sleep(&(struct timespec) {.tv_nsec = BATCHING_INTERVAL_US * 1000}, NULL);
+      }
+      uint64_t latency_ns = 0, end = start;
+      for (size_t i = 0; i < BATCHING_MESSAGES; i++) {
+        assert(promise_wait(promises[i], NULL));
+        promise_destroy(promises[i]);
+        latency_ns += done_ns[i] - sent_ns[i];
+        end = done_ns[i] > end ? done_ns[i] : end;
+      }
+
+      printf("linger %2d ms, max batch %3zu: %7ju messages/s, %5ju ms mean latency\n",
+          lingers[l], max_batches[b],
+          (uintmax_t) (BATCHING_MESSAGES * NS_PER_S / (end - start)),
+          (uintmax_t) (latency_ns / BATCHING_MESSAGES / 1000000));
+
+      json_decref(subject);
+      cosmo_shutdown(client);
+    }
+  }
+}
+
+// Client-side cost of queueing messages, one call each or in one call. The
+// long linger keeps them queued, so no server is needed.
+static void bench_send_messages() {
+  const size_t sizes[] = {1, 10, 100, 1000};
+#define SEND_MESSAGES_TOTAL 100000
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    size_t batch = sizes[s];
+    json_t *subjects[batch], *messages[batch];
+    for (size_t i = 0; i < batch; i++) {
+      subjects[i] = bench_subject(i % 10);
+      messages[i] = json_pack("{sssi}", "text", "hello there, how is everybody doing today?", "seq", (int) i);
+    }
+
+    cosmo_callbacks callbacks = {NULL};
+    cosmo_options options = {
+      .linger_ms = 3600 * 1000,
+    };
+    cosmo *client = cosmo_create("https://localhost:1", NULL, &callbacks, &options, NULL);
+    uint64_t start = now_ns();
+    for (size_t n = 0; n < SEND_MESSAGES_TOTAL; n += batch) {
+      for (size_t i = 0; i < batch; i++) {
+        cosmo_send_message(client, subjects[i], messages[i], NULL);
+      }
+    }
+    uint64_t single_ns = (now_ns() - start) / SEND_MESSAGES_TOTAL;
+    cosmo_shutdown(client);
+
+    client = cosmo_create("https://localhost:1", NULL, &callbacks, &options, NULL);
+    start = now_ns();
+    for (size_t n = 0; n < SEND_MESSAGES_TOTAL; n += batch) {
+      cosmo_send_messages(client, batch, subjects, messages, NULL, NULL);
+    }
+    uint64_t bulk_ns = (now_ns() - start) / SEND_MESSAGES_TOTAL;
+    cosmo_shutdown(client);
+
+    printf("%4zu messages per call: %5ju ns/message cosmo_send_message(), %5ju ns/message cosmo_send_messages()\n",
+        batch, (uintmax_t) single_ns, (uintmax_t) bulk_ns);
+
+    for (size_t i = 0; i < batch; i++) {
+      json_decref(subjects[i]);
+      json_decref(messages[i]);
+    }
+  }
+}
+
+static void append(char **buf, size_t *len, size_t *capacity, const char *data, size_t data_len) {
+  if (*len + data_len > *capacity) {
+    *capacity = (*len + data_len) * 2;
+    *buf = realloc(*buf, *capacity);
+    assert(*buf);
+  }
+  memcpy(*buf + *len, data, data_len);
+  *len += data_len;
+}
+
+// Building a request body for a backlog of commands, as happens on every
+// attempt while they're retried: encoding them all, as cosmo_build_rpc() used
+// to, or splicing in each command's cached encoding.
+static void bench_request_build() {
+  const size_t sizes[] = {100, 1000, 10000};
+#define REQUEST_BUILD_ATTEMPTS 20
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    json_t *commands = json_array();
+    char **encoded = malloc(sizes[s] * sizeof(*encoded));
+    assert(encoded);
+    for (size_t i = 0; i < sizes[s]; i++) {
+      json_t *command = bench_send_command(i);
+      encoded[i] = json_dumps(command, JSON_COMPACT);
+      json_array_append_new(commands, command);
+    }
+
+    uint64_t start = now_ns();
+    for (size_t a = 0; a < REQUEST_BUILD_ATTEMPTS; a++) {
+      json_t *to_send = json_pack("{sssssO}", "client_id", "bench", "instance_id", "bench", "commands", commands);
+      free(json_dumps(to_send, JSON_COMPACT));
+      json_decref(to_send);
+    }
+    uint64_t encode_ns = (now_ns() - start) / REQUEST_BUILD_ATTEMPTS;
+
+    char *buf = NULL;
+    size_t capacity = 0;
+    const char *prefix = "{\"client_id\":\"bench\",\"instance_id\":\"bench\",\"commands\":[";
+    start = now_ns();
+    for (size_t a = 0; a < REQUEST_BUILD_ATTEMPTS; a++) {
+      size_t len = 0;
+      append(&buf, &len, &capacity, prefix, strlen(prefix));
+      for (size_t i = 0; i < sizes[s]; i++) {
+        if (i) {
+          append(&buf, &len, &capacity, ",", 1);
+        }
+        append(&buf, &len, &capacity, encoded[i], strlen(encoded[i]));
+      }
+      append(&buf, &len, &capacity, "]}", 2);
+    }
+    uint64_t splice_ns = (now_ns() - start) / REQUEST_BUILD_ATTEMPTS;
+
+    printf("%5zu commands: %7ju us/request encoded, %5ju us/request spliced\n",
+        sizes[s], (uintmax_t) (encode_ns / 1000), (uintmax_t) (splice_ns / 1000));
+
+    free(buf);
+    for (size_t i = 0; i < sizes[s]; i++) {
+      free(encoded[i]);
+    }
+    free(encoded);
+    json_decref(commands);
+  }
+}
+
+static void bench_journal() {
+  const size_t sizes[] = {1000, 10000, 100000};
+#define JOURNAL_SYNCED_APPENDS 1000
+
+  char path[COSMO_UUID_SIZE + 32];
+  char uuid[COSMO_UUID_SIZE];
+  cosmo_uuid(uuid);
+  sprintf(path, "/tmp/cosmo-bench-%s.journal", uuid);
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    struct cosmo_journal journal;
+    assert(cosmo_journal_open(&journal, path, NULL));
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < sizes[s]; i++) {
+      json_t *command = bench_send_command(i);
+      cosmo_journal_append(&journal, command);
+      json_decref(command);
+    }
+    uint64_t append_ns = (now_ns() - start) / sizes[s];
+    cosmo_journal_close(&journal);
+
+    // What cosmo_create() does with a journal left by a crash.
+    start = now_ns();
+    assert(cosmo_journal_open(&journal, path, NULL));
+    size_t offset = 0, record_offset, replayed = 0;
+    json_t *command;
+    while ((command = cosmo_journal_next(&journal, &offset, &record_offset))) {
+      json_decref(command);
+      replayed++;
+    }
+    uint64_t recover_ns = now_ns() - start;
+    assert(replayed == sizes[s]);
+    cosmo_journal_close(&journal);
+    assert(!unlink(path));
+
+    printf("%6zu commands: %5ju ns/append, %6ju us to recover\n",
+        sizes[s], (uintmax_t) append_ns, (uintmax_t) (recover_ns / 1000));
+  }
+
+  // Each append synced to disk, as with journal_sync.
+  struct cosmo_journal journal;
+  assert(cosmo_journal_open(&journal, path, NULL));
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < JOURNAL_SYNCED_APPENDS; i++) {
+    json_t *command = bench_send_command(i);
+    cosmo_journal_append(&journal, command);
+    cosmo_journal_sync(&journal);
+    json_decref(command);
+  }
+  uint64_t synced_ns = (now_ns() - start) / JOURNAL_SYNCED_APPENDS;
+  cosmo_journal_close(&journal);
+  assert(!unlink(path));
+  printf("synced: %ju ns/append\n", (uintmax_t) synced_ns);
+}
+
+// Whether the instance has a new generation and has finished resubscribing.
+static bool resubscribed(cosmo *client, const json_t *old_generation) {
+  assert(!pthread_mutex_lock(&client->lock));
+  bool done = client->generation && !json_equal(client->generation, old_generation) && !client->command_queue_head;
+  for (size_t i = 0; i < client->num_rpcs; i++) {
+    done &= !client->rpcs[i].commands;
+  }
+  assert(!pthread_mutex_unlock(&client->lock));
+  return done;
+}
+
+// Time to recover from a server-side instance reset.
+static void bench_resubscribe() {
+  const char *base_url = bench_base_url();
+
+  const size_t sizes[] = {100, 1000, 5000};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    cosmo_callbacks callbacks = {NULL};
+    // Frequent plain polls, so the reset is noticed at once, and RPCs of a
+    // bounded number of commands.
+    cosmo_options options = {
+      .allow_http_loopback = true,
+      .hanging_poll_ms = -1,
+      .min_poll_ms = 10,
+      .max_poll_ms = 10,
+      .max_batch_commands = 100,
+    };
+    cosmo *client = cosmo_create(base_url, NULL, &callbacks, &options, NULL);
+    json_t *subjects = json_array();
+    for (size_t i = 0; i < sizes[s]; i++) {
+      json_array_append_new(subjects, bench_subject(i));
+    }
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_subscribe(client, subjects, 0, 0, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+
+    // A new instance ID looks to the server like its instance was reset.
+    assert(!pthread_mutex_lock(&client->lock));
+    json_t *old_generation = json_incref(client->generation);
+    cosmo_uuid(client->instance_id);
+    assert(!pthread_mutex_unlock(&client->lock));
+    uint64_t start = now_ns();
+    while (!resubscribed(client, old_generation)) {
+      thrd_sleep(&(struct timespec) {.tv_nsec = 100000}, NULL);
+    }
+    uint64_t recover_ns = now_ns() - start;
+
+    printf("%5zu subscriptions: %6ju ms to resubscribe\n", sizes[s], (uintmax_t) (recover_ns / 1000000));
+
+    json_decref(old_generation);
+    json_decref(subjects);
+    cosmo_shutdown(client);
+  }
+}
+
+// Sends as fast as they're accepted, for a range of message sizes.
+static void bench_publish() {
+  const size_t sizes[] = {16, 1024, 16384};
+#define PUBLISH_MESSAGES 2000
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    cosmo_callbacks callbacks = {NULL};
+    cosmo_options options = {
+      .allow_http_loopback = true,
+      .max_batch_commands = 100,
+    };
+    cosmo *client = cosmo_create(bench_base_url(), NULL, &callbacks, &options, NULL);
+    json_t *subject = bench_random_subject();
+    json_t *message = bench_payload(sizes[s]);
+
+    promise *promises[PUBLISH_MESSAGES];
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < PUBLISH_MESSAGES; i++) {
+      promises[i] = promise_create(NULL, NULL, NULL);
+      cosmo_send_message(client, subject, message, promises[i]);
+    }
+    for (size_t i = 0; i < PUBLISH_MESSAGES; i++) {
+      assert(promise_wait(promises[i], NULL));
+      promise_destroy(promises[i]);
+    }
+    uint64_t elapsed_ns = now_ns() - start;
+
+    printf("%5zu byte messages: %6ju messages/s, %7.2f MB/s\n",
+        sizes[s], (uintmax_t) (PUBLISH_MESSAGES * NS_PER_S / elapsed_ns),
+        (double) PUBLISH_MESSAGES * sizes[s] * NS_PER_S / elapsed_ns / 1e6);
+
+    json_decref(message);
+    json_decref(subject);
+    cosmo_shutdown(client);
+  }
+}
+
+struct fan_in {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint64_t *latencies_ns;
+  size_t received;
+};
+
+static void on_fan_in_message(const json_t *event, void *passthrough) {
+  uint64_t now = now_ns();
+  struct fan_in *fan_in = passthrough;
+  json_int_t sent_ns = json_integer_value(json_object_get(json_object_get(event, "message"), "sent_ns"));
+  assert(!pthread_mutex_lock(&fan_in->lock));
+  fan_in->latencies_ns[fan_in->received++] = now - sent_ns;
+  assert(!pthread_cond_signal(&fan_in->cond));
+  assert(!pthread_mutex_unlock(&fan_in->lock));
+}
+
+static int uint64_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Delivery latency, from cosmo_send_message() to the message callback, with
+// several senders feeding one subscriber through a hanging poll.
+static void bench_fan_in() {
+  const size_t num_senders[] = {1, 4, 16};
+#define FAN_IN_MESSAGES 1000
+#define FAN_IN_INTERVAL_US 500
+#define MAX_FAN_IN_SENDERS 16
+
+  for (size_t n = 0; n < sizeof(num_senders) / sizeof(*num_senders); n++) {
+    struct fan_in fan_in = {
+      .received = 0,
+    };
+    assert(!pthread_mutex_init(&fan_in.lock, NULL));
+    assert(!pthread_cond_init(&fan_in.cond, NULL));
+    fan_in.latencies_ns = malloc(FAN_IN_MESSAGES * sizeof(*fan_in.latencies_ns));
+    assert(fan_in.latencies_ns);
+
+    cosmo_callbacks receiver_callbacks = {
+      .message = on_fan_in_message,
+    };
+    cosmo_options receiver_options = {
+      .allow_http_loopback = true,
+    };
+    cosmo *receiver = cosmo_create(bench_base_url(), NULL, &receiver_callbacks, &receiver_options, &fan_in);
+    json_t *subject = bench_random_subject();
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_subscribe(receiver, subject, 0, 0, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+
+    // Senders only send, and are warmed up first so connection setup isn't
+    // counted.
+    cosmo_callbacks sender_callbacks = {NULL};
+    cosmo_options sender_options = {
+      .allow_http_loopback = true,
+      .hanging_poll_ms = -1,
+    };
+    cosmo *senders[MAX_FAN_IN_SENDERS];
+    json_t *warm_up_subject = bench_random_subject();
+    for (size_t i = 0; i < num_senders[n]; i++) {
+      senders[i] = cosmo_create(bench_base_url(), NULL, &sender_callbacks, &sender_options, NULL);
+      json_t *message = json_integer(i);
+      promise_obj = promise_create(NULL, NULL, NULL);
+      cosmo_send_message(senders[i], warm_up_subject, message, promise_obj);
+      assert(promise_wait(promise_obj, NULL));
+      promise_destroy(promise_obj);
+      json_decref(message);
+    }
+    json_decref(warm_up_subject);
+
+    for (size_t i = 0; i < FAN_IN_MESSAGES; i++) {
+      json_t *message = json_pack("{sI}", "sent_ns", (json_int_t) now_ns());
+      cosmo_send_message(senders[i % num_senders[n]], subject, message, NULL);
+      json_decref(message);
+      thrd_sleep(&(struct timespec) {.tv_nsec = FAN_IN_INTERVAL_US * 1000}, NULL);
+    }
+    assert(!pthread_mutex_lock(&fan_in.lock));
+    while (fan_in.received < FAN_IN_MESSAGES) {
+      assert(!pthread_cond_wait(&fan_in.cond, &fan_in.lock));
+    }
+    assert(!pthread_mutex_unlock(&fan_in.lock));
+
+    qsort(fan_in.latencies_ns, FAN_IN_MESSAGES, sizeof(*fan_in.latencies_ns), uint64_cmp);
+    printf("%2zu senders: p50 %6ju us, p90 %6ju us, p99 %6ju us, max %6ju us\n",
+        num_senders[n],
+        (uintmax_t) (fan_in.latencies_ns[FAN_IN_MESSAGES / 2] / 1000),
+        (uintmax_t) (fan_in.latencies_ns[FAN_IN_MESSAGES * 9 / 10] / 1000),
+        (uintmax_t) (fan_in.latencies_ns[FAN_IN_MESSAGES * 99 / 100] / 1000),
+        (uintmax_t) (fan_in.latencies_ns[FAN_IN_MESSAGES - 1] / 1000));
+
+    for (size_t i = 0; i < num_senders[n]; i++) {
+      cosmo_shutdown(senders[i]);
+    }
+    cosmo_shutdown(receiver);
+    json_decref(subject);
+    free(fan_in.latencies_ns);
+    assert(!pthread_cond_destroy(&fan_in.cond));
+    assert(!pthread_mutex_destroy(&fan_in.lock));
+  }
+}
+
+// A new instance subscribing to many subjects at once.
+static void bench_subscribe_scale() {
+  const size_t sizes[] = {100, 1000, 10000};
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    cosmo_callbacks callbacks = {NULL};
+    cosmo_options options = {
+      .allow_http_loopback = true,
+      .max_batch_commands = 100,
+    };
+    cosmo *client = cosmo_create(bench_base_url(), NULL, &callbacks, &options, NULL);
+    json_t *subjects = json_array();
+    for (size_t i = 0; i < sizes[s]; i++) {
+      json_array_append_new(subjects, bench_subject(i));
+    }
+
+    uint64_t start = now_ns();
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_subscribe(client, subjects, 0, 0, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+    uint64_t elapsed_ns = now_ns() - start;
+
+    printf("%5zu subjects: %6ju ms, %5ju us/subject\n",
+        sizes[s], (uintmax_t) (elapsed_ns / 1000000), (uintmax_t) (elapsed_ns / sizes[s] / 1000));
+
+    json_decref(subjects);
+    cosmo_shutdown(client);
+  }
+}
+
+static size_t resident_bytes() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  assert(statm);
+  size_t size, resident;
+  assert(fscanf(statm, "%zu %zu", &size, &resident) == 2);
+  assert(!fclose(statm));
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Client memory per message held, from resident set growth as a subscription
+// loads a subject's history. Approximate: it includes allocator slack and any
+// transient buffers the mock server doesn't give back.
+static void bench_message_memory() {
+  const size_t sizes[] = {16, 1024};
+#define MEMORY_MESSAGES 10000
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+    cosmo_callbacks callbacks = {NULL};
+    cosmo_options options = {
+      .allow_http_loopback = true,
+      .max_batch_commands = 100,
+    };
+    cosmo *sender = cosmo_create(bench_base_url(), NULL, &callbacks, &options, NULL);
+    json_t *subject = bench_random_subject();
+    json_t *message = bench_payload(sizes[s]);
+    json_t **subjects = malloc(MEMORY_MESSAGES * sizeof(*subjects));
+    json_t **messages = malloc(MEMORY_MESSAGES * sizeof(*messages));
+    assert(subjects && messages);
+    for (size_t i = 0; i < MEMORY_MESSAGES; i++) {
+      subjects[i] = subject;
+      messages[i] = message;
+    }
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_send_messages(sender, MEMORY_MESSAGES, subjects, messages, promise_obj, NULL);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+    free(subjects);
+    free(messages);
+    cosmo_shutdown(sender);
+
+    cosmo *receiver = cosmo_create(bench_base_url(), NULL, &callbacks, &options, NULL);
+    size_t before = resident_bytes();
+    promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_subscribe(receiver, subject, -1, 0, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+    cosmo_stats stats;
+    do {
+      thrd_sleep(&(struct timespec) {.tv_nsec = 1000000}, NULL);
+      cosmo_get_stats(receiver, &stats);
+    } while (stats.messages < MEMORY_MESSAGES);
+    size_t after = resident_bytes();
+
+    printf("%5zu byte messages: %6zu bytes/message\n",
+        sizes[s], (after > before ? after - before : 0) / MEMORY_MESSAGES);
+
+    cosmo_shutdown(receiver);
+    json_decref(message);
+    json_decref(subject);
+  }
+}
+
+static atomic_size_t allocations;
+
+static void *counting_malloc(size_t size) {
+  atomic_fetch_add(&allocations, 1);
+  return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t size) {
+  atomic_fetch_add(&allocations, 1);
+  return realloc(ptr, size);
+}
+
+#define ALLOCATION_MESSAGES 1000
+#define ALLOCATION_INTERVAL_US 2000
+#define ALLOCATION_URL_SIZE 128
+
+// The other end of bench_allocations(), in a child process so that its
+// allocations don't count: a mock server, and a sender that fills the history
+// subject ('h', answered once it's done) or trickles into the live one ('l').
+static void bench_allocations_peer(int commands, int replies) {
+  mock_server *server = mock_server_create(NULL);
+  char url[ALLOCATION_URL_SIZE] = {0};
+  assert(strlen(mock_server_base_url(server)) < sizeof(url));
+  strcpy(url, mock_server_base_url(server));
+  assert(write(replies, url, sizeof(url)) == sizeof(url));
+
+  cosmo_callbacks callbacks = {NULL};
+  cosmo_options options = {
+    .allow_http_loopback = true,
+    .hanging_poll_ms = -1,
+    .max_batch_commands = 100,
+  };
+  cosmo *sender = cosmo_create(url, NULL, &callbacks, &options, NULL);
+  json_t *message = bench_payload(64);
+  char command;
+  while (read(commands, &command, 1) == 1) {
+    json_t *subject = cosmo_subject(command == 'h' ? "/bench/history" : "/bench/live", NULL, NULL);
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    if (command == 'h') {
+      json_t *subjects[ALLOCATION_MESSAGES], *messages[ALLOCATION_MESSAGES];
+      for (size_t i = 0; i < ALLOCATION_MESSAGES; i++) {
+        subjects[i] = subject;
+        messages[i] = message;
+      }
+      cosmo_send_messages(sender, ALLOCATION_MESSAGES, subjects, messages, promise_obj, NULL);
+    } else {
+      for (size_t i = 0; i < ALLOCATION_MESSAGES - 1; i++) {
+        cosmo_send_message(sender, subject, message, NULL);
+        thrd_sleep(&(struct timespec) {.tv_nsec = ALLOCATION_INTERVAL_US * 1000}, NULL);
+      }
+      cosmo_send_message(sender, subject, message, promise_obj);
+    }
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+    json_decref(subject);
+    assert(write(replies, &command, 1) == 1);
+  }
+
+  json_decref(message);
+  cosmo_shutdown(sender);
+  mock_server_destroy(server);
+}
+
+static void bench_allocations_await(cosmo *receiver, uint64_t messages) {
+  cosmo_stats stats;
+  do {
+    thrd_sleep(&(struct timespec) {.tv_nsec = 1000000}, NULL);
+    cosmo_get_stats(receiver, &stats);
+  } while (stats.messages < messages);
+}
+
+// Allocations (jansson's and the instance's own; not libcurl's) per message
+// delivered to a subscriber: a subject's history in bulk, and messages
+// arriving one per hanging poll, where each RPC's overhead counts in full.
+static void bench_allocations() {
+  int commands[2], replies[2];
+  assert(!pipe(commands) && !pipe(replies));
+  pid_t peer = fork();
+  assert(peer >= 0);
+  if (!peer) {
+    close(commands[1]);
+    close(replies[0]);
+    bench_allocations_peer(commands[0], replies[1]);
+    _exit(0);
+  }
+  close(commands[0]);
+  close(replies[1]);
+  char url[ALLOCATION_URL_SIZE];
+  assert(read(replies[0], url, sizeof(url)) == sizeof(url));
+
+  // Counting passes through to malloc(), so values from before can still be
+  // freed with free().
+  json_set_alloc_funcs(counting_malloc, free);
+  cosmo_callbacks callbacks = {NULL};
+  cosmo_options options = {
+    .allow_http_loopback = true,
+    .malloc_func = counting_malloc,
+    .realloc_func = counting_realloc,
+    .free_func = free,
+  };
+  cosmo *receiver = cosmo_create(url, NULL, &callbacks, &options, NULL);
+  char reply;
+
+  assert(write(commands[1], "h", 1) == 1);
+  assert(read(replies[0], &reply, 1) == 1);
+  json_t *subject = cosmo_subject("/bench/history", NULL, NULL);
+  atomic_store(&allocations, 0);
+  cosmo_subscribe(receiver, subject, -1, 0, NULL);
+  bench_allocations_await(receiver, ALLOCATION_MESSAGES);
+  printf("history: %6.1f allocations/message\n", (double) atomic_load(&allocations) / ALLOCATION_MESSAGES);
+  json_decref(subject);
+
+  subject = cosmo_subject("/bench/live", NULL, NULL);
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(receiver, subject, 0, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  atomic_store(&allocations, 0);
+  assert(write(commands[1], "l", 1) == 1);
+  bench_allocations_await(receiver, ALLOCATION_MESSAGES * 2);
+  printf("live:    %6.1f allocations/message\n", (double) atomic_load(&allocations) / ALLOCATION_MESSAGES);
+  assert(read(replies[0], &reply, 1) == 1);
+  json_decref(subject);
+
+  cosmo_shutdown(receiver);
+  json_set_alloc_funcs(malloc, free);
+  close(commands[1]);
+  close(replies[0]);
+  int status;
+  assert(waitpid(peer, &status, 0) == peer && WIFEXITED(status) && !WEXITSTATUS(status));
+}
+
+int main(int argc, char *argv[]) {
+  // Benchmarks that need a server use COSMO_BENCH_URL's, or an in-process mock.
+  if (!getenv("COSMO_BENCH_URL")) {
+    mock_server_options options = {
+      .latency_ms = bench_env("COSMO_BENCH_LATENCY_MS"),
+      .padding_bytes = bench_env("COSMO_BENCH_PADDING_BYTES"),
+    };
+    bench_server = mock_server_create(&options);
+  }
+
+  RUN_BENCH(bench_subscription_lookup);
+  RUN_BENCH(bench_message_store);
+  RUN_BENCH(bench_snapshot);
+  RUN_BENCH(bench_compression);
+  RUN_BENCH(bench_send_messages);
+  RUN_BENCH(bench_request_build);
+  RUN_BENCH(bench_journal);
+  RUN_BENCH(bench_batching);
+  RUN_BENCH(bench_resubscribe);
+  RUN_BENCH(bench_publish);
+  RUN_BENCH(bench_fan_in);
+  RUN_BENCH(bench_subscribe_scale);
+  RUN_BENCH(bench_message_memory);
+  RUN_BENCH(bench_allocations);
+
+  if (bench_server) {
+    mock_server_destroy(bench_server);
+  }
+  return 0;
+}
@@ -3,17 +3,251 @@
 
 #include <curl/curl.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <time.h>
 
 // Declarations that aren't in the public API but are available to the test suite.
 
+// The instance's options.malloc_func, realloc_func and free_func. Components
+// given NULL use malloc(), realloc() and free().
+struct cosmo_allocator {
+  void *(*malloc_func)(size_t);
+  void *(*realloc_func)(void *, size_t);
+  void (*free_func)(void *);
+};
+
+// Commands sent together under one promise, completed when the last is.
+struct cosmo_command_group {
+  size_t remaining;
+  bool failed;
+  promise *promise;
+};
+
 struct cosmo_command {
+  struct cosmo_command_slab *slab;
   struct cosmo_command *prev;
   struct cosmo_command *next;
   json_t *command;
   promise *promise;
+  struct cosmo_command_group *group;
+  // The command as it goes on the wire: encoded when first sent and reused on
+  // retries, unless the server changes how it takes message bodies.
+  char *encoded;
+  size_t encoded_len;
+  bool encoded_embedded;
+  size_t size;
+  uint64_t queued_ms;
+  uint64_t id;
+  // Where the command is recorded in the journal; SIZE_MAX if it isn't.
+  size_t journal_offset;
+};
+
+#define COMMAND_SLAB_SIZE 64
+
+// Command nodes are carved from slabs and recycled through each slab's free
+// list, so queueing a command doesn't usually cost an allocation. A slab whose
+// commands are all free is released, unless it's the only one with room.
+struct cosmo_command_slab {
+  struct cosmo_command_slab *prev;
+  struct cosmo_command_slab *next;
+  // Linked through next.
+  struct cosmo_command *free_commands;
+  size_t in_use;
+  struct cosmo_command commands[COMMAND_SLAB_SIZE];
+};
+
+struct cosmo_message {
+  json_int_t id;
+  json_t *event;
+};
+
+// Refcounted backing array for a message store. Snapshots share it with the
+// store: entries below a snapshot's length are never modified while the block
+// is shared, so in-order appends into spare capacity don't need a copy.
+struct cosmo_message_block {
+  atomic_size_t refcount;
+  // Kept here, since snapshots can outlive the instance.
+  void (*free_func)(void *);
+  size_t length;
+  size_t capacity;
+  struct cosmo_message messages[];
+};
+
+// Message history for one subject, kept sorted by id.
+struct cosmo_message_store {
+  const struct cosmo_allocator *allocator;
+  struct cosmo_message_block *block;
+};
+
+struct cosmo_snapshot {
+  void (*free_func)(void *);
+  struct cosmo_message_block *block;
+  size_t length;
+};
+
+void cosmo_message_store_init(struct cosmo_message_store *store, const struct cosmo_allocator *allocator);
+void cosmo_message_store_destroy(struct cosmo_message_store *store);
+bool cosmo_message_store_insert(struct cosmo_message_store *store, json_int_t id, json_t *event);
+bool cosmo_message_store_contains(const struct cosmo_message_store *store, json_int_t id);
+const struct cosmo_message *cosmo_message_store_last(const struct cosmo_message_store *store);
+cosmo_snapshot *cosmo_message_store_snapshot(const struct cosmo_message_store *store);
+
+struct cosmo_subscription {
+  json_t *subject;
+  char *key;
+  size_t key_len;
+  uint64_t hash;
+  int state;
+  struct cosmo_message_store messages;
+  json_int_t num_messages;
+  json_int_t last_id;
+  struct cosmo_journal *cache;
+  // Depth of history the cache holds (as cosmo_subscribe()'s messages), and
+  // how many messages it has now.
+  json_int_t cache_depth;
+  size_t cache_messages;
+  // Position among the subjects in the instance's message batch, if
+  // batch_generation matches the instance's.
+  uint64_t batch_generation;
+  size_t batch_group;
+};
+
+// A cache holding a limited depth of history is rewritten once it has more
+// than twice that many messages, and at least this many.
+#define CACHE_REWRITE_MIN_MESSAGES 64
+
+// Subjects by hash of their canonical key, as an open-addressed set; 0 marks an
+// empty slot. A collision can only make a command wait needlessly for another.
+struct cosmo_subject_set {
+  const struct cosmo_allocator *allocator;
+  uint64_t *slots;
+  size_t capacity;
+  size_t count;
+};
+
+// Open-addressed (linear probing) index of subscriptions by canonical subject key.
+struct cosmo_subscriptions {
+  const struct cosmo_allocator *allocator;
+  struct cosmo_subscription **slots;
+  size_t capacity;
+  size_t count;
+};
+
+void cosmo_subscriptions_init(struct cosmo_subscriptions *subscriptions, const struct cosmo_allocator *allocator);
+void cosmo_subscriptions_destroy(struct cosmo_subscriptions *subscriptions);
+struct cosmo_subscription *cosmo_subscriptions_find(const struct cosmo_subscriptions *subscriptions, const json_t *subject);
+struct cosmo_subscription *cosmo_subscriptions_add(struct cosmo_subscriptions *subscriptions, json_t *subject);
+void cosmo_subscriptions_remove(struct cosmo_subscriptions *subscriptions, const json_t *subject);
+
+// Append-only, mmap()ed record of commands queued but not yet acknowledged by
+// the server, for replay by the next instance after a crash or restart.
+struct cosmo_journal {
+  const struct cosmo_allocator *allocator;
+  char *path;
+  int fd;
+  char *map;
+  size_t capacity;
+  size_t length;
+  size_t pending;
+  // End of the acknowledged prefix: the first record still pending, if any.
+  size_t start;
+  // Appended bytes not yet synced to disk.
+  size_t dirty_start;
+  size_t dirty_end;
+};
+
+// Returns false if the file can't be opened, or another instance has it open.
+bool cosmo_journal_open(struct cosmo_journal *journal, const char *path, const struct cosmo_allocator *allocator);
+void cosmo_journal_close(struct cosmo_journal *journal);
+// Appends a command, returning its offset.
+size_t cosmo_journal_append(struct cosmo_journal *journal, const json_t *command);
+// Marks the command at offset acknowledged. Once all are, the journal empties.
+void cosmo_journal_complete(struct cosmo_journal *journal, size_t offset);
+void cosmo_journal_sync(struct cosmo_journal *journal);
+// Empties the journal and shrinks its file.
+void cosmo_journal_reset(struct cosmo_journal *journal);
+// Drops the acknowledged prefix once it's large, by rewriting the rest to a new
+// file. Returns how far the remaining records moved down (0 if they didn't);
+// their offsets must be adjusted by as much.
+size_t cosmo_journal_compact(struct cosmo_journal *journal);
+// Returns the first unacknowledged command at or after *offset, or NULL if
+// there are none. Sets *record_offset to its offset and moves *offset past it.
+json_t *cosmo_journal_next(const struct cosmo_journal *journal, size_t *offset, size_t *record_offset);
+
+// A callback or promise completion to run.
+struct cosmo_task {
+  void (*run)(cosmo *instance, struct cosmo_task *task);
+  promise *promise;
+  void *result;
+  promise_cleanup cleanup;
+  bool success;
+  uint64_t queued_ms;
+  // Of the command whose promise this completes, for options.trace; 0 if none.
+  uint64_t command_id;
+};
+
+struct cosmo_task_node {
+  struct cosmo_task_node *next;
+  struct cosmo_task task;
+};
+
+// Bounded ring of tasks from an instance's network thread (the only producer)
+// to its dispatch thread or executor (the only consumer). The network thread
+// mustn't wait on a consumer, so tasks that don't fit go on an unbounded
+// overflow list, and keep going there until the consumer takes it; it runs
+// them after the ring. The lock protects the list and is for sleeping on an
+// empty queue.
+struct cosmo_dispatcher {
+  struct cosmo_task *tasks;
+  size_t capacity;
+  atomic_size_t head;
+  atomic_size_t tail;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  atomic_bool consumer_waiting;
+  // Whether overflow_head is set, for checking without the lock.
+  atomic_bool overflowing;
+  struct cosmo_task_node *overflow_head;
+  struct cosmo_task_node *overflow_tail;
+  size_t overflow_length;
+  bool shutdown;
+  pthread_t thread;
+  // eventfd readable while the ring is non-empty, with dispatch_fd.
+  int event_fd;
+  atomic_size_t max_depth;
+  _Atomic uint64_t lag_ms;
+  _Atomic uint64_t max_lag_ms;
+};
+
+// Updated from any thread, so relaxed atomics; see cosmo_histogram.
+struct cosmo_histogram {
+  _Atomic uint64_t count;
+  _Atomic uint64_t total_us;
+  _Atomic uint64_t max_us;
+  _Atomic uint64_t buckets[COSMO_HISTOGRAM_BUCKETS];
+};
+
+// Protected by the instance lock, except the histograms.
+struct cosmo_counters {
+  uint64_t rpcs;
+  uint64_t rpc_failures;
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  uint64_t retries;
+  struct cosmo_histogram rpc_latency;
+  struct cosmo_histogram callback_time;
+  struct cosmo_histogram lock_wait;
+  struct cosmo_histogram lock_hold;
+  // When the instance lock was last taken.
+  uint64_t locked_us;
+};
+
+struct cosmo_batched_message {
+  size_t group;
+  json_int_t id;
+  json_t *event;
 };
 
 struct cosmo_get_profile {
@@ -21,12 +255,96 @@ struct cosmo_get_profile {
   promise *promise;
 };
 
+// Incremental scan of a response body for the top-level "events" array, so
+// each event can be handled as soon as it has arrived. Offsets are into
+// recv_buf.
+struct cosmo_event_scanner {
+  size_t pos;
+  int depth;
+  bool in_string;
+  bool escape;
+  size_t string_start;
+  // The last top-level string was "events", and then whether it was a key.
+  bool string_is_events;
+  bool last_key_is_events;
+  bool in_events;
+  size_t element_start;
+  size_t events_start;
+  size_t events_end;
+};
+
+typedef struct {
+  char *send_buf;
+  size_t send_buf_len;
+
+  // Kept across RPCs and grown geometrically.
+  char *recv_buf;
+  size_t recv_buf_len;
+  size_t recv_buf_capacity;
+  struct cosmo_event_scanner scanner;
+  bool streaming;
+
+  int64_t retry_after;
+  bool accepts_gzip;
+} cosmo_transfer;
+
+// One slot in an instance's window of RPCs, with its own easy handle.
+struct cosmo_rpc {
+  cosmo *instance;
+  CURL *curl;
+  bool in_flight;
+  bool hanging;
+  // Request bodies are built here, and the buffer kept for the next.
+  char *request_buf;
+  size_t request_buf_capacity;
+  // The compressed body, if any; freed when the RPC ends.
+  char *request;
+  struct cosmo_command *commands;
+  // The instance's messages_received when it started. Events are handled as
+  // the response streams in, so this tells whether it brought any.
+  uint64_t messages_received;
+  cosmo_transfer transfer;
+};
+
+// One reactor thread: a curl multi handle driving the RPCs of every instance
+// assigned to it.
+struct cosmo_loop_thread {
+  pthread_t thread;
+  CURLM *multi;
+  int wakeup_fds[2];
+
+  // Instances owned by the thread; only it touches this list.
+  cosmo *instances;
+
+  pthread_mutex_t lock;
+  // Protected by lock.
+  cosmo *attach_head;
+  bool shutdown;
+};
+
+struct cosmo_loop {
+  pthread_mutex_t lock;
+  size_t next_thread;
+  size_t num_threads;
+  struct cosmo_loop_thread threads[];
+};
+
 struct cosmo {
   char client_id[COSMO_UUID_SIZE];
   char instance_id[COSMO_UUID_SIZE];
   cosmo_callbacks callbacks;
   cosmo_options options;
+  struct cosmo_allocator allocator;
   void *passthrough;
+  struct cosmo_dispatcher *dispatcher;
+  struct cosmo_counters counters;
+
+  // New messages for the next messages_batch callback.
+  struct cosmo_batched_message *batch;
+  size_t batch_length;
+  size_t batch_capacity;
+  size_t batch_groups;
+  uint64_t batch_generation;
 
   pthread_mutex_t lock;
   pthread_cond_t cond;
@@ -34,11 +352,39 @@ struct cosmo {
   json_t *profile;
   struct cosmo_get_profile *get_profile_head;
   json_t *generation;
+  // Subjects the server takes per subscribe command; 0 if only one.
+  size_t max_subscribe_subjects;
+  uint64_t next_command_id;
+  // The command being completed, if any, for options.trace.
+  uint64_t completing_command_id;
   struct cosmo_command *command_queue_head;
   struct cosmo_command *command_queue_tail;
+  size_t command_queue_length;
+  size_t command_queue_bytes;
+  // Reused by cosmo_take_commands(): subjects later commands must wait on.
+  struct cosmo_subject_set blocked_subjects;
+  // Those with free commands first, then the full ones.
+  struct cosmo_command_slab *command_slabs;
+  struct cosmo_command_slab *command_slabs_tail;
+  // The request envelope up to its commands, and the instance ID it was
+  // encoded for.
+  char *envelope;
+  size_t envelope_len;
+  char envelope_instance_id[COSMO_UUID_SIZE];
+  struct cosmo_journal *journal;
   json_t *ack;
-  json_t *subscriptions;
+  // Subscription key -> highest event sequence number seen.
+  json_t *ack_cursors;
+  struct cosmo_subscriptions subscriptions;
   uint64_t next_delay_ms;
+  uint64_t next_rpc_ms;
+  uint64_t poll_interval_ms;
+  // New messages handled; RPCs that add to it count as activity.
+  uint64_t messages_received;
+  bool hanging_poll_supported;
+  bool embed_messages;
+  bool server_accepts_gzip;
+  struct curl_slist *gzip_headers;
   bool debug;
 
   enum {
@@ -46,7 +392,7 @@ struct cosmo {
     CONNECTED,
     DISCONNECTED,
   } connect_state;
-  struct timespec last_success;
+  uint64_t last_success_ms;
 
   enum {
     LOGIN_UNKNOWN,
@@ -54,8 +400,24 @@ struct cosmo {
     LOGGED_IN,
   } login_state;
 
-  pthread_t thread;
-  CURL *curl;
+  cosmo_loop *loop;
+  bool owns_loop;
+  struct cosmo_loop_thread *loop_thread;
+  cosmo *loop_next;
+  bool detached;
+
+  struct cosmo_rpc *rpcs;
+  size_t num_rpcs;
 };
 
+// gzip in into a new buffer. Returns its length; caller frees *out.
+size_t cosmo_gzip(const struct cosmo_allocator *allocator, const char *in, size_t in_len, char **out);
+
+// For tests; both take the instance lock.
+// Picks a new instance ID, so the server sees a new instance, as it does once
+// it's forgotten the old one.
+void cosmo_force_new_instance(cosmo *instance);
+// Command slabs currently allocated.
+size_t cosmo_command_slab_count(cosmo *instance);
+
 #endif
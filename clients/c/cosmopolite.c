@@ -1,3 +1,7 @@
+// For clock_gettime().
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -5,12 +9,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <uuid/uuid.h>
+#include <zlib.h>
 
 #include "cosmopolite.h"
 #include "cosmopolite-int.h"
@@ -20,22 +28,56 @@
 
 #define CYCLE_MS 10000
 #define CYCLE_STAGGER_FACTOR 10
+#define HANGING_POLL_MS 30000
+#define MIN_POLL_MS 1000
+#define MAX_POLL_MS 30000
+#define RECV_BUF_MIN_CAPACITY 4096
+#define COMPRESS_MIN_BYTES 1024
+// Larger receive and request buffers are freed after use instead of kept for
+// the next RPC.
+#define RECV_BUF_MAX_RETAINED (1024 * 1024)
+#define JOURNAL_MIN_CAPACITY (64 * 1024)
+#define JOURNAL_COMPACT_MIN_BYTES (64 * 1024)
+#define MESSAGE_BATCH_MIN_CAPACITY 64
 #define CONNECT_TIMEOUT_S 60
+#define DISPATCH_FD_QUEUE_SIZE 1024
+#define RESUBSCRIBE_MAX_SUBJECTS 256
 
 enum {
   SUBSCRIPTION_PENDING,
   SUBSCRIPTION_ACTIVE,
 };
 
-typedef struct {
-  char *send_buf;
-  size_t send_buf_len;
+#define MS_PER_S 1000
+#define US_PER_S 1000000
+#define NS_PER_MS 1000000
+#define NS_PER_US 1000
+
+static const struct cosmo_allocator cosmo_default_allocator = {malloc, realloc, free};
+
+static void *cosmo_alloc(const struct cosmo_allocator *allocator, size_t size) {
+  void *ptr = allocator->malloc_func(size);
+  assert(ptr);
+  return ptr;
+}
+
+static void *cosmo_zalloc(const struct cosmo_allocator *allocator, size_t size) {
+  void *ptr = cosmo_alloc(allocator, size);
+  memset(ptr, 0, size);
+  return ptr;
+}
 
-  char *recv_buf;
-  size_t recv_buf_len;
+static void *cosmo_realloc(const struct cosmo_allocator *allocator, void *ptr, size_t size) {
+  ptr = allocator->realloc_func(ptr, size);
+  assert(ptr);
+  return ptr;
+}
 
-  int64_t retry_after;
-} cosmo_transfer;
+static void cosmo_dealloc(const struct cosmo_allocator *allocator, void *ptr) {
+  if (ptr) {
+    allocator->free_func(ptr);
+  }
+}
 
 static int cosmo_random_fd = -1;
 
@@ -55,6 +97,54 @@ static uint64_t cosmo_random() {
   return ret;
 }
 
+static uint64_t cosmo_now_ms() {
+  struct timespec ts;
+  assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+  return (ts.tv_sec * MS_PER_S) + (ts.tv_nsec / NS_PER_MS);
+}
+
+static uint64_t cosmo_now_us() {
+  struct timespec ts;
+  assert(!clock_gettime(CLOCK_MONOTONIC, &ts));
+  return (ts.tv_sec * US_PER_S) + (ts.tv_nsec / NS_PER_US);
+}
+
+static void cosmo_histogram_add(struct cosmo_histogram *histogram, uint64_t us) {
+  size_t bucket = 0;
+  while (bucket < COSMO_HISTOGRAM_BUCKETS - 1 && us >> bucket) {
+    bucket++;
+  }
+  atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&histogram->total_us, us, memory_order_relaxed);
+  uint64_t max_us = atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+  while (us > max_us && !atomic_compare_exchange_weak_explicit(&histogram->max_us, &max_us, us, memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+static void cosmo_histogram_get(struct cosmo_histogram *histogram, cosmo_histogram *out) {
+  out->count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+  out->total_us = atomic_load_explicit(&histogram->total_us, memory_order_relaxed);
+  out->max_us = atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+  for (size_t i = 0; i < COSMO_HISTOGRAM_BUCKETS; i++) {
+    out->buckets[i] = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+  }
+}
+
+// pthread_mutex_lock() and pthread_mutex_unlock() of the instance lock, timed
+// for cosmo_get_stats().
+static void cosmo_lock(cosmo *instance) {
+  uint64_t start = cosmo_now_us();
+  assert(!pthread_mutex_lock(&instance->lock));
+  instance->counters.locked_us = cosmo_now_us();
+  cosmo_histogram_add(&instance->counters.lock_wait, instance->counters.locked_us - start);
+}
+
+static void cosmo_unlock(cosmo *instance) {
+  cosmo_histogram_add(&instance->counters.lock_hold, cosmo_now_us() - instance->counters.locked_us);
+  assert(!pthread_mutex_unlock(&instance->lock));
+}
+
 static void cosmo_log(cosmo *instance, const char *fmt, ...) {
   if (!instance->debug) {
     return;
@@ -70,6 +160,26 @@ static void cosmo_log(cosmo *instance, const char *fmt, ...) {
   va_end(ap);
 }
 
+static void cosmo_trace(cosmo *instance, cosmo_trace_stage stage, uint64_t command_id, const char *command, const char *sender_message_id) {
+  cosmo_trace_event event = {
+    .stage = stage,
+    .time_us = cosmo_now_us(),
+    .command_id = command_id,
+    .command = command,
+    .sender_message_id = sender_message_id,
+  };
+  instance->options.trace(&event, instance->passthrough);
+}
+
+static void cosmo_trace_command(cosmo *instance, cosmo_trace_stage stage, const struct cosmo_command *command) {
+  if (!instance->options.trace) {
+    return;
+  }
+  const char *name = json_string_value(json_object_get(command->command, "command"));
+  const char *sender_message_id = json_string_value(json_object_get(json_object_get(command->command, "arguments"), "sender_message_id"));
+  cosmo_trace(instance, stage, command->id, name, sender_message_id);
+}
+
 static void cosmo_append_command(struct cosmo_command **head, struct cosmo_command **tail, struct cosmo_command *command) {
   command->prev = *tail;
   if (command->prev) {
@@ -82,523 +192,2468 @@ static void cosmo_append_command(struct cosmo_command **head, struct cosmo_comma
   }
 }
 
-static json_t *cosmo_find_subscription(cosmo *instance, json_t *subject) {
-  size_t i;
-  json_t *subscription;
-  json_array_foreach(instance->subscriptions, i, subscription) {
-    if (json_equal(json_object_get(subscription, "subject"), subject)) {
-      return subscription;
-    }
-  }
-  return NULL;
+#define MESSAGE_STORE_MIN_CAPACITY 16
+
+static struct cosmo_message_block *cosmo_message_block_create(const struct cosmo_allocator *allocator, size_t capacity) {
+  struct cosmo_message_block *block = cosmo_alloc(allocator, sizeof(*block) + capacity * sizeof(*block->messages));
+  atomic_init(&block->refcount, 1);
+  block->free_func = allocator->free_func;
+  block->length = 0;
+  block->capacity = capacity;
+  return block;
 }
 
-void cosmo_remove_subscription(cosmo *instance, json_t *subject) {
-  size_t i;
-  json_t *subscription;
-  json_array_foreach(instance->subscriptions, i, subscription) {
-    if (json_equal(json_object_get(subscription, "subject"), subject)) {
-      json_array_remove(instance->subscriptions, i);
-      break;
-    }
+static void cosmo_message_block_decref(struct cosmo_message_block *block) {
+  if (!block || atomic_fetch_sub(&block->refcount, 1) != 1) {
+    return;
   }
+  // May run on a reader's thread; relies on jansson's atomic refcounting.
+  for (size_t i = 0; i < block->length; i++) {
+    json_decref(block->messages[i].event);
+  }
+  block->free_func(block);
 }
 
-static void cosmo_send_command_locked(cosmo *instance, json_t *command, promise *promise_obj) {
-  struct cosmo_command *command_obj = malloc(sizeof(*command_obj));
-  command_obj->command = command;
-  command_obj->promise = promise_obj;
-  cosmo_append_command(&instance->command_queue_head, &instance->command_queue_tail, command_obj);
-  instance->next_delay_ms = 0;
+void cosmo_message_store_init(struct cosmo_message_store *store, const struct cosmo_allocator *allocator) {
+  store->allocator = allocator ? allocator : &cosmo_default_allocator;
+  store->block = NULL;
 }
 
-// Takes ownership of command.
-static void cosmo_send_command(cosmo *instance, json_t *command, promise *promise_obj) {
-  assert(command);
-  assert(!pthread_mutex_lock(&instance->lock));
-  cosmo_send_command_locked(instance, command, promise_obj);
-  assert(!pthread_cond_signal(&instance->cond));
-  assert(!pthread_mutex_unlock(&instance->lock));
+void cosmo_message_store_destroy(struct cosmo_message_store *store) {
+  cosmo_message_block_decref(store->block);
+  store->block = NULL;
 }
 
-static size_t cosmo_read_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
-  cosmo_transfer *transfer = userp;
-  size_t to_write = min(transfer->send_buf_len, size * nmemb);
-  memcpy(ptr, transfer->send_buf, to_write);
-  transfer->send_buf += to_write;
-  transfer->send_buf_len -= to_write;
-  return to_write;
+static size_t cosmo_message_store_length(const struct cosmo_message_store *store) {
+  return store->block ? store->block->length : 0;
 }
 
-static size_t cosmo_write_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
-  cosmo_transfer *transfer = userp;
-  size_t to_read = size * nmemb;
-  transfer->recv_buf = realloc(transfer->recv_buf, transfer->recv_buf_len + to_read + 1);
-  assert(transfer->recv_buf);
-  memcpy(transfer->recv_buf + transfer->recv_buf_len, ptr, to_read);
-  transfer->recv_buf_len += to_read;
-  transfer->recv_buf[transfer->recv_buf_len] = '\0';
-  return to_read;
+// Index of the first message with id >= the given id.
+static size_t cosmo_message_store_search(const struct cosmo_message_store *store, json_int_t id) {
+  size_t low = 0, high = cosmo_message_store_length(store);
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (store->block->messages[mid].id < id) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
 }
 
-static size_t cosmo_header_callback(char *ptr, size_t size, size_t nmemb, void *userp) {
-  cosmo_transfer *transfer = userp;
-  size_t length = size * nmemb;
-#define RETRY_AFTER_HEADER "Retry-After: 0\r\n"
-#define RETRY_AFTER_HEADER_SIZE (sizeof(RETRY_AFTER_HEADER) - 1)
-  if (length == RETRY_AFTER_HEADER_SIZE &&
-      strncasecmp(ptr, RETRY_AFTER_HEADER, RETRY_AFTER_HEADER_SIZE) == 0) {
-    transfer->retry_after = 0;
+// Replace a shared (or full) block with a private one, copying message
+// pointers but not message bodies.
+static void cosmo_message_store_unshare(struct cosmo_message_store *store, size_t capacity) {
+  struct cosmo_message_block *old_block = store->block;
+  struct cosmo_message_block *block = cosmo_message_block_create(store->allocator, capacity);
+  for (size_t i = 0; i < old_block->length; i++) {
+    block->messages[i] = old_block->messages[i];
+    json_incref(block->messages[i].event);
   }
-  return length;
+  block->length = old_block->length;
+  store->block = block;
+  cosmo_message_block_decref(old_block);
 }
 
-static char *cosmo_build_rpc(const cosmo *instance, const json_t *commands) {
-  json_t *to_send = json_pack("{sssssO}", "client_id", instance->client_id, "instance_id", instance->instance_id, "commands", commands);
-  assert(to_send);
-  char *ret = json_dumps(to_send, 0);
-  assert(ret);
-  json_decref(to_send);
-  return ret;
+// Takes a reference to event on success; returns false for a duplicate id.
+bool cosmo_message_store_insert(struct cosmo_message_store *store, json_int_t id, json_t *event) {
+  size_t length = cosmo_message_store_length(store);
+  size_t index;
+  if (!length || store->block->messages[length - 1].id < id) {
+    // Common case: in-order delivery.
+    index = length;
+  } else {
+    index = cosmo_message_store_search(store, id);
+    if (store->block->messages[index].id == id) {
+      return false;
+    }
+  }
+
+  if (!store->block) {
+    store->block = cosmo_message_block_create(store->allocator, MESSAGE_STORE_MIN_CAPACITY);
+  } else if (length == store->block->capacity) {
+    if (atomic_load(&store->block->refcount) > 1) {
+      cosmo_message_store_unshare(store, length * 2);
+    } else {
+      store->block = cosmo_realloc(store->allocator, store->block, sizeof(*store->block) + length * 2 * sizeof(*store->block->messages));
+      store->block->capacity = length * 2;
+    }
+  } else if (index < length && atomic_load(&store->block->refcount) > 1) {
+    // Shifting would rewrite entries that a snapshot can see.
+    cosmo_message_store_unshare(store, store->block->capacity);
+  }
+
+  struct cosmo_message *messages = store->block->messages;
+  memmove(&messages[index + 1], &messages[index], (length - index) * sizeof(*messages));
+  json_incref(event);
+  messages[index].id = id;
+  messages[index].event = event;
+  store->block->length++;
+  return true;
 }
 
-static bool cosmo_send_http_int(cosmo *instance, cosmo_transfer *transfer) {
-  CURLcode res;
- 
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_POSTFIELDSIZE, transfer->send_buf_len));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_READDATA, transfer));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_WRITEDATA, transfer));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_HEADERDATA, transfer));
+bool cosmo_message_store_contains(const struct cosmo_message_store *store, json_int_t id) {
+  size_t index = cosmo_message_store_search(store, id);
+  return index < cosmo_message_store_length(store) && store->block->messages[index].id == id;
+}
 
-  assert(!pthread_mutex_unlock(&instance->lock));
-  res = curl_easy_perform(instance->curl);
-  assert(!pthread_mutex_lock(&instance->lock));
+const struct cosmo_message *cosmo_message_store_last(const struct cosmo_message_store *store) {
+  size_t length = cosmo_message_store_length(store);
+  return length ? &store->block->messages[length - 1] : NULL;
+}
 
-  if (res) {
-    return false;
+cosmo_snapshot *cosmo_message_store_snapshot(const struct cosmo_message_store *store) {
+  cosmo_snapshot *snapshot = cosmo_alloc(store->allocator, sizeof(*snapshot));
+  snapshot->free_func = store->allocator->free_func;
+  snapshot->block = store->block;
+  snapshot->length = cosmo_message_store_length(store);
+  if (snapshot->block) {
+    atomic_fetch_add(&snapshot->block->refcount, 1);
   }
+  return snapshot;
+}
 
-  long return_code;
-  assert(curl_easy_getinfo(instance->curl, CURLINFO_RESPONSE_CODE, &return_code) == CURLE_OK);
-  if (return_code != 200) {
-    return false;
+#define SUBSCRIPTIONS_MIN_CAPACITY 16
+// Grow when more than 3/4 full.
+#define SUBSCRIPTIONS_LOAD_NUM 3
+#define SUBSCRIPTIONS_LOAD_DEN 4
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+
+// FNV-1a, continued over more of the key.
+static uint64_t cosmo_hash_update(uint64_t hash, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char) data[i];
+    hash *= 1099511628211ULL;
   }
+  return hash;
+}
 
-  return true;
+#define SUBJECT_KEY_FIELDS 3
+// Keys up to this long are built on the stack for lookups.
+#define SUBJECT_KEY_STACK_SIZE 256
+
+// Canonical identity of a subject: length-prefixed name, readable_only_by and
+// writeable_only_by, with "-" for any that's absent (distinct from an empty
+// string). Writes it to key and its hash to hash, for those that aren't NULL,
+// and returns its length.
+static size_t cosmo_subject_key(const json_t *subject, char *key, uint64_t *hash) {
+  static const char *const fields[SUBJECT_KEY_FIELDS] = {"name", "readable_only_by", "writeable_only_by"};
+  size_t key_len = 0;
+  uint64_t key_hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < SUBJECT_KEY_FIELDS; i++) {
+    const char *value = json_string_value(json_object_get(subject, fields[i]));
+    if (!value) {
+      if (key) {
+        key[key_len] = '-';
+      }
+      key_hash = cosmo_hash_update(key_hash, "-", 1);
+      key_len++;
+      continue;
+    }
+    size_t value_len = strlen(value);
+    char prefix[32];
+    int prefix_len = sprintf(prefix, "%zu:", value_len);
+    if (key) {
+      memcpy(key + key_len, prefix, prefix_len);
+      memcpy(key + key_len + prefix_len, value, value_len);
+    }
+    key_hash = cosmo_hash_update(cosmo_hash_update(key_hash, prefix, prefix_len), value, value_len);
+    key_len += prefix_len + value_len;
+  }
+  if (hash) {
+    *hash = key_hash;
+  }
+  return key_len;
 }
 
-// Takes ownership of request.
-static char *cosmo_send_http(cosmo *instance, char *request) {
-  cosmo_transfer transfer = {
-    .send_buf = request,
-    .send_buf_len = strlen(request),
-    .recv_buf = NULL,
-    .recv_buf_len = 0,
-    .retry_after = -1
-  };
 
-  int ret = cosmo_send_http_int(instance, &transfer);
+// Returns the slot holding key, or the empty slot where it would be inserted.
+static size_t cosmo_subscriptions_probe(const struct cosmo_subscriptions *subscriptions, const char *key, size_t key_len, uint64_t hash) {
+  size_t mask = subscriptions->capacity - 1;
+  size_t i = hash & mask;
+  while (subscriptions->slots[i]) {
+    struct cosmo_subscription *subscription = subscriptions->slots[i];
+    if (subscription->hash == hash &&
+        subscription->key_len == key_len &&
+        !memcmp(subscription->key, key, key_len)) {
+      break;
+    }
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static void cosmo_subscriptions_resize(struct cosmo_subscriptions *subscriptions, size_t capacity) {
+  struct cosmo_subscription **old_slots = subscriptions->slots;
+  size_t old_capacity = subscriptions->capacity;
 
-  if (transfer.retry_after >= 0) {
-    instance->next_delay_ms = transfer.retry_after * 1000;
+  subscriptions->slots = cosmo_zalloc(subscriptions->allocator, capacity * sizeof(*subscriptions->slots));
+  subscriptions->capacity = capacity;
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    struct cosmo_subscription *subscription = old_slots[i];
+    if (subscription) {
+      size_t slot = cosmo_subscriptions_probe(subscriptions, subscription->key, subscription->key_len, subscription->hash);
+      subscriptions->slots[slot] = subscription;
+    }
   }
+  cosmo_dealloc(subscriptions->allocator, old_slots);
+}
 
-  free(request);
+static void cosmo_subscription_free(const struct cosmo_subscriptions *subscriptions, struct cosmo_subscription *subscription) {
+  if (subscription->cache) {
+    cosmo_journal_close(subscription->cache);
+    cosmo_dealloc(subscriptions->allocator, subscription->cache);
+  }
+  json_decref(subscription->subject);
+  cosmo_message_store_destroy(&subscription->messages);
+  cosmo_dealloc(subscriptions->allocator, subscription->key);
+  cosmo_dealloc(subscriptions->allocator, subscription);
+}
 
-  return ret ? transfer.recv_buf : NULL;
+void cosmo_subscriptions_init(struct cosmo_subscriptions *subscriptions, const struct cosmo_allocator *allocator) {
+  subscriptions->allocator = allocator ? allocator : &cosmo_default_allocator;
+  subscriptions->slots = NULL;
+  subscriptions->capacity = 0;
+  subscriptions->count = 0;
+  cosmo_subscriptions_resize(subscriptions, SUBSCRIPTIONS_MIN_CAPACITY);
 }
 
-static void cosmo_handle_message(cosmo *instance, json_t *event) {
-  json_t *subject;
-  int id;
-  char *message_content;
-  if (json_unpack(event, "{sosiss}", "subject", &subject, "id", &id, "message", &message_content)) {
-    cosmo_log(instance, "invalid message event");
-    return;
+void cosmo_subscriptions_destroy(struct cosmo_subscriptions *subscriptions) {
+  for (size_t i = 0; i < subscriptions->capacity; i++) {
+    if (subscriptions->slots[i]) {
+      cosmo_subscription_free(subscriptions, subscriptions->slots[i]);
+    }
   }
+  cosmo_dealloc(subscriptions->allocator, subscriptions->slots);
+  subscriptions->slots = NULL;
+  subscriptions->capacity = subscriptions->count = 0;
+}
 
-  json_error_t err;
-  json_t *message_object = json_loads(message_content, JSON_DECODE_ANY, &err);
-  if (!message_object) {
-    cosmo_log(instance, "error parsing message content: %s", err.text);
-    return;
+// Where subject is, or would go. Its key only touches the heap if it's long.
+static size_t cosmo_subscriptions_find_slot(const struct cosmo_subscriptions *subscriptions, const json_t *subject) {
+  char stack_key[SUBJECT_KEY_STACK_SIZE];
+  uint64_t hash;
+  size_t key_len = cosmo_subject_key(subject, NULL, &hash);
+  char *key = key_len <= sizeof(stack_key) ? stack_key : cosmo_alloc(subscriptions->allocator, key_len);
+  cosmo_subject_key(subject, key, NULL);
+  size_t slot = cosmo_subscriptions_probe(subscriptions, key, key_len, hash);
+  if (key != stack_key) {
+    cosmo_dealloc(subscriptions->allocator, key);
   }
-  json_object_set_new(event, "message", message_object);
+  return slot;
+}
 
-  json_t *subscription = cosmo_find_subscription(instance, subject);
-  if (!subscription) {
-    cosmo_log(instance, "message from unknown subject");
+struct cosmo_subscription *cosmo_subscriptions_find(const struct cosmo_subscriptions *subscriptions, const json_t *subject) {
+  return subscriptions->slots[cosmo_subscriptions_find_slot(subscriptions, subject)];
+}
+
+// Caller must check that subject isn't already present.
+struct cosmo_subscription *cosmo_subscriptions_add(struct cosmo_subscriptions *subscriptions, json_t *subject) {
+  if ((subscriptions->count + 1) * SUBSCRIPTIONS_LOAD_DEN > subscriptions->capacity * SUBSCRIPTIONS_LOAD_NUM) {
+    cosmo_subscriptions_resize(subscriptions, subscriptions->capacity * 2);
+  }
+
+  struct cosmo_subscription *subscription = cosmo_alloc(subscriptions->allocator, sizeof(*subscription));
+  json_incref(subject);
+  subscription->subject = subject;
+  subscription->key_len = cosmo_subject_key(subject, NULL, &subscription->hash);
+  // Never empty: each field contributes at least "-".
+  subscription->key = cosmo_alloc(subscriptions->allocator, subscription->key_len);
+  cosmo_subject_key(subject, subscription->key, NULL);
+  subscription->state = SUBSCRIPTION_PENDING;
+  cosmo_message_store_init(&subscription->messages, subscriptions->allocator);
+  subscription->num_messages = 0;
+  subscription->last_id = 0;
+  subscription->cache = NULL;
+  subscription->batch_generation = 0;
+
+  size_t slot = cosmo_subscriptions_probe(subscriptions, subscription->key, subscription->key_len, subscription->hash);
+  assert(!subscriptions->slots[slot]);
+  subscriptions->slots[slot] = subscription;
+  subscriptions->count++;
+  return subscription;
+}
+
+void cosmo_subscriptions_remove(struct cosmo_subscriptions *subscriptions, const json_t *subject) {
+  size_t slot = cosmo_subscriptions_find_slot(subscriptions, subject);
+  if (!subscriptions->slots[slot]) {
     return;
   }
 
-  json_t *messages = json_object_get(subscription, "messages");
-  ssize_t insert_after;
-  for (insert_after = json_array_size(messages) - 1; insert_after >= 0; insert_after--) {
-    json_t *message = json_array_get(messages, insert_after);
-    json_int_t message_id = json_integer_value(json_object_get(message, "id"));
-    if (message_id == id) {
-      return;
-    }
-    if (message_id < id) {
-      break;
+  cosmo_subscription_free(subscriptions, subscriptions->slots[slot]);
+  subscriptions->slots[slot] = NULL;
+  subscriptions->count--;
+
+  // Backward-shift deletion: pull later members of the probe run into the
+  // hole so lookups never need tombstones.
+  size_t mask = subscriptions->capacity - 1;
+  size_t hole = slot;
+  for (size_t i = (slot + 1) & mask; subscriptions->slots[i]; i = (i + 1) & mask) {
+    size_t home = subscriptions->slots[i]->hash & mask;
+    if (((i - home) & mask) >= ((i - hole) & mask)) {
+      subscriptions->slots[hole] = subscriptions->slots[i];
+      subscriptions->slots[i] = NULL;
+      hole = i;
     }
   }
-  json_array_insert(messages, insert_after + 1, event);
+}
 
-  if (instance->callbacks.message) {
-    cosmo_log(instance, "callbacks.message()");
-    assert(!pthread_mutex_unlock(&instance->lock));
-    instance->callbacks.message(event, instance->passthrough);
-    assert(!pthread_mutex_lock(&instance->lock));
+static void cosmo_loop_wakeup(struct cosmo_loop_thread *loop_thread) {
+  char c = 0;
+  if (write(loop_thread->wakeup_fds[1], &c, 1) < 0) {
+    // A full pipe already guarantees a wakeup.
+    assert(errno == EAGAIN);
   }
 }
 
-static void cosmo_handle_client_id_change(cosmo *instance) {
-  if (instance->callbacks.client_id_change) {
-    cosmo_log(instance, "callbacks.client_id_change()");
-    assert(!pthread_mutex_unlock(&instance->lock));
-    instance->callbacks.client_id_change(instance->passthrough, instance->client_id);
-    assert(!pthread_mutex_lock(&instance->lock));
+// Whether the queue already holds a full batch, so lingering can't grow it.
+static bool cosmo_batch_full(const cosmo *instance) {
+  return (instance->options.max_batch_commands && instance->command_queue_length >= instance->options.max_batch_commands) ||
+         (instance->options.max_batch_bytes && instance->command_queue_bytes >= instance->options.max_batch_bytes);
+}
+
+// The journal is a sequence of records, each a header and then the command's
+// JSON text padded to the header's alignment. A zero length ends it.
+struct cosmo_journal_record {
+  uint32_t length;
+  uint32_t crc;
+  uint32_t done;
+};
+
+static size_t cosmo_journal_record_size(uint32_t length) {
+  size_t align = _Alignof(struct cosmo_journal_record);
+  return sizeof(struct cosmo_journal_record) + (length + align - 1) / align * align;
+}
+
+static struct cosmo_journal_record *cosmo_journal_record(const struct cosmo_journal *journal, size_t offset) {
+  return (struct cosmo_journal_record *) (journal->map + offset);
+}
+
+// Whether a complete, intact record starts at offset. A crash can leave a
+// torn record at the end; it and anything after it are ignored.
+static bool cosmo_journal_valid(const struct cosmo_journal *journal, size_t offset) {
+  if (offset + sizeof(struct cosmo_journal_record) > journal->capacity) {
+    return false;
   }
+  struct cosmo_journal_record *record = cosmo_journal_record(journal, offset);
+  return record->length &&
+         offset + cosmo_journal_record_size(record->length) <= journal->capacity &&
+         crc32(0, (const Bytef *) (record + 1), record->length) == record->crc;
 }
 
-static void cosmo_handle_connect(cosmo *instance) {
-  if (instance->connect_state == CONNECTED) {
-    return;
+static void cosmo_journal_map(struct cosmo_journal *journal, size_t capacity) {
+  if (journal->map) {
+    assert(!munmap(journal->map, journal->capacity));
   }
-  instance->connect_state = CONNECTED;
-  if (instance->callbacks.connect) {
-    cosmo_log(instance, "callbacks.connect()");
-    assert(!pthread_mutex_unlock(&instance->lock));
-    instance->callbacks.connect(instance->passthrough);
-    assert(!pthread_mutex_lock(&instance->lock));
+  struct stat st;
+  assert(!fstat(journal->fd, &st));
+  if ((size_t) st.st_size < capacity) {
+    // Extend the file by writing its last byte; the rest reads as zeros.
+    assert(lseek(journal->fd, capacity - 1, SEEK_SET) == (off_t) capacity - 1);
+    assert(write(journal->fd, "", 1) == 1);
   }
+  journal->capacity = capacity;
+  journal->map = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, journal->fd, 0);
+  assert(journal->map != MAP_FAILED);
 }
 
-static void cosmo_handle_disconnect(cosmo *instance) {
-  if (instance->connect_state == DISCONNECTED) {
-    return;
+bool cosmo_journal_open(struct cosmo_journal *journal, const char *path, const struct cosmo_allocator *allocator) {
+  journal->allocator = allocator ? allocator : &cosmo_default_allocator;
+  journal->fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (journal->fd < 0) {
+    return false;
   }
-  instance->connect_state = DISCONNECTED;
-  if (instance->callbacks.disconnect) {
-    cosmo_log(instance, "callbacks.disconnect()");
-    assert(!pthread_mutex_unlock(&instance->lock));
-    instance->callbacks.disconnect(instance->passthrough);
-    assert(!pthread_mutex_lock(&instance->lock));
+  if (flock(journal->fd, LOCK_EX | LOCK_NB)) {
+    assert(errno == EWOULDBLOCK);
+    assert(!close(journal->fd));
+    return false;
+  }
+  size_t path_size = strlen(path) + 1;
+  journal->path = cosmo_alloc(journal->allocator, path_size);
+  memcpy(journal->path, path, path_size);
+  struct stat st;
+  assert(!fstat(journal->fd, &st));
+  journal->map = NULL;
+  cosmo_journal_map(journal, max((size_t) st.st_size, JOURNAL_MIN_CAPACITY));
+
+  journal->length = journal->pending = 0;
+  journal->start = SIZE_MAX;
+  while (cosmo_journal_valid(journal, journal->length)) {
+    struct cosmo_journal_record *record = cosmo_journal_record(journal, journal->length);
+    if (!record->done && journal->start == SIZE_MAX) {
+      journal->start = journal->length;
+    }
+    journal->pending += !record->done;
+    journal->length += cosmo_journal_record_size(record->length);
   }
+  journal->start = min(journal->start, journal->length);
+  journal->dirty_start = journal->dirty_end = 0;
+  return true;
 }
 
-static void cosmo_handle_login(cosmo *instance, json_t *event) {
-  if (instance->login_state == LOGGED_IN) {
+void cosmo_journal_close(struct cosmo_journal *journal) {
+  assert(!msync(journal->map, journal->capacity, MS_SYNC));
+  assert(!munmap(journal->map, journal->capacity));
+  assert(!close(journal->fd));
+  cosmo_dealloc(journal->allocator, journal->path);
+}
+
+json_t *cosmo_journal_next(const struct cosmo_journal *journal, size_t *offset, size_t *record_offset) {
+  while (*offset < journal->length) {
+    struct cosmo_journal_record *record = cosmo_journal_record(journal, *offset);
+    *record_offset = *offset;
+    *offset += cosmo_journal_record_size(record->length);
+    if (!record->done) {
+      json_t *command = json_loadb((const char *) (record + 1), record->length, 0, NULL);
+      assert(command);
+      return command;
+    }
+  }
+  return NULL;
+}
+
+size_t cosmo_journal_append(struct cosmo_journal *journal, const json_t *command) {
+  size_t length = json_dumpb(command, NULL, 0, JSON_COMPACT);
+  assert(length && length <= UINT32_MAX);
+  size_t offset = journal->length;
+  size_t record_size = cosmo_journal_record_size(length);
+  // Leave room for the terminator after the record.
+  size_t needed = offset + record_size + sizeof(struct cosmo_journal_record);
+  if (needed > journal->capacity) {
+    size_t capacity = journal->capacity * 2;
+    while (capacity < needed) {
+      capacity *= 2;
+    }
+    cosmo_journal_map(journal, capacity);
+  }
+
+  // Terminate first and fill in the header last, so that a torn write fails
+  // its CRC rather than running into stale records.
+  memset(cosmo_journal_record(journal, offset + record_size), 0, sizeof(struct cosmo_journal_record));
+  struct cosmo_journal_record *record = cosmo_journal_record(journal, offset);
+  assert(json_dumpb(command, (char *) (record + 1), length, JSON_COMPACT) == length);
+  record->done = 0;
+  record->crc = crc32(0, (const Bytef *) (record + 1), length);
+  record->length = length;
+
+  if (journal->dirty_start == journal->dirty_end) {
+    journal->dirty_start = offset;
+    journal->dirty_end = needed;
+  } else {
+    journal->dirty_start = min(journal->dirty_start, offset);
+    journal->dirty_end = max(journal->dirty_end, needed);
+  }
+  journal->length += record_size;
+  journal->pending++;
+  return offset;
+}
+
+void cosmo_journal_complete(struct cosmo_journal *journal, size_t offset) {
+  cosmo_journal_record(journal, offset)->done = 1;
+  if (--journal->pending) {
+    while (journal->start < journal->length && cosmo_journal_record(journal, journal->start)->done) {
+      journal->start += cosmo_journal_record_size(cosmo_journal_record(journal, journal->start)->length);
+    }
     return;
   }
-  instance->login_state = LOGGED_IN;
-  if (instance->callbacks.login) {
-    cosmo_log(instance, "callbacks.login()");
-    assert(!pthread_mutex_unlock(&instance->lock));
-    instance->callbacks.login(instance->passthrough);
-    assert(!pthread_mutex_lock(&instance->lock));
+  // Everything is acknowledged; start over from the top.
+  memset(cosmo_journal_record(journal, 0), 0, sizeof(struct cosmo_journal_record));
+  journal->length = journal->start = 0;
+}
+
+void cosmo_journal_reset(struct cosmo_journal *journal) {
+  assert(!munmap(journal->map, journal->capacity));
+  journal->map = NULL;
+  assert(!ftruncate(journal->fd, 0));
+  cosmo_journal_map(journal, JOURNAL_MIN_CAPACITY);
+  journal->length = journal->pending = journal->start = 0;
+  journal->dirty_start = journal->dirty_end = 0;
+}
+
+size_t cosmo_journal_compact(struct cosmo_journal *journal) {
+  // Only once copying the rest costs no more than the prefix it frees.
+  size_t moved = journal->start;
+  if (moved < JOURNAL_COMPACT_MIN_BYTES || moved < journal->length - moved) {
+    return 0;
+  }
+
+  // Written in full and synced before it replaces the old file, so that a
+  // crash leaves one or the other intact.
+  char tmp_path[strlen(journal->path) + 5];
+  sprintf(tmp_path, "%s.tmp", journal->path);
+  int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  assert(fd >= 0);
+  assert(!flock(fd, LOCK_EX | LOCK_NB));
+
+  int old_fd = journal->fd;
+  char *old_map = journal->map;
+  size_t old_capacity = journal->capacity;
+  size_t length = journal->length - moved;
+  size_t capacity = JOURNAL_MIN_CAPACITY;
+  while (capacity < length + sizeof(struct cosmo_journal_record)) {
+    capacity *= 2;
   }
+  journal->fd = fd;
+  journal->map = NULL;
+  cosmo_journal_map(journal, capacity);
+  memcpy(journal->map, old_map + moved, length);
+  memset(cosmo_journal_record(journal, length), 0, sizeof(struct cosmo_journal_record));
+  assert(!msync(journal->map, length + sizeof(struct cosmo_journal_record), MS_SYNC));
+  assert(!rename(tmp_path, journal->path));
+
+  assert(!munmap(old_map, old_capacity));
+  assert(!close(old_fd));
+  journal->length = length;
+  journal->start = 0;
+  journal->dirty_start = journal->dirty_end = 0;
+  return moved;
 }
 
-static void cosmo_handle_logout(cosmo *instance, json_t *event) {
-  if (instance->login_state == LOGGED_OUT) {
+void cosmo_journal_sync(struct cosmo_journal *journal) {
+  if (journal->dirty_start == journal->dirty_end) {
     return;
   }
-  instance->login_state = LOGGED_OUT;
-  if (instance->callbacks.logout) {
-    cosmo_log(instance, "callbacks.logout()");
-    assert(!pthread_mutex_unlock(&instance->lock));
-    instance->callbacks.logout(instance->passthrough);
-    assert(!pthread_mutex_lock(&instance->lock));
+  // msync() wants a page-aligned start.
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t start = journal->dirty_start / page_size * page_size;
+  assert(!msync(journal->map + start, journal->dirty_end - start, MS_SYNC));
+  journal->dirty_start = journal->dirty_end = 0;
+}
+
+// Strings jansson allocated, like json_dumps()'s, go back through whatever
+// allocator it was given.
+static void cosmo_json_free(void *ptr) {
+  json_free_t free_func;
+  json_get_alloc_funcs(NULL, &free_func);
+  if (ptr) {
+    free_func(ptr);
   }
 }
 
-static void cosmo_handle_event(cosmo *instance, json_t *event) {
-  json_t *event_id = json_object_get(event, "event_id");
-  if (event_id) {
-    json_array_append(instance->ack, event_id);
+static void cosmo_command_slab_unlink(cosmo *instance, struct cosmo_command_slab *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    instance->command_slabs = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  } else {
+    instance->command_slabs_tail = slab->prev;
   }
+}
 
-  const char *event_type = json_string_value(json_object_get(event, "event_type"));
-  if (!strcmp(event_type, "message")) {
-    cosmo_handle_message(instance, event);
-  } else if (!strcmp(event_type, "login")) {
-    cosmo_handle_login(instance, event);
-  } else if (!strcmp(event_type, "logout")) {
-    cosmo_handle_logout(instance, event);
+static void cosmo_command_slab_push_front(cosmo *instance, struct cosmo_command_slab *slab) {
+  slab->prev = NULL;
+  slab->next = instance->command_slabs;
+  if (slab->next) {
+    slab->next->prev = slab;
   } else {
-    cosmo_log(instance, "unknown event type: %s", event_type);
+    instance->command_slabs_tail = slab;
   }
+  instance->command_slabs = slab;
 }
 
-static void cosmo_complete_subscribe(cosmo *instance, struct cosmo_command *command, json_t *response, char *result) {
-  json_t *subject;
-  assert(!json_unpack(command->command, "{s{so}}", "arguments", "subject", &subject));
+static void cosmo_command_slab_push_back(cosmo *instance, struct cosmo_command_slab *slab) {
+  slab->next = NULL;
+  slab->prev = instance->command_slabs_tail;
+  if (slab->prev) {
+    slab->prev->next = slab;
+  } else {
+    instance->command_slabs = slab;
+  }
+  instance->command_slabs_tail = slab;
+}
 
-  if (strcmp(result, "ok")) {
-    cosmo_remove_subscription(instance, subject);
-    assert(!pthread_mutex_unlock(&instance->lock));
-    promise_fail(command->promise, NULL, NULL);
-    assert(!pthread_mutex_lock(&instance->lock));
-    return;
+static struct cosmo_command *cosmo_command_alloc(cosmo *instance) {
+  struct cosmo_command_slab *slab = instance->command_slabs;
+  if (!slab || !slab->free_commands) {
+    slab = cosmo_alloc(&instance->allocator, sizeof(*slab));
+    slab->free_commands = NULL;
+    slab->in_use = 0;
+    for (size_t i = 0; i < COMMAND_SLAB_SIZE; i++) {
+      slab->commands[i].slab = slab;
+      slab->commands[i].next = slab->free_commands;
+      slab->free_commands = &slab->commands[i];
+    }
+    cosmo_command_slab_push_front(instance, slab);
+  }
+  struct cosmo_command *command = slab->free_commands;
+  slab->free_commands = command->next;
+  if (++slab->in_use == COMMAND_SLAB_SIZE) {
+    cosmo_command_slab_unlink(instance, slab);
+    cosmo_command_slab_push_back(instance, slab);
   }
+  return command;
+}
 
-  json_t *subscription = cosmo_find_subscription(instance, subject);
-  if (subscription) {
-    // Might have unsubscribed later
-    json_object_set_new(subscription, "state", json_integer(SUBSCRIPTION_ACTIVE));
+static void cosmo_command_release(cosmo *instance, struct cosmo_command *command) {
+  struct cosmo_command_slab *slab = command->slab;
+  command->next = slab->free_commands;
+  slab->free_commands = command;
+  if (slab->in_use-- == COMMAND_SLAB_SIZE) {
+    cosmo_command_slab_unlink(instance, slab);
+    cosmo_command_slab_push_front(instance, slab);
+  }
+  // Slabs with room are contiguous, so if another has any, it's a neighbour.
+  if (!slab->in_use && ((slab->prev && slab->prev->free_commands) || (slab->next && slab->next->free_commands))) {
+    cosmo_command_slab_unlink(instance, slab);
+    cosmo_dealloc(&instance->allocator, slab);
   }
+}
 
-  assert(!pthread_mutex_unlock(&instance->lock));
-  promise_succeed(command->promise, NULL, NULL);
-  assert(!pthread_mutex_lock(&instance->lock));
+static struct cosmo_command *cosmo_command_create(cosmo *instance, json_t *command, promise *promise_obj) {
+  struct cosmo_command *command_obj = cosmo_command_alloc(instance);
+  command_obj->command = command;
+  command_obj->promise = promise_obj;
+  command_obj->group = NULL;
+  command_obj->journal_offset = SIZE_MAX;
+  command_obj->queued_ms = cosmo_now_ms();
+  command_obj->id = ++instance->next_command_id;
+  // Encoded when first sent, once the server has said how it takes message
+  // bodies, and off the caller's thread.
+  command_obj->encoded = NULL;
+  // Only batches limited by size need to know; approximate, since that
+  // encoding isn't known yet.
+  command_obj->size = instance->options.max_batch_bytes ? json_dumpb(command, NULL, 0, JSON_COMPACT) : 0;
+  return command_obj;
 }
 
-static void cosmo_complete_unsubscribe(cosmo *instance, struct cosmo_command *command, json_t *response, char *result) {
-  assert(!pthread_mutex_unlock(&instance->lock));
-  promise_complete(command->promise, NULL, NULL, (strcmp(result, "ok") == 0));
-  assert(!pthread_mutex_lock(&instance->lock));
+static void cosmo_command_free(cosmo *instance, struct cosmo_command *command) {
+  json_decref(command->command);
+  cosmo_json_free(command->encoded);
+  cosmo_command_release(instance, command);
 }
 
-static void cosmo_complete_send_message(cosmo *instance, struct cosmo_command *command, json_t *response, char *result) {
-  json_t *message;
-  int err = json_unpack(response, "{so}", "message", &message);
-  if (err || (strcmp(result, "ok") && strcmp(result, "duplicate_message"))) {
-    assert(!pthread_mutex_unlock(&instance->lock));
-    promise_fail(command->promise, NULL, NULL);
-    assert(!pthread_mutex_lock(&instance->lock));
-  } else {
-    char *message_content;
-    assert(!json_unpack(message, "{ss}", "message", &message_content));
-    json_t *message_object = json_loads(message_content, JSON_DECODE_ANY, NULL);
-    assert(message_object);
-    json_object_set_new(message, "message", message_object);
+static void cosmo_enqueue_command_locked(cosmo *instance, struct cosmo_command *command_obj) {
+  bool was_empty = !instance->command_queue_head;
+  cosmo_append_command(&instance->command_queue_head, &instance->command_queue_tail, command_obj);
+  instance->command_queue_length++;
+  instance->command_queue_bytes += command_obj->size;
+  cosmo_trace_command(instance, COSMO_TRACE_ENQUEUE, command_obj);
+  if (instance->options.linger_ms <= 0 || cosmo_batch_full(instance)) {
+    instance->next_delay_ms = 0;
+    instance->next_rpc_ms = 0;
+  } else if (was_empty) {
+    // Hold the first command of a burst so the rest can join its RPC.
+    uint64_t deadline = cosmo_now_ms() + instance->options.linger_ms;
+    if (deadline < instance->next_rpc_ms) {
+      instance->next_rpc_ms = deadline;
+    }
+  }
+}
 
-    json_incref(message);
-    assert(!pthread_mutex_unlock(&instance->lock));
-    promise_succeed(command->promise, message, (promise_cleanup) json_decref);
-    assert(!pthread_mutex_lock(&instance->lock));
+static struct cosmo_command *cosmo_send_command_locked(cosmo *instance, json_t *command, promise *promise_obj) {
+  struct cosmo_command *command_obj = cosmo_command_create(instance, command, promise_obj);
+  // Commands with a sender_message_id are idempotent, so safe to replay.
+  if (instance->journal && json_object_get(json_object_get(command, "arguments"), "sender_message_id")) {
+    command_obj->journal_offset = cosmo_journal_append(instance->journal, command);
   }
+  cosmo_enqueue_command_locked(instance, command_obj);
+  return command_obj;
 }
 
-static void cosmo_complete_rpc(cosmo *instance, struct cosmo_command *command, json_t *response) {
-  char *command_name, *result;
+// Call before returning to the caller, once a batch of commands is queued.
+static void cosmo_sync_journal_locked(cosmo *instance) {
+  if (instance->journal && instance->options.journal_sync) {
+    cosmo_journal_sync(instance->journal);
+  }
+}
+
+// Takes ownership of command.
+static void cosmo_send_command(cosmo *instance, json_t *command, promise *promise_obj) {
+  assert(command);
+  cosmo_lock(instance);
+  cosmo_send_command_locked(instance, command, promise_obj);
+  cosmo_sync_journal_locked(instance);
+  cosmo_loop_wakeup(instance->loop_thread);
+  cosmo_unlock(instance);
+}
+
+static size_t cosmo_read_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
+  cosmo_transfer *transfer = userp;
+  size_t to_write = min(transfer->send_buf_len, size * nmemb);
+  memcpy(ptr, transfer->send_buf, to_write);
+  transfer->send_buf += to_write;
+  transfer->send_buf_len -= to_write;
+  return to_write;
+}
+
+static size_t cosmo_header_callback(char *ptr, size_t size, size_t nmemb, void *userp) {
+  cosmo_transfer *transfer = userp;
+  size_t length = size * nmemb;
+#define RETRY_AFTER_HEADER "Retry-After: 0\r\n"
+#define RETRY_AFTER_HEADER_SIZE (sizeof(RETRY_AFTER_HEADER) - 1)
+  if (length == RETRY_AFTER_HEADER_SIZE &&
+      strncasecmp(ptr, RETRY_AFTER_HEADER, RETRY_AFTER_HEADER_SIZE) == 0) {
+    transfer->retry_after = 0;
+  }
+  // RFC 7694: the server will take gzipped request bodies.
+#define ACCEPT_GZIP_HEADER "Accept-Encoding: gzip\r\n"
+#define ACCEPT_GZIP_HEADER_SIZE (sizeof(ACCEPT_GZIP_HEADER) - 1)
+  if (length == ACCEPT_GZIP_HEADER_SIZE &&
+      strncasecmp(ptr, ACCEPT_GZIP_HEADER, ACCEPT_GZIP_HEADER_SIZE) == 0) {
+    transfer->accepts_gzip = true;
+  }
+  return length;
+}
+
+static void cosmo_buf_append(const struct cosmo_allocator *allocator, char **buf, size_t *len, size_t *capacity, const char *data, size_t data_len) {
+  if (*len + data_len + 1 > *capacity) {
+    *capacity = (*len + data_len + 1) * 2;
+    *buf = cosmo_realloc(allocator, *buf, *capacity);
+  }
+  memcpy(*buf + *len, data, data_len);
+  *len += data_len;
+  (*buf)[*len] = '\0';
+}
+
+// Appends json's compact encoding, written straight into the buffer.
+static void cosmo_buf_append_json(const struct cosmo_allocator *allocator, char **buf, size_t *len, size_t *capacity, const json_t *json) {
+  size_t flags = JSON_COMPACT | JSON_PRESERVE_ORDER;
+  size_t json_len = json_dumpb(json, *buf ? *buf + *len : NULL, *capacity - *len, flags);
+  assert(json_len);
+  if (*len + json_len + 1 > *capacity) {
+    *capacity = (*len + json_len + 1) * 2;
+    *buf = cosmo_realloc(allocator, *buf, *capacity);
+    assert(json_dumpb(json, *buf + *len, *capacity - *len, flags) == json_len);
+  }
+  *len += json_len;
+  (*buf)[*len] = '\0';
+}
+
+// Encodes the request envelope, up to where its commands go, unless it's
+// current.
+static void cosmo_encode_envelope(cosmo *instance) {
+  if (instance->envelope && !strcmp(instance->envelope_instance_id, instance->instance_id)) {
+    return;
+  }
+  cosmo_json_free(instance->envelope);
+  strcpy(instance->envelope_instance_id, instance->instance_id);
+  json_t *envelope = json_pack("{ssss}", "client_id", instance->client_id, "instance_id", instance->instance_id);
+  assert(envelope);
+  if (!instance->options.raw_messages) {
+    // Ask for message bodies as embedded JSON; the server says if it agrees.
+    json_object_set_new(envelope, "message_encoding", json_string("json"));
+  }
+  json_object_set_new(envelope, "commands", json_array());
+  instance->envelope = json_dumps(envelope, JSON_COMPACT | JSON_PRESERVE_ORDER);
+  assert(instance->envelope);
+  json_decref(envelope);
+  instance->envelope_len = strlen(instance->envelope);
+  // Up to the empty commands array's closing bracket.
+  assert(instance->envelope_len > 3 && !strcmp(instance->envelope + instance->envelope_len - 3, "[]}"));
+  instance->envelope_len -= 2;
+}
+
+#define POLL_PREFIX "{\"command\":\"poll\",\"arguments\":"
+
+// Builds the request body in rpc->request_buf, splicing the poll and each
+// command's cached encoding into the envelope. Returns its length.
+static size_t cosmo_build_rpc(cosmo *instance, struct cosmo_rpc *rpc, const json_t *poll_arguments, const struct cosmo_command *commands) {
+  cosmo_encode_envelope(instance);
+  size_t len = 0;
+  cosmo_buf_append(&instance->allocator, &rpc->request_buf, &len, &rpc->request_buf_capacity, instance->envelope, instance->envelope_len);
+  cosmo_buf_append(&instance->allocator, &rpc->request_buf, &len, &rpc->request_buf_capacity, POLL_PREFIX, sizeof(POLL_PREFIX) - 1);
+  cosmo_buf_append_json(&instance->allocator, &rpc->request_buf, &len, &rpc->request_buf_capacity, poll_arguments);
+  cosmo_buf_append(&instance->allocator, &rpc->request_buf, &len, &rpc->request_buf_capacity, "}", 1);
+  for (const struct cosmo_command *iter = commands; iter; iter = iter->next) {
+    cosmo_buf_append(&instance->allocator, &rpc->request_buf, &len, &rpc->request_buf_capacity, ",", 1);
+    cosmo_buf_append(&instance->allocator, &rpc->request_buf, &len, &rpc->request_buf_capacity, iter->encoded, iter->encoded_len);
+  }
+  cosmo_buf_append(&instance->allocator, &rpc->request_buf, &len, &rpc->request_buf_capacity, "]}", 2);
+  return len;
+}
+
+size_t cosmo_gzip(const struct cosmo_allocator *allocator, const char *in, size_t in_len, char **out) {
+  z_stream stream = {
+    .next_in = (unsigned char *) in,
+    .avail_in = in_len,
+  };
+  // windowBits + 16 selects a gzip wrapper.
+  assert(deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  size_t out_len = deflateBound(&stream, in_len);
+  *out = cosmo_alloc(allocator ? allocator : &cosmo_default_allocator, out_len);
+  stream.next_out = (unsigned char *) *out;
+  stream.avail_out = out_len;
+  assert(deflate(&stream, Z_FINISH) == Z_STREAM_END);
+  out_len = stream.total_out;
+  assert(deflateEnd(&stream) == Z_OK);
+  return out_len;
+}
+
+// Sends the request_len bytes built in rpc->request_buf.
+static void cosmo_start_http(cosmo *instance, struct cosmo_rpc *rpc, size_t request_len) {
+  char *request = rpc->request_buf;
+  struct curl_slist *headers = NULL;
+  if (instance->options.compress &&
+      instance->server_accepts_gzip &&
+      request_len >= instance->options.compress_min_bytes) {
+    request_len = cosmo_gzip(&instance->allocator, request, request_len, &rpc->request);
+    request = rpc->request;
+    headers = instance->gzip_headers;
+  }
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_HTTPHEADER, headers));
+
+  rpc->transfer.send_buf = request;
+  rpc->transfer.send_buf_len = request_len;
+  rpc->transfer.recv_buf_len = 0;
+  memset(&rpc->transfer.scanner, 0, sizeof(rpc->transfer.scanner));
+  rpc->transfer.streaming = false;
+  rpc->transfer.retry_after = -1;
+  rpc->transfer.accepts_gzip = false;
+
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_POSTFIELDSIZE, rpc->transfer.send_buf_len));
+  instance->counters.bytes_sent += request_len;
+
+  assert(!curl_multi_add_handle(instance->loop_thread->multi, rpc->curl));
+  rpc->in_flight = true;
+}
+
+static void cosmo_release_recv_buf(const struct cosmo_allocator *allocator, cosmo_transfer *transfer) {
+  if (transfer->recv_buf_capacity > RECV_BUF_MAX_RETAINED) {
+    cosmo_dealloc(allocator, transfer->recv_buf);
+    transfer->recv_buf = NULL;
+    transfer->recv_buf_capacity = 0;
+  }
+}
+
+// Once an RPC has ended.
+static void cosmo_release_request(const struct cosmo_allocator *allocator, struct cosmo_rpc *rpc) {
+  cosmo_dealloc(allocator, rpc->request);
+  rpc->request = NULL;
+  if (rpc->request_buf_capacity > RECV_BUF_MAX_RETAINED) {
+    cosmo_dealloc(allocator, rpc->request_buf);
+    rpc->request_buf = NULL;
+    rpc->request_buf_capacity = 0;
+  }
+}
+
+// Returns the completed transfer, or NULL on failure.
+static cosmo_transfer *cosmo_finish_http(cosmo *instance, struct cosmo_rpc *rpc, CURLcode res) {
+  rpc->in_flight = false;
+  cosmo_release_request(&instance->allocator, rpc);
+
+  if (rpc->transfer.retry_after >= 0) {
+    instance->next_delay_ms = rpc->transfer.retry_after * 1000;
+  }
+
+  instance->counters.rpcs++;
+  curl_off_t received, total_time_us;
+  assert(curl_easy_getinfo(rpc->curl, CURLINFO_SIZE_DOWNLOAD_T, &received) == CURLE_OK);
+  instance->counters.bytes_received += received;
+  if (!rpc->hanging) {
+    assert(curl_easy_getinfo(rpc->curl, CURLINFO_TOTAL_TIME_T, &total_time_us) == CURLE_OK);
+    cosmo_histogram_add(&instance->counters.rpc_latency, total_time_us);
+  }
+
+  long return_code = 0;
+  if (!res) {
+    assert(curl_easy_getinfo(rpc->curl, CURLINFO_RESPONSE_CODE, &return_code) == CURLE_OK);
+  }
+  if (return_code == 415) {
+    // RFC 7694: the server no longer takes compressed bodies.
+    instance->server_accepts_gzip = false;
+  }
+  if (return_code != 200) {
+    instance->counters.rpc_failures++;
+    return NULL;
+  }
+
+  instance->server_accepts_gzip = rpc->transfer.accepts_gzip;
+  return &rpc->transfer;
+}
+
+// Leaves the body of a message event (or sendMessage result) under "message":
+// decoded, or as JSON text for raw_messages. Returns false if it's invalid.
+static bool cosmo_decode_message(cosmo *instance, json_t *event) {
+  json_t *embedded = json_object_get(event, "message_json");
+  if (embedded) {
+    if (instance->options.raw_messages) {
+      char *encoded = json_dumps(embedded, JSON_ENCODE_ANY);
+      json_object_set_new(event, "message", json_string(encoded));
+      cosmo_json_free(encoded);
+    } else {
+      json_object_set(event, "message", embedded);
+    }
+    json_object_del(event, "message_json");
+    return true;
+  }
+
+  const char *message_content = json_string_value(json_object_get(event, "message"));
+  if (!message_content) {
+    return false;
+  }
+  if (instance->options.raw_messages) {
+    return true;
+  }
+
+  json_error_t err;
+  json_t *message_object = json_loads(message_content, JSON_DECODE_ANY, &err);
+  if (!message_object) {
+    cosmo_log(instance, "error parsing message content: %s", err.text);
+    return false;
+  }
+  json_object_set_new(event, "message", message_object);
+  return true;
+}
+
+static void cosmo_run_promise(cosmo *instance, struct cosmo_task *task) {
+  promise_complete(task->promise, task->result, task->cleanup, task->success);
+  if (task->command_id && instance->options.trace) {
+    cosmo_trace(instance, COSMO_TRACE_CALLBACK, task->command_id, NULL, NULL);
+  }
+}
+
+static void cosmo_run_message(cosmo *instance, struct cosmo_task *task) {
+  instance->callbacks.message(task->result, instance->passthrough);
+  json_decref(task->result);
+}
+
+static void cosmo_run_messages_batch(cosmo *instance, struct cosmo_task *task) {
+  instance->callbacks.messages_batch(task->result, instance->passthrough);
+  json_decref(task->result);
+}
+
+static void cosmo_run_client_id_change(cosmo *instance, struct cosmo_task *task) {
+  instance->callbacks.client_id_change(instance->passthrough, instance->client_id);
+}
+
+static void cosmo_run_connect(cosmo *instance, struct cosmo_task *task) {
+  instance->callbacks.connect(instance->passthrough);
+}
+
+static void cosmo_run_disconnect(cosmo *instance, struct cosmo_task *task) {
+  instance->callbacks.disconnect(instance->passthrough);
+}
+
+static void cosmo_run_login(cosmo *instance, struct cosmo_task *task) {
+  instance->callbacks.login(instance->passthrough);
+}
+
+static void cosmo_run_logout(cosmo *instance, struct cosmo_task *task) {
+  instance->callbacks.logout(instance->passthrough);
+}
+
+// Wakes the consumer if it's asleep.
+static void cosmo_dispatcher_signal(struct cosmo_dispatcher *dispatcher) {
+  assert(!pthread_mutex_lock(&dispatcher->lock));
+  assert(!pthread_cond_broadcast(&dispatcher->cond));
+  assert(!pthread_mutex_unlock(&dispatcher->lock));
+}
+
+static void cosmo_run_task(cosmo *instance, struct cosmo_task *task) {
+  uint64_t start = cosmo_now_us();
+  task->run(instance, task);
+  cosmo_histogram_add(&instance->counters.callback_time, cosmo_now_us() - start);
+}
+
+// Runs a callback or promise completion: inline, unlocking the instance around
+// it, or by handing it to the dispatcher. Called with the instance locked, from
+// the one thread that produces for the instance's dispatcher.
+static void cosmo_dispatch_task(cosmo *instance, struct cosmo_task *task) {
+  struct cosmo_dispatcher *dispatcher = instance->dispatcher;
+  if (!dispatcher) {
+    cosmo_unlock(instance);
+    cosmo_run_task(instance, task);
+    cosmo_lock(instance);
+    return;
+  }
+
+  task->queued_ms = cosmo_now_ms();
+  size_t tail = atomic_load_explicit(&dispatcher->tail, memory_order_relaxed);
+  size_t depth = tail - atomic_load(&dispatcher->head);
+  bool first;
+  if (atomic_load(&dispatcher->overflowing) || depth == dispatcher->capacity) {
+    // Behind whatever overflowed before it, to keep the order.
+    struct cosmo_task_node *node = cosmo_alloc(&instance->allocator, sizeof(*node));
+    node->next = NULL;
+    node->task = *task;
+    assert(!pthread_mutex_lock(&dispatcher->lock));
+    if (dispatcher->overflow_tail) {
+      dispatcher->overflow_tail->next = node;
+    } else {
+      dispatcher->overflow_head = node;
+      atomic_store(&dispatcher->overflowing, true);
+    }
+    dispatcher->overflow_tail = node;
+    // The consumer may have emptied the ring and taken the list since.
+    first = node == dispatcher->overflow_head;
+    depth += ++dispatcher->overflow_length;
+    if (atomic_load(&dispatcher->consumer_waiting)) {
+      assert(!pthread_cond_broadcast(&dispatcher->cond));
+    }
+    assert(!pthread_mutex_unlock(&dispatcher->lock));
+  } else {
+    dispatcher->tasks[tail % dispatcher->capacity] = *task;
+    atomic_store(&dispatcher->tail, tail + 1);
+    // Loaded after publishing, so either this sees the consumer's last pop or
+    // the consumer sees this task.
+    depth = tail + 1 - atomic_load(&dispatcher->head);
+    first = depth == 1;
+    if (atomic_load(&dispatcher->consumer_waiting)) {
+      cosmo_dispatcher_signal(dispatcher);
+    }
+  }
+  if (depth > atomic_load_explicit(&dispatcher->max_depth, memory_order_relaxed)) {
+    atomic_store_explicit(&dispatcher->max_depth, depth, memory_order_relaxed);
+  }
+
+  // A spare wakeup just finds nothing to run.
+  if (first && dispatcher->event_fd >= 0) {
+    uint64_t one = 1;
+    assert(write(dispatcher->event_fd, &one, sizeof(one)) == sizeof(one));
+  }
+  if (first && instance->options.dispatch_notify) {
+    cosmo_unlock(instance);
+    instance->options.dispatch_notify(instance->passthrough);
+    cosmo_lock(instance);
+  }
+}
+
+// Completes a promise through cosmo_dispatch_task().
+static void cosmo_complete_promise(cosmo *instance, promise *promise_obj, void *result, promise_cleanup cleanup, bool success) {
+  if (!promise_obj) {
+    if (result && cleanup) {
+      cleanup(result);
+    }
+    return;
+  }
+  struct cosmo_task task = {
+    .run = cosmo_run_promise,
+    .promise = promise_obj,
+    .result = result,
+    .cleanup = cleanup,
+    .success = success,
+    .command_id = instance->completing_command_id,
+  };
+  cosmo_dispatch_task(instance, &task);
+}
+
+static void cosmo_dispatcher_run(cosmo *instance, struct cosmo_task *task) {
+  struct cosmo_dispatcher *dispatcher = instance->dispatcher;
+  uint64_t lag_ms = cosmo_now_ms() - task->queued_ms;
+  atomic_store_explicit(&dispatcher->lag_ms, lag_ms, memory_order_relaxed);
+  if (lag_ms > atomic_load_explicit(&dispatcher->max_lag_ms, memory_order_relaxed)) {
+    atomic_store_explicit(&dispatcher->max_lag_ms, lag_ms, memory_order_relaxed);
+  }
+  cosmo_run_task(instance, task);
+}
+
+size_t cosmo_dispatch(cosmo *instance) {
+  struct cosmo_dispatcher *dispatcher = instance->dispatcher;
+  size_t ran = 0;
+  size_t head = atomic_load_explicit(&dispatcher->head, memory_order_relaxed);
+  while (true) {
+    while (head != atomic_load(&dispatcher->tail)) {
+      struct cosmo_task task = dispatcher->tasks[head % dispatcher->capacity];
+      atomic_store(&dispatcher->head, ++head);
+      cosmo_dispatcher_run(instance, &task);
+      ran++;
+    }
+
+    // Everything that overflowed is newer than what was in the ring, and
+    // older than anything the ring takes once the list is empty.
+    if (!atomic_load(&dispatcher->overflowing)) {
+      return ran;
+    }
+    assert(!pthread_mutex_lock(&dispatcher->lock));
+    struct cosmo_task_node *node = dispatcher->overflow_head;
+    dispatcher->overflow_head = dispatcher->overflow_tail = NULL;
+    dispatcher->overflow_length = 0;
+    atomic_store(&dispatcher->overflowing, false);
+    assert(!pthread_mutex_unlock(&dispatcher->lock));
+    while (node) {
+      struct cosmo_task_node *next = node->next;
+      cosmo_dispatcher_run(instance, &node->task);
+      cosmo_dealloc(&instance->allocator, node);
+      ran++;
+      node = next;
+    }
+  }
+}
+
+static void *cosmo_dispatcher_main(void *arg) {
+  cosmo *instance = arg;
+  struct cosmo_dispatcher *dispatcher = instance->dispatcher;
+  while (true) {
+    cosmo_dispatch(instance);
+
+    assert(!pthread_mutex_lock(&dispatcher->lock));
+    atomic_store(&dispatcher->consumer_waiting, true);
+    while (atomic_load(&dispatcher->head) == atomic_load(&dispatcher->tail) && !dispatcher->overflow_head && !dispatcher->shutdown) {
+      assert(!pthread_cond_wait(&dispatcher->cond, &dispatcher->lock));
+    }
+    atomic_store(&dispatcher->consumer_waiting, false);
+    bool done = dispatcher->shutdown && atomic_load(&dispatcher->head) == atomic_load(&dispatcher->tail) && !dispatcher->overflow_head;
+    assert(!pthread_mutex_unlock(&dispatcher->lock));
+    if (done) {
+      return NULL;
+    }
+  }
+}
+
+// Whether the caller runs dispatched tasks, rather than a thread of our own.
+static bool cosmo_dispatch_external(const cosmo *instance) {
+  return instance->options.dispatch_notify || instance->options.dispatch_fd;
+}
+
+static void cosmo_dispatcher_create(cosmo *instance) {
+  struct cosmo_dispatcher *dispatcher = cosmo_alloc(&instance->allocator, sizeof(*dispatcher));
+  dispatcher->capacity = instance->options.dispatch_queue_size;
+  dispatcher->tasks = cosmo_alloc(&instance->allocator, dispatcher->capacity * sizeof(*dispatcher->tasks));
+  atomic_init(&dispatcher->head, 0);
+  atomic_init(&dispatcher->tail, 0);
+  assert(!pthread_mutex_init(&dispatcher->lock, NULL));
+  assert(!pthread_cond_init(&dispatcher->cond, NULL));
+  atomic_init(&dispatcher->consumer_waiting, false);
+  atomic_init(&dispatcher->overflowing, false);
+  dispatcher->overflow_head = dispatcher->overflow_tail = NULL;
+  dispatcher->overflow_length = 0;
+  dispatcher->shutdown = false;
+  atomic_init(&dispatcher->max_depth, 0);
+  atomic_init(&dispatcher->lag_ms, 0);
+  atomic_init(&dispatcher->max_lag_ms, 0);
+  dispatcher->event_fd = -1;
+  if (instance->options.dispatch_fd) {
+    dispatcher->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert(dispatcher->event_fd >= 0);
+  }
+  instance->dispatcher = dispatcher;
+  if (!cosmo_dispatch_external(instance)) {
+    assert(!pthread_create(&dispatcher->thread, NULL, cosmo_dispatcher_main, instance));
+  }
+}
+
+// Once nothing else can produce: runs what's left, then frees the dispatcher.
+static void cosmo_dispatcher_destroy(cosmo *instance) {
+  struct cosmo_dispatcher *dispatcher = instance->dispatcher;
+  if (cosmo_dispatch_external(instance)) {
+    cosmo_dispatch(instance);
+  } else {
+    assert(!pthread_mutex_lock(&dispatcher->lock));
+    dispatcher->shutdown = true;
+    assert(!pthread_cond_broadcast(&dispatcher->cond));
+    assert(!pthread_mutex_unlock(&dispatcher->lock));
+    assert(!pthread_join(dispatcher->thread, NULL));
+  }
+  if (dispatcher->event_fd >= 0) {
+    assert(!close(dispatcher->event_fd));
+  }
+  assert(!pthread_mutex_destroy(&dispatcher->lock));
+  assert(!pthread_cond_destroy(&dispatcher->cond));
+  cosmo_dealloc(&instance->allocator, dispatcher->tasks);
+  cosmo_dealloc(&instance->allocator, dispatcher);
+}
+
+void cosmo_get_stats(cosmo *instance, cosmo_stats *stats) {
+  cosmo_lock(instance);
+  struct cosmo_counters *counters = &instance->counters;
+  stats->rpcs = counters->rpcs;
+  stats->rpc_failures = counters->rpc_failures;
+  stats->bytes_sent = counters->bytes_sent;
+  stats->bytes_received = counters->bytes_received;
+  stats->retries = counters->retries;
+  stats->command_queue_length = instance->command_queue_length;
+  // Retries go back on the front, so the head has waited longest.
+  stats->command_queue_age_ms = instance->command_queue_head ? cosmo_now_ms() - instance->command_queue_head->queued_ms : 0;
+  stats->subscriptions = instance->subscriptions.count;
+  stats->messages = 0;
+  for (size_t i = 0; i < instance->subscriptions.capacity; i++) {
+    if (instance->subscriptions.slots[i]) {
+      stats->messages += cosmo_message_store_length(&instance->subscriptions.slots[i]->messages);
+    }
+  }
+  cosmo_unlock(instance);
+
+  cosmo_histogram_get(&counters->rpc_latency, &stats->rpc_latency);
+  cosmo_histogram_get(&counters->callback_time, &stats->callback_time);
+  cosmo_histogram_get(&counters->lock_wait, &stats->lock_wait);
+  cosmo_histogram_get(&counters->lock_hold, &stats->lock_hold);
+  cosmo_get_dispatch_stats(instance, &stats->dispatch);
+}
+
+int cosmo_get_fd(cosmo *instance) {
+  return instance->dispatcher ? instance->dispatcher->event_fd : -1;
+}
+
+size_t cosmo_process_events(cosmo *instance) {
+  struct cosmo_dispatcher *dispatcher = instance->dispatcher;
+  if (!dispatcher || dispatcher->event_fd < 0) {
+    return 0;
+  }
+  // Reset the fd before draining, so a task queued after the drain checks the
+  // ring makes it readable again.
+  uint64_t count;
+  if (read(dispatcher->event_fd, &count, sizeof(count)) < 0) {
+    assert(errno == EAGAIN);
+  }
+  return cosmo_dispatch(instance);
+}
+
+void cosmo_get_dispatch_stats(cosmo *instance, cosmo_dispatch_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  struct cosmo_dispatcher *dispatcher = instance->dispatcher;
+  if (!dispatcher) {
+    return;
+  }
+  size_t head = atomic_load(&dispatcher->head);
+  stats->queue_depth = atomic_load(&dispatcher->tail) - head;
+  assert(!pthread_mutex_lock(&dispatcher->lock));
+  stats->queue_depth += dispatcher->overflow_length;
+  assert(!pthread_mutex_unlock(&dispatcher->lock));
+  stats->max_queue_depth = atomic_load_explicit(&dispatcher->max_depth, memory_order_relaxed);
+  stats->lag_ms = atomic_load_explicit(&dispatcher->lag_ms, memory_order_relaxed);
+  stats->max_lag_ms = atomic_load_explicit(&dispatcher->max_lag_ms, memory_order_relaxed);
+}
+
+void cosmo_force_new_instance(cosmo *instance) {
+  cosmo_lock(instance);
+  cosmo_uuid(instance->instance_id);
+  cosmo_unlock(instance);
+}
+
+size_t cosmo_command_slab_count(cosmo *instance) {
+  cosmo_lock(instance);
+  size_t count = 0;
+  for (struct cosmo_command_slab *slab = instance->command_slabs; slab; slab = slab->next) {
+    count++;
+  }
+  cosmo_unlock(instance);
+  return count;
+}
+
+// Holds a new message for the next messages_batch callback.
+static void cosmo_batch_message(cosmo *instance, struct cosmo_subscription *subscription, json_int_t id, json_t *event) {
+  if (subscription->batch_generation != instance->batch_generation) {
+    subscription->batch_generation = instance->batch_generation;
+    subscription->batch_group = instance->batch_groups++;
+  }
+  if (instance->batch_length == instance->batch_capacity) {
+    instance->batch_capacity = instance->batch_capacity ? instance->batch_capacity * 2 : MESSAGE_BATCH_MIN_CAPACITY;
+    instance->batch = cosmo_realloc(&instance->allocator, instance->batch, instance->batch_capacity * sizeof(*instance->batch));
+  }
+  json_incref(event);
+  struct cosmo_batched_message *batched = &instance->batch[instance->batch_length++];
+  batched->group = subscription->batch_group;
+  batched->id = id;
+  batched->event = event;
+}
+
+static int cosmo_batched_message_cmp(const void *a, const void *b) {
+  const struct cosmo_batched_message *x = a, *y = b;
+  if (x->group != y->group) {
+    return x->group < y->group ? -1 : 1;
+  }
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+// Hands the batched messages to messages_batch, grouped by subject in the
+// order subjects first appeared, and in id order within each subject.
+static void cosmo_flush_message_batch(cosmo *instance) {
+  if (!instance->batch_length) {
+    return;
+  }
+  qsort(instance->batch, instance->batch_length, sizeof(*instance->batch), cosmo_batched_message_cmp);
+  json_t *messages = json_array();
+  assert(messages);
+  for (size_t i = 0; i < instance->batch_length; i++) {
+    assert(!json_array_append_new(messages, instance->batch[i].event));
+  }
+  instance->batch_length = 0;
+  instance->batch_groups = 0;
+  // Invalidates every subscription's batch_group at once.
+  instance->batch_generation++;
+
+  cosmo_log(instance, "callbacks.messages_batch()");
+  struct cosmo_task task = {
+    .run = cosmo_run_messages_batch,
+    .result = messages,
+  };
+  cosmo_dispatch_task(instance, &task);
+}
+
+// Starts the subscription's cache over with a header and the newest messages
+// its depth calls for.
+static void cosmo_cache_write(cosmo *instance, struct cosmo_subscription *subscription) {
+  struct cosmo_journal *cache = subscription->cache;
+  json_int_t depth = subscription->cache_depth;
+  cosmo_journal_reset(cache);
+  json_t *header = json_pack("{sOsIsb}",
+      "subject", subscription->subject,
+      "messages", depth,
+      "raw_messages", instance->options.raw_messages);
+  assert(header);
+  cosmo_journal_append(cache, header);
+  json_decref(header);
+  const struct cosmo_message_block *block = subscription->messages.block;
+  size_t length = block ? block->length : 0;
+  size_t first = depth < 0 || (size_t) depth >= length ? 0 : length - depth;
+  for (size_t i = first; i < length; i++) {
+    cosmo_journal_append(cache, block->messages[i].event);
+  }
+  subscription->cache_messages = length - first;
+}
+
+static void cosmo_cache_append(cosmo *instance, struct cosmo_subscription *subscription, const json_t *event) {
+  cosmo_journal_append(subscription->cache, event);
+  subscription->cache_messages++;
+  // A whole history grows no faster than the store does.
+  json_int_t depth = subscription->cache_depth;
+  if (depth >= 0 && subscription->cache_messages > max((size_t) depth * 2, (size_t) CACHE_REWRITE_MIN_MESSAGES)) {
+    cosmo_cache_write(instance, subscription);
+  }
+}
+
+static void cosmo_handle_message(cosmo *instance, json_t *event) {
+  json_t *subject;
+  json_int_t id;
+  if (json_unpack(event, "{sosI}", "subject", &subject, "id", &id)) {
+    cosmo_log(instance, "invalid message event");
+    return;
+  }
+
+  struct cosmo_subscription *subscription = cosmo_subscriptions_find(&instance->subscriptions, subject);
+  if (!subscription) {
+    cosmo_log(instance, "message from unknown subject");
+    return;
+  }
+
+  // Replays are common; skip them before paying for the decode.
+  if (cosmo_message_store_contains(&subscription->messages, id)) {
+    return;
+  }
+
+  if (!cosmo_decode_message(instance, event)) {
+    cosmo_log(instance, "invalid message event");
+    return;
+  }
+
+  assert(cosmo_message_store_insert(&subscription->messages, id, event));
+  instance->messages_received++;
+  if (instance->options.trace) {
+    cosmo_trace(instance, COSMO_TRACE_RECEIVE, 0, NULL, json_string_value(json_object_get(event, "sender_message_id")));
+  }
+  // Only new ids get this far, so the cache never holds one twice.
+  if (subscription->cache) {
+    cosmo_cache_append(instance, subscription, event);
+  }
+
+  if (instance->callbacks.messages_batch) {
+    cosmo_batch_message(instance, subscription, id, event);
+  } else if (instance->callbacks.message) {
+    cosmo_log(instance, "callbacks.message()");
+    json_incref(event);
+    struct cosmo_task task = {
+      .run = cosmo_run_message,
+      .result = event,
+    };
+    cosmo_dispatch_task(instance, &task);
+  }
+}
+
+static void cosmo_handle_client_id_change(cosmo *instance) {
+  if (instance->callbacks.client_id_change) {
+    cosmo_log(instance, "callbacks.client_id_change()");
+    struct cosmo_task task = {
+      .run = cosmo_run_client_id_change,
+    };
+    cosmo_dispatch_task(instance, &task);
+  }
+}
+
+static void cosmo_handle_connect(cosmo *instance) {
+  if (instance->connect_state == CONNECTED) {
+    return;
+  }
+  instance->connect_state = CONNECTED;
+  if (instance->callbacks.connect) {
+    cosmo_log(instance, "callbacks.connect()");
+    struct cosmo_task task = {
+      .run = cosmo_run_connect,
+    };
+    cosmo_dispatch_task(instance, &task);
+  }
+}
+
+static void cosmo_handle_disconnect(cosmo *instance) {
+  if (instance->connect_state == DISCONNECTED) {
+    return;
+  }
+  instance->connect_state = DISCONNECTED;
+  if (instance->callbacks.disconnect) {
+    cosmo_log(instance, "callbacks.disconnect()");
+    struct cosmo_task task = {
+      .run = cosmo_run_disconnect,
+    };
+    cosmo_dispatch_task(instance, &task);
+  }
+}
+
+static void cosmo_handle_login(cosmo *instance, json_t *event) {
+  if (instance->login_state == LOGGED_IN) {
+    return;
+  }
+  instance->login_state = LOGGED_IN;
+  if (instance->callbacks.login) {
+    cosmo_log(instance, "callbacks.login()");
+    struct cosmo_task task = {
+      .run = cosmo_run_login,
+    };
+    cosmo_dispatch_task(instance, &task);
+  }
+}
+
+static void cosmo_handle_logout(cosmo *instance, json_t *event) {
+  if (instance->login_state == LOGGED_OUT) {
+    return;
+  }
+  instance->login_state = LOGGED_OUT;
+  if (instance->callbacks.logout) {
+    cosmo_log(instance, "callbacks.logout()");
+    struct cosmo_task task = {
+      .run = cosmo_run_logout,
+    };
+    cosmo_dispatch_task(instance, &task);
+  }
+}
+
+static void cosmo_handle_event(cosmo *instance, json_t *event) {
+  // Servers that number events take one cursor per subscription, covering
+  // everything up to it; otherwise each event is acked by id.
+  const char *subscription_key;
+  json_int_t seq;
+  json_t *event_id = json_object_get(event, "event_id");
+  if (!json_unpack(event, "{s{sssI}}", "ack_cursor", "subscription", &subscription_key, "seq", &seq)) {
+    json_t *acked = json_object_get(instance->ack_cursors, subscription_key);
+    if (!acked || json_integer_value(acked) < seq) {
+      json_object_set_new(instance->ack_cursors, subscription_key, json_integer(seq));
+    }
+  } else if (event_id) {
+    json_array_append(instance->ack, event_id);
+  }
+
+  const char *event_type = json_string_value(json_object_get(event, "event_type"));
+  if (!strcmp(event_type, "message")) {
+    cosmo_handle_message(instance, event);
+  } else if (!strcmp(event_type, "login")) {
+    cosmo_handle_login(instance, event);
+  } else if (!strcmp(event_type, "logout")) {
+    cosmo_handle_logout(instance, event);
+  } else {
+    cosmo_log(instance, "unknown event type: %s", event_type);
+  }
+}
+
+// Any valid response means we can reach the server.
+static void cosmo_handle_success(cosmo *instance) {
+  instance->last_success_ms = cosmo_now_ms();
+  cosmo_handle_connect(instance);
+}
+
+static void cosmo_handle_streamed_event(cosmo *instance, const char *buf, size_t len) {
+  json_error_t error;
+  json_t *event = json_loadb(buf, len, 0, &error);
+  if (!event) {
+    // Unacked, so the server will send it again.
+    cosmo_log(instance, "json_loadb() failed: %s", error.text);
+    return;
+  }
+
+  cosmo_lock(instance);
+  cosmo_handle_success(instance);
+  cosmo_handle_event(instance, event);
+  cosmo_unlock(instance);
+  json_decref(event);
+}
+
+// Advances the scanner over newly received bytes, handling each event in the
+// top-level "events" array as soon as it is complete. Only needs to track
+// enough of the JSON grammar to match brackets and spot that key.
+//
+// Events are thus handled before anything else in their response, wherever it
+// puts them: the profile, instance generation and command responses come once
+// it's complete. cosmo_handle_response() keeps that order for responses that
+// weren't streamed.
+static void cosmo_scan_events(struct cosmo_rpc *rpc) {
+  cosmo_transfer *transfer = &rpc->transfer;
+  struct cosmo_event_scanner *scanner = &transfer->scanner;
+  for (; scanner->pos < transfer->recv_buf_len; scanner->pos++) {
+    char c = transfer->recv_buf[scanner->pos];
+    if (scanner->in_string) {
+      if (scanner->escape) {
+        scanner->escape = false;
+      } else if (c == '\\') {
+        scanner->escape = true;
+      } else if (c == '"') {
+        scanner->in_string = false;
+        if (scanner->depth == 1) {
+#define EVENTS_KEY "\"events\""
+          scanner->string_is_events =
+              scanner->pos + 1 - scanner->string_start == strlen(EVENTS_KEY) &&
+              !memcmp(transfer->recv_buf + scanner->string_start, EVENTS_KEY, strlen(EVENTS_KEY));
+        }
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '"':
+        scanner->in_string = true;
+        scanner->string_start = scanner->pos;
+        break;
+
+      case ':':
+        // Only a key is followed by one; a value "events" isn't the array.
+        if (scanner->depth == 1) {
+          scanner->last_key_is_events = scanner->string_is_events;
+        }
+        break;
+
+      case ',':
+        if (scanner->depth == 1) {
+          scanner->last_key_is_events = false;
+        }
+        break;
+
+      case '[':
+      case '{':
+        if (scanner->depth == 1 && c == '[' && scanner->last_key_is_events) {
+          scanner->in_events = true;
+          scanner->events_start = scanner->pos;
+        } else if (scanner->in_events && scanner->depth == 2 && c == '{') {
+          scanner->element_start = scanner->pos;
+        }
+        scanner->depth++;
+        break;
+
+      case ']':
+      case '}':
+        scanner->depth--;
+        if (scanner->in_events && scanner->depth == 2 && c == '}') {
+          cosmo_handle_streamed_event(rpc->instance, transfer->recv_buf + scanner->element_start, scanner->pos + 1 - scanner->element_start);
+        } else if (scanner->in_events && scanner->depth == 1) {
+          scanner->in_events = false;
+          scanner->events_end = scanner->pos + 1;
+        }
+        break;
+    }
+  }
+}
+
+static size_t cosmo_write_callback(void *ptr, size_t size, size_t nmemb, void *userp) {
+  struct cosmo_rpc *rpc = userp;
+  cosmo_transfer *transfer = &rpc->transfer;
+  size_t to_read = size * nmemb;
+
+  if (!transfer->recv_buf_len) {
+    // Only error responses are worth waiting for in full.
+    long return_code = 0;
+    assert(curl_easy_getinfo(rpc->curl, CURLINFO_RESPONSE_CODE, &return_code) == CURLE_OK);
+    transfer->streaming = return_code == 200;
+  }
+
+  if (transfer->recv_buf_len + to_read + 1 > transfer->recv_buf_capacity) {
+    size_t capacity = max(transfer->recv_buf_capacity, RECV_BUF_MIN_CAPACITY);
+    while (transfer->recv_buf_len + to_read + 1 > capacity) {
+      capacity *= 2;
+    }
+    transfer->recv_buf = cosmo_realloc(&rpc->instance->allocator, transfer->recv_buf, capacity);
+    transfer->recv_buf_capacity = capacity;
+  }
+  memcpy(transfer->recv_buf + transfer->recv_buf_len, ptr, to_read);
+  transfer->recv_buf_len += to_read;
+  transfer->recv_buf[transfer->recv_buf_len] = '\0';
+
+  if (transfer->streaming) {
+    cosmo_scan_events(rpc);
+  }
+  return to_read;
+}
+
+// Counts a command out of its group, if any. Without complete, as at shutdown,
+// an emptied group is freed without completing its promise.
+static void cosmo_group_release(cosmo *instance, struct cosmo_command *command, bool complete, bool success) {
+  struct cosmo_command_group *group = command->group;
+  if (!group) {
+    return;
+  }
+  group->failed |= !success;
+  if (--group->remaining) {
+    return;
+  }
+  if (complete) {
+    cosmo_complete_promise(instance, group->promise, NULL, NULL, !group->failed);
+  }
+  cosmo_dealloc(&instance->allocator, group);
+}
+
+static bool cosmo_complete_subscribe_subject(cosmo *instance, json_t *subject, const char *result) {
+  if (!result || strcmp(result, "ok")) {
+    cosmo_subscriptions_remove(&instance->subscriptions, subject);
+    return false;
+  }
+
+  struct cosmo_subscription *subscription = cosmo_subscriptions_find(&instance->subscriptions, subject);
+  if (subscription) {
+    // Might have unsubscribed later
+    subscription->state = SUBSCRIPTION_ACTIVE;
+  }
+  return true;
+}
+
+// Returns true if the command has been cut down to subjects the server said
+// to retry, and should go out again.
+static bool cosmo_complete_subscribe(cosmo *instance, struct cosmo_command *command, json_t *response, char *result) {
+  json_t *command_arguments = json_object_get(command->command, "arguments");
+  json_t *subjects = json_object_get(command_arguments, "subjects");
+  if (subjects) {
+    // From cosmo_resubscribe(), so no promise or group.
+    json_t *results = strcmp(result, "ok") ? NULL : json_object_get(response, "results");
+    json_t *retry = json_array();
+    size_t index;
+    json_t *arguments;
+    json_array_foreach(subjects, index, arguments) {
+      json_t *subject = json_object_get(arguments, "subject");
+      const char *subject_result = json_string_value(json_object_get(json_array_get(results, index), "result"));
+      if (!subject_result || !strcmp(subject_result, "retry")) {
+        // Likely the instance isn't active yet, or the whole command failed;
+        // only a subject's own answer is reason to drop it. Unless we've since
+        // unsubscribed, try again.
+        if (cosmo_subscriptions_find(&instance->subscriptions, subject)) {
+          json_array_append(retry, arguments);
+        }
+        continue;
+      }
+      cosmo_complete_subscribe_subject(instance, subject, subject_result);
+    }
+    if (!json_array_size(retry)) {
+      json_decref(retry);
+      return false;
+    }
+    json_object_set_new(command_arguments, "subjects", retry);
+    cosmo_json_free(command->encoded);
+    command->encoded = NULL;
+    command->size = instance->options.max_batch_bytes ? json_dumpb(command->command, NULL, 0, JSON_COMPACT) : 0;
+    return true;
+  }
+
+  json_t *subject;
+  assert(!json_unpack(command->command, "{s{so}}", "arguments", "subject", &subject));
+  bool success = cosmo_complete_subscribe_subject(instance, subject, result);
+  cosmo_complete_promise(instance, command->promise, NULL, NULL, success);
+  cosmo_group_release(instance, command, true, success);
+  return false;
+}
+
+static void cosmo_complete_unsubscribe(cosmo *instance, struct cosmo_command *command, json_t *response, char *result) {
+  cosmo_complete_promise(instance, command->promise, NULL, NULL, (strcmp(result, "ok") == 0));
+}
+
+static void cosmo_complete_send_message(cosmo *instance, struct cosmo_command *command, json_t *response, char *result) {
+  json_t *message;
+  int err = json_unpack(response, "{so}", "message", &message);
+  if (err || (strcmp(result, "ok") && strcmp(result, "duplicate_message")) || !cosmo_decode_message(instance, message)) {
+    cosmo_complete_promise(instance, command->promise, NULL, NULL, false);
+    cosmo_group_release(instance, command, true, false);
+  } else {
+    json_incref(message);
+    cosmo_complete_promise(instance, command->promise, message, (promise_cleanup) json_decref, true);
+    cosmo_group_release(instance, command, true, true);
+  }
+}
+
+// Returns true if the command should be retried, as cosmo_complete_subscribe().
+static bool cosmo_complete_rpc(cosmo *instance, struct cosmo_command *command, json_t *response) {
+  cosmo_trace_command(instance, COSMO_TRACE_COMPLETE, command);
+  char *command_name, *result;
   assert(!json_unpack(command->command, "{ss}", "command", &command_name));
   assert(!json_unpack(response, "{ss}", "result", &result));
   if (!strcmp(command_name, "subscribe")) {
-    cosmo_complete_subscribe(instance, command, response, result);
+    return cosmo_complete_subscribe(instance, command, response, result);
   } else if (!strcmp(command_name, "unsubscribe")) {
     cosmo_complete_unsubscribe(instance, command, response, result);
   } else if (!strcmp(command_name, "sendMessage")) {
     cosmo_complete_send_message(instance, command, response, result);
   }
+  return false;
+}
+
+// Takes ownership of arguments.
+static json_t *cosmo_command(const char *name, const json_t *arguments) {
+  return json_pack("{ssso}", "command", name, "arguments", arguments);
+}
+
+// sendMessage commands are queued with the body as a JSON value. It goes out
+// embedded if the server has agreed to that, and JSON-encoded otherwise.
+static json_t *cosmo_encode_command(const cosmo *instance, json_t *command) {
+  if (strcmp(json_string_value(json_object_get(command, "command")), "sendMessage")) {
+    return json_incref(command);
+  }
+
+  json_t *arguments = json_copy(json_object_get(command, "arguments"));
+  json_t *message = json_object_get(arguments, "message");
+  if (instance->embed_messages) {
+    json_object_set(arguments, "message_json", message);
+    json_object_del(arguments, "message");
+  } else {
+    char *encoded = json_dumps(message, JSON_ENCODE_ANY);
+    json_object_set_new(arguments, "message", json_string(encoded));
+    cosmo_json_free(encoded);
+  }
+
+  json_t *ret = json_copy(command);
+  json_object_set_new(ret, "arguments", arguments);
+  return ret;
+}
+
+// Fills in command->encoded, unless it's already in the form the server takes.
+static void cosmo_command_encode(const cosmo *instance, struct cosmo_command *command) {
+  if (command->encoded && command->encoded_embedded == instance->embed_messages) {
+    return;
+  }
+  cosmo_json_free(command->encoded);
+  json_t *to_encode = cosmo_encode_command(instance, command->command);
+  command->encoded = json_dumps(to_encode, JSON_COMPACT | JSON_PRESERVE_ORDER);
+  assert(command->encoded);
+  json_decref(to_encode);
+  command->encoded_len = strlen(command->encoded);
+  command->encoded_embedded = instance->embed_messages;
+}
+
+static void cosmo_resubscribe(cosmo *instance) {
+  // Servers that take many subjects per subscribe get them in chunks.
+  size_t chunk_size = min(instance->max_subscribe_subjects, RESUBSCRIBE_MAX_SUBJECTS);
+  json_t *chunk = NULL;
+  for (size_t i = 0; i < instance->subscriptions.capacity; i++) {
+    struct cosmo_subscription *subscription = instance->subscriptions.slots[i];
+    if (!subscription || subscription->state == SUBSCRIPTION_PENDING) {
+      continue;
+    }
+
+    json_t *arguments = json_pack("{sO}", "subject", subscription->subject);
+    const struct cosmo_message *last_message = cosmo_message_store_last(&subscription->messages);
+    if (last_message) {
+      // Restart at the last actual ID we received.
+      json_object_set_new(arguments, "last_id", json_integer(last_message->id));
+    } else {
+      if (subscription->num_messages) {
+        json_object_set_new(arguments, "messages", json_integer(subscription->num_messages));
+      }
+      if (subscription->last_id) {
+        json_object_set_new(arguments, "last_id", json_integer(subscription->last_id));
+      }
+    }
+
+    if (chunk_size < 2) {
+      cosmo_send_command_locked(instance, cosmo_command("subscribe", arguments), NULL);
+      continue;
+    }
+    if (!chunk) {
+      chunk = json_array();
+    }
+    json_array_append_new(chunk, arguments);
+    if (json_array_size(chunk) == chunk_size) {
+      cosmo_send_command_locked(instance, cosmo_command("subscribe", json_pack("{so}", "subjects", chunk)), NULL);
+      chunk = NULL;
+    }
+  }
+  if (chunk) {
+    cosmo_send_command_locked(instance, cosmo_command("subscribe", json_pack("{so}", "subjects", chunk)), NULL);
+  }
+}
+
+// Takes ownership of commands.
+// Takes ownership of ack and ack_cursors.
+static void cosmo_start_rpc(cosmo *instance, struct cosmo_rpc *rpc, struct cosmo_command *commands, json_t *ack, json_t *ack_cursors) {
+  // Always poll. Only hang when there's nothing else in the batch to hold up.
+  json_t *arguments = json_pack("{so}", "ack", ack);
+  if (json_object_size(ack_cursors)) {
+    json_object_set(arguments, "ack_cursors", ack_cursors);
+  }
+  json_decref(ack_cursors);
+  rpc->hanging = !commands && instance->connect_state == CONNECTED && instance->options.hanging_poll_ms > 0;
+  rpc->messages_received = instance->messages_received;
+  if (rpc->hanging) {
+    json_object_set_new(arguments, "timeout_ms", json_integer(instance->options.hanging_poll_ms));
+  }
+  struct cosmo_command *command_iter;
+  for (command_iter = commands; command_iter; command_iter = command_iter->next) {
+    cosmo_command_encode(instance, command_iter);
+  }
+
+  size_t request_len = cosmo_build_rpc(instance, rpc, arguments, commands);
+  cosmo_log(instance, "--> %s", rpc->request_buf);
+  json_decref(arguments);
+
+  rpc->commands = commands;
+  for (command_iter = commands; command_iter; command_iter = command_iter->next) {
+    cosmo_trace_command(instance, COSMO_TRACE_SEND, command_iter);
+  }
+  long timeout_ms = CYCLE_MS;
+  if (rpc->hanging) {
+    timeout_ms += instance->options.hanging_poll_ms;
+  }
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_TIMEOUT_MS, timeout_ms));
+  cosmo_start_http(instance, rpc, request_len);
+}
+
+// Returns the commands to retry.
+static struct cosmo_command *cosmo_handle_response(cosmo *instance, struct cosmo_rpc *rpc, struct cosmo_command *commands, cosmo_transfer *transfer) {
+  if (!transfer) {
+    return commands;
+  }
+  cosmo_log(instance, "<-- %s", transfer->recv_buf);
+  for (struct cosmo_command *iter = commands; iter; iter = iter->next) {
+    cosmo_trace_command(instance, COSMO_TRACE_RESPONSE, iter);
+  }
+
+  struct cosmo_event_scanner *scanner = &transfer->scanner;
+  if (scanner->events_end) {
+    // Events were handled as they arrived; parse the rest without them.
+    transfer->recv_buf[scanner->events_start] = '[';
+    transfer->recv_buf[scanner->events_start + 1] = ']';
+    memset(transfer->recv_buf + scanner->events_start + 2, ' ', scanner->events_end - scanner->events_start - 2);
+  }
+
+  json_error_t error;
+  json_t *received = json_loadb(transfer->recv_buf, transfer->recv_buf_len, 0, &error);
+  if (!received) {
+    cosmo_log(instance, "json_loadb() failed: %s (json: \"%s\")", error.text, transfer->recv_buf);
+    return commands;
+  }
+
+  json_t *command_responses, *events, *profile;
+  if (json_unpack(received, "{sososo}", "profile", &profile, "responses", &command_responses, "events", &events)) {
+    cosmo_log(instance, "invalid server response");
+    json_decref(received);
+    return commands;
+  }
+
+  json_t *message_encoding = json_object_get(received, "message_encoding");
+  instance->embed_messages = json_is_string(message_encoding) && !strcmp(json_string_value(message_encoding), "json");
+
+  cosmo_handle_success(instance);
+
+  size_t index;
+  json_t *event;
+  json_array_foreach(events, index, event) {
+    cosmo_handle_event(instance, event);
+  }
+  cosmo_flush_message_batch(instance);
+
+  // Events go first, as they do when streamed.
+  // TODO: major locking problems through here
+  if (!json_equal(instance->profile, profile)) {
+    json_decref(instance->profile);
+    json_incref(profile);
+    instance->profile = profile;
+    struct cosmo_get_profile *get_profile_iter = instance->get_profile_head;
+    while (get_profile_iter) {
+      struct cosmo_get_profile *next = get_profile_iter->next;
+      json_incref(instance->profile);
+      cosmo_complete_promise(instance, get_profile_iter->promise, instance->profile, (promise_cleanup)json_decref, true);
+      cosmo_dealloc(&instance->allocator, get_profile_iter);
+      get_profile_iter = next;
+    }
+    instance->get_profile_head = NULL;
+  }
+
+  json_t *poll_response = json_array_get(command_responses, 0);
+  json_t *instance_generation;
+  if (json_unpack(poll_response, "{so}", "instance_generation", &instance_generation)) {
+    cosmo_log(instance, "invalid poll response");
+  } else {
+    json_int_t max_subscribe_subjects = 0;
+    json_unpack(poll_response, "{s?I}", "max_subscribe_subjects", &max_subscribe_subjects);
+    instance->max_subscribe_subjects = max_subscribe_subjects > 0 ? max_subscribe_subjects : 0;
+    if (!json_equal(instance_generation, instance->generation)) {
+      json_decref(instance->generation);
+      json_incref(instance_generation);
+      instance->generation = instance_generation;
+      cosmo_resubscribe(instance);
+    }
+  }
+
+  if (rpc->hanging) {
+    // Servers that don't support hanging polls don't echo the timeout.
+    json_int_t timeout_ms = 0;
+    json_unpack(poll_response, "{s?I}", "timeout_ms", &timeout_ms);
+    instance->hanging_poll_supported = timeout_ms > 0;
+  }
+  if (instance->hanging_poll_supported) {
+    // Re-arm immediately; the server does the waiting.
+    instance->next_delay_ms = 0;
+  }
+
+  struct cosmo_command *command_iter = commands;
+  struct cosmo_command *to_retry_head = NULL, *to_retry_tail = NULL;
+  json_t *command_response;
+  json_array_foreach(command_responses, index, command_response) {
+    if (index == 0) {
+      // Skip poll response; don't increment command_iter
+      continue;
+    }
+
+    if (!command_iter) {
+      cosmo_log(instance, "more responses than requests");
+      continue;
+    }
+    struct cosmo_command *command_next = command_iter->next;
+
+    char *result;
+    if (json_unpack(command_response, "{ss}", "result", &result)) {
+      cosmo_log(instance, "invalid command response");
+      cosmo_append_command(&to_retry_head, &to_retry_tail, command_iter);
+      command_iter = command_next;
+      continue;
+    }
+    if (!strcmp(result, "retry")) {
+      cosmo_append_command(&to_retry_head, &to_retry_tail, command_iter);
+      command_iter = command_next;
+      continue;
+    }
+
+    instance->completing_command_id = command_iter->id;
+    bool retry = cosmo_complete_rpc(instance, command_iter, command_response);
+    instance->completing_command_id = 0;
+    if (retry) {
+      cosmo_append_command(&to_retry_head, &to_retry_tail, command_iter);
+      command_iter = command_next;
+      continue;
+    }
+    if (command_iter->journal_offset != SIZE_MAX) {
+      cosmo_journal_complete(instance->journal, command_iter->journal_offset);
+    }
+
+    cosmo_command_free(instance, command_iter);
+    command_iter = command_next;
+  }
+
+  json_decref(received);
+
+  return to_retry_head;
+}
+
+// Puts a list of commands back at the front of the queue, ahead of any later
+// commands for the same subjects.
+static void cosmo_requeue_commands(cosmo *instance, struct cosmo_command *commands) {
+  if (!commands) {
+    return;
+  }
+  struct cosmo_command *tail = commands;
+  while (true) {
+    instance->command_queue_length++;
+    instance->command_queue_bytes += tail->size;
+    if (!tail->next) {
+      break;
+    }
+    tail = tail->next;
+  }
+  tail->next = instance->command_queue_head;
+  if (tail->next) {
+    tail->next->prev = tail;
+  } else {
+    instance->command_queue_tail = tail;
+  }
+  commands->prev = NULL;
+  instance->command_queue_head = commands;
+}
+
+static json_t *cosmo_command_subject(const struct cosmo_command *command) {
+  return json_object_get(json_object_get(command->command, "arguments"), "subject");
+}
+
+// Subscribes from cosmo_resubscribe() carry many subjects instead of one.
+static json_t *cosmo_command_subjects(const struct cosmo_command *command) {
+  return json_object_get(json_object_get(command->command, "arguments"), "subjects");
+}
+
+#define SUBJECT_SET_MIN_CAPACITY 16
+
+static void cosmo_subject_set_insert(struct cosmo_subject_set *set, uint64_t hash) {
+  size_t mask = set->capacity - 1;
+  size_t i = hash & mask;
+  while (set->slots[i] && set->slots[i] != hash) {
+    i = (i + 1) & mask;
+  }
+  set->count += !set->slots[i];
+  set->slots[i] = hash;
+}
+
+static void cosmo_subject_set_add(struct cosmo_subject_set *set, const json_t *subject) {
+  if ((set->count + 1) * SUBSCRIPTIONS_LOAD_DEN > set->capacity * SUBSCRIPTIONS_LOAD_NUM) {
+    uint64_t *old_slots = set->slots;
+    size_t old_capacity = set->capacity;
+    set->capacity = max(old_capacity * 2, (size_t) SUBJECT_SET_MIN_CAPACITY);
+    set->slots = cosmo_zalloc(set->allocator, set->capacity * sizeof(*set->slots));
+    set->count = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_slots[i]) {
+        cosmo_subject_set_insert(set, old_slots[i]);
+      }
+    }
+    cosmo_dealloc(set->allocator, old_slots);
+  }
+  uint64_t hash;
+  cosmo_subject_key(subject, NULL, &hash);
+  // 0 marks an empty slot.
+  cosmo_subject_set_insert(set, hash ? hash : 1);
+}
+
+static bool cosmo_subject_set_contains(const struct cosmo_subject_set *set, const json_t *subject) {
+  if (!set->count) {
+    return false;
+  }
+  uint64_t hash;
+  cosmo_subject_key(subject, NULL, &hash);
+  hash = hash ? hash : 1;
+  size_t mask = set->capacity - 1;
+  for (size_t i = hash & mask; set->slots[i]; i = (i + 1) & mask) {
+    if (set->slots[i] == hash) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void cosmo_subject_set_clear(struct cosmo_subject_set *set) {
+  if (set->count) {
+    memset(set->slots, 0, set->capacity * sizeof(*set->slots));
+    set->count = 0;
+  }
+}
+
+static void cosmo_block_command_subjects(struct cosmo_subject_set *blocked, const struct cosmo_command *command) {
+  json_t *subject = cosmo_command_subject(command);
+  if (subject) {
+    cosmo_subject_set_add(blocked, subject);
+  }
+  size_t index;
+  json_t *arguments;
+  json_array_foreach(cosmo_command_subjects(command), index, arguments) {
+    cosmo_subject_set_add(blocked, json_object_get(arguments, "subject"));
+  }
 }
 
-// Takes ownership of arguments.
-static json_t *cosmo_command(const char *name, const json_t *arguments) {
-  return json_pack("{ssso}", "command", name, "arguments", arguments);
+static bool cosmo_command_blocked(const struct cosmo_subject_set *blocked, const struct cosmo_command *command) {
+  json_t *subject = cosmo_command_subject(command);
+  if (subject && cosmo_subject_set_contains(blocked, subject)) {
+    return true;
+  }
+  size_t index;
+  json_t *arguments;
+  json_array_foreach(cosmo_command_subjects(command), index, arguments) {
+    if (cosmo_subject_set_contains(blocked, json_object_get(arguments, "subject"))) {
+      return true;
+    }
+  }
+  return false;
 }
 
-static void cosmo_resubscribe(cosmo *instance) {
-  size_t i;
-  json_t *subscription;
-  json_array_foreach(instance->subscriptions, i, subscription) {
-    int state;
-    json_t *subject, *messages;
-    assert(!json_unpack(subscription, "{sisoso}", "state", &state, "subject", &subject, "messages", &messages));
+// Takes the queued commands that can go out now, up to the batch limits. A
+// command waits if its subject has a command in flight in another RPC, and so
+// do later commands for the same subject, so each subject's commands reach the
+// server in order.
+static struct cosmo_command *cosmo_take_commands(cosmo *instance) {
+  struct cosmo_command *head = NULL, *tail = NULL;
+  bool in_flight = false;
+  for (size_t i = 0; i < instance->num_rpcs; i++) {
+    in_flight |= instance->rpcs[i].in_flight;
+  }
+  if (!in_flight && !instance->options.max_batch_commands && !instance->options.max_batch_bytes) {
+    head = instance->command_queue_head;
+    instance->command_queue_head = instance->command_queue_tail = NULL;
+    instance->command_queue_length = instance->command_queue_bytes = 0;
+    return head;
+  }
 
-    if (state == SUBSCRIPTION_PENDING) {
-      continue;
+  struct cosmo_subject_set *blocked = &instance->blocked_subjects;
+  cosmo_subject_set_clear(blocked);
+  for (size_t i = 0; i < instance->num_rpcs; i++) {
+    for (struct cosmo_command *iter = instance->rpcs[i].commands; iter; iter = iter->next) {
+      cosmo_block_command_subjects(blocked, iter);
     }
+  }
 
-    json_t *arguments = json_pack("{sO}", "subject", subject);
-    if (json_array_size(messages)) {
-      // Restart at the last actual ID we received.
-      json_t *last_message = json_array_get(messages, json_array_size(messages) - 1);
-      json_object_set(arguments, "last_id", json_object_get(last_message, "id"));
+  size_t length = 0, bytes = 0;
+  struct cosmo_command *iter = instance->command_queue_head;
+  while (iter) {
+    struct cosmo_command *next = iter->next;
+    if (cosmo_command_blocked(blocked, iter)) {
+      if (cosmo_command_subjects(iter)) {
+        // Later commands for any of its subjects must wait for it.
+        cosmo_block_command_subjects(blocked, iter);
+      }
     } else {
-      json_t *num_messages = json_object_get(subscription, "num_messages");
-      if (num_messages) {
-        json_object_set(arguments, "messages", num_messages);
+      // Always take one, however big.
+      if (length && ((instance->options.max_batch_commands && length >= instance->options.max_batch_commands) ||
+                     (instance->options.max_batch_bytes && bytes + iter->size > instance->options.max_batch_bytes))) {
+        break;
       }
-      json_t *last_id = json_object_get(subscription, "last_id");
-      if (last_id) {
-        json_object_set(arguments, "last_id", last_id);
+      if (iter->prev) {
+        iter->prev->next = iter->next;
+      } else {
+        instance->command_queue_head = iter->next;
       }
+      if (iter->next) {
+        iter->next->prev = iter->prev;
+      } else {
+        instance->command_queue_tail = iter->prev;
+      }
+      cosmo_append_command(&head, &tail, iter);
+      length++;
+      bytes += iter->size;
     }
-
-    cosmo_send_command_locked(instance, cosmo_command("subscribe", arguments), NULL);
+    iter = next;
   }
+  instance->command_queue_length -= length;
+  instance->command_queue_bytes -= bytes;
+
+  return head;
 }
 
-// Takes ownership of commands.
-// Takes ownership of ack.
-static struct cosmo_command *cosmo_send_rpc(cosmo *instance, struct cosmo_command *commands, json_t *ack) {
-  json_t *int_commands = json_array();
+// The current poll interval, staggered so that clients don't synchronize.
+static uint64_t cosmo_poll_delay(cosmo *instance) {
+  uint64_t interval = instance->poll_interval_ms;
+  return interval + cosmo_random() % (interval / CYCLE_STAGGER_FACTOR + 1);
+}
 
-  // Always poll.
-  json_t *arguments = json_pack("{so}", "ack", ack);
-  json_array_append_new(int_commands, cosmo_command("poll", arguments));
-  struct cosmo_command *command_iter = commands;
-  while (command_iter) {
-    json_array_append(int_commands, command_iter->command);
-    command_iter = command_iter->next;
+// Polls speed up to min_poll_ms while messages are arriving, and back off
+// exponentially to max_poll_ms while they aren't or RPCs are failing.
+static void cosmo_adapt_poll_interval(cosmo *instance, bool active) {
+  if (active) {
+    instance->poll_interval_ms = instance->options.min_poll_ms;
+    instance->next_delay_ms = min(instance->next_delay_ms, cosmo_poll_delay(instance));
+  } else {
+    instance->poll_interval_ms = min(instance->poll_interval_ms * 2, (uint64_t) instance->options.max_poll_ms);
   }
+}
 
-  char *request = cosmo_build_rpc(instance, int_commands);
-  cosmo_log(instance, "--> %s", request);
+static void cosmo_rpc_due(cosmo *instance, struct cosmo_rpc *rpc, struct cosmo_command *commands) {
+  // Empty ones carry over rather than being replaced every RPC; the poll is
+  // encoded before anything can be added.
+  json_t *ack = instance->ack;
+  instance->ack = json_array_size(ack) ? json_array() : json_incref(ack);
+  json_t *ack_cursors = instance->ack_cursors;
+  instance->ack_cursors = json_object_size(ack_cursors) ? json_object() : json_incref(ack_cursors);
 
-  char *response = cosmo_send_http(instance, request);
-  json_decref(int_commands);
-  if (!response) {
-    return commands;
-  }
-  cosmo_log(instance, "<-- %s", response);
+  instance->next_delay_ms = cosmo_poll_delay(instance);
 
-  json_error_t error;
-  json_t *received = json_loads(response, 0, &error);
-  if (!received) {
-    cosmo_log(instance, "json_loads() failed: %s (json: \"%s\")", error.text, response);
-    free(response);
-    return commands;
+  cosmo_start_rpc(instance, rpc, commands, ack, ack_cursors);
+}
+
+static void cosmo_rebase_journal_offsets(struct cosmo_command *commands, size_t moved) {
+  for (struct cosmo_command *iter = commands; iter; iter = iter->next) {
+    if (iter->journal_offset != SIZE_MAX) {
+      iter->journal_offset -= moved;
+    }
   }
-  free(response);
+}
 
-  json_t *command_responses, *events, *profile;
-  if (json_unpack(received, "{sososo}", "profile", &profile, "responses", &command_responses, "events", &events)) {
-    cosmo_log(instance, "invalid server response");
-    json_decref(received);
-    return commands;
+// Once commands are only on the queue or in flight, so that all their
+// journal offsets can be found.
+static void cosmo_compact_journal(cosmo *instance) {
+  if (!instance->journal) {
+    return;
+  }
+  size_t moved = cosmo_journal_compact(instance->journal);
+  if (!moved) {
+    return;
+  }
+  cosmo_rebase_journal_offsets(instance->command_queue_head, moved);
+  for (size_t i = 0; i < instance->num_rpcs; i++) {
+    cosmo_rebase_journal_offsets(instance->rpcs[i].commands, moved);
   }
+}
 
-  // TODO: major locking problems through here
-  if (!json_equal(instance->profile, profile)) {
-    json_decref(instance->profile);
-    json_incref(profile);
-    instance->profile = profile;
-    struct cosmo_get_profile *get_profile_iter = instance->get_profile_head;
-    while (get_profile_iter) {
-      struct cosmo_get_profile *next = get_profile_iter->next;
-      json_incref(instance->profile);
-      assert(!pthread_mutex_unlock(&instance->lock));
-      promise_succeed(get_profile_iter->promise, instance->profile, (promise_cleanup)json_decref);
-      assert(!pthread_mutex_lock(&instance->lock));
-      free(get_profile_iter);
-      get_profile_iter = next;
+// Whether a queued command is waiting for a subject of one of commands.
+static bool cosmo_commands_block_queue(cosmo *instance, const struct cosmo_command *commands) {
+  if (!commands || !instance->command_queue_head) {
+    return false;
+  }
+  struct cosmo_subject_set *blocked = &instance->blocked_subjects;
+  cosmo_subject_set_clear(blocked);
+  for (const struct cosmo_command *iter = commands; iter; iter = iter->next) {
+    cosmo_block_command_subjects(blocked, iter);
+  }
+  for (const struct cosmo_command *iter = instance->command_queue_head; iter; iter = iter->next) {
+    if (cosmo_command_blocked(blocked, iter)) {
+      return true;
     }
-    instance->get_profile_head = NULL;
   }
+  return false;
+}
 
-  // Should actually be a monotonic clock.
-  assert(timespec_get(&instance->last_success, TIME_UTC) == TIME_UTC);
-  cosmo_handle_connect(instance);
-
-  size_t index;
-  json_t *event;
-  json_array_foreach(events, index, event) {
-    cosmo_handle_event(instance, event);
+static void cosmo_rpc_done(cosmo *instance, struct cosmo_rpc *rpc, CURLcode res) {
+  struct cosmo_command *commands = rpc->commands;
+  rpc->commands = NULL;
+  // Before they're completed and freed.
+  bool unblocks = cosmo_commands_block_queue(instance, commands);
+  struct cosmo_command *to_retry = cosmo_handle_response(instance, rpc, commands, cosmo_finish_http(instance, rpc, res));
+  // Messages streamed from a response that then failed.
+  cosmo_flush_message_batch(instance);
+  cosmo_release_recv_buf(&instance->allocator, &rpc->transfer);
+  cosmo_adapt_poll_interval(instance, instance->messages_received != rpc->messages_received);
+  // Before the first success, any failure counts.
+  if (instance->connect_state != CONNECTED || cosmo_now_ms() - instance->last_success_ms > CONNECT_TIMEOUT_S * MS_PER_S) {
+    cosmo_handle_disconnect(instance);
   }
 
-  json_t *poll_response = json_array_get(command_responses, 0);
-  json_t *instance_generation;
-  if (json_unpack(poll_response, "{so}", "instance_generation", &instance_generation)) {
-    cosmo_log(instance, "invalid poll response");
-  } else {
-    if (!json_equal(instance_generation, instance->generation)) {
-      json_decref(instance->generation);
-      json_incref(instance_generation);
-      instance->generation = instance_generation;
-      cosmo_resubscribe(instance);
+  for (struct cosmo_command *iter = to_retry; iter; iter = iter->next) {
+    instance->counters.retries++;
+  }
+  uint64_t now = cosmo_now_ms();
+  uint64_t next_rpc_ms = now + instance->next_delay_ms;
+  if (instance->command_queue_head) {
+    if (unblocks || cosmo_batch_full(instance)) {
+      // Commands were waiting on this RPC's subjects, or lingering can't
+      // add to them; they can go now.
+      next_rpc_ms = now;
+    } else {
+      // Otherwise they keep lingering, from when the oldest was queued.
+      next_rpc_ms = min(next_rpc_ms, instance->command_queue_head->queued_ms + max(instance->options.linger_ms, 0));
     }
   }
+  cosmo_requeue_commands(instance, to_retry);
+  cosmo_compact_journal(instance);
 
-  command_iter = commands;
-  struct cosmo_command *to_retry_head = NULL, *to_retry_tail = NULL;
-  json_t *command_response;
-  json_array_foreach(command_responses, index, command_response) {
-    if (index == 0) {
-      // Skip poll response; don't increment command_iter
-      continue;
-    }
+  instance->next_rpc_ms = next_rpc_ms;
+}
 
-    if (!command_iter) {
-      cosmo_log(instance, "more responses than requests");
-      continue;
+// Drops an in-flight RPC, putting its commands back on the queue. Events the
+// server would have returned stay unacked, so they come back on the next poll.
+static void cosmo_rpc_abort(cosmo *instance, struct cosmo_rpc *rpc) {
+  assert(!curl_multi_remove_handle(instance->loop_thread->multi, rpc->curl));
+  rpc->in_flight = false;
+  cosmo_release_request(&instance->allocator, rpc);
+  cosmo_release_recv_buf(&instance->allocator, &rpc->transfer);
+  cosmo_requeue_commands(instance, rpc->commands);
+  rpc->commands = NULL;
+}
+
+// Starts whatever RPCs are due on the instance. Returns how long until the
+// next might be; completions of those in flight wake the loop regardless.
+static uint64_t cosmo_start_due_rpcs(cosmo *instance, uint64_t now) {
+  while (instance->next_rpc_ms <= now) {
+    struct cosmo_rpc *free_rpc = NULL, *hanging_rpc = NULL;
+    bool in_flight = false;
+    for (size_t i = 0; i < instance->num_rpcs; i++) {
+      struct cosmo_rpc *rpc = &instance->rpcs[i];
+      if (!rpc->in_flight) {
+        free_rpc = free_rpc ? free_rpc : rpc;
+      } else {
+        in_flight = true;
+        if (rpc->hanging) {
+          hanging_rpc = rpc;
+        }
+      }
     }
-    struct cosmo_command *command_next = command_iter->next;
 
-    char *result;
-    if (json_unpack(command_response, "{ss}", "result", &result)) {
-      cosmo_log(instance, "invalid command response");
-      cosmo_append_command(&to_retry_head, &to_retry_tail, command_iter);
-      command_iter = command_next;
-      continue;
+    // Polls only need to go out when nothing else is in flight. Whatever is
+    // in flight makes the next RPC due when it completes; until then, keep
+    // next_rpc_ms current so that new commands still linger.
+    if (in_flight && !instance->command_queue_head) {
+      instance->next_rpc_ms = now + CYCLE_MS;
+      return CYCLE_MS;
     }
-    if (!strcmp(result, "retry")) {
-      cosmo_append_command(&to_retry_head, &to_retry_tail, command_iter);
-      command_iter = command_next;
-      continue;
+    if (!free_rpc) {
+      if (!hanging_rpc) {
+        instance->next_rpc_ms = now + CYCLE_MS;
+        return CYCLE_MS;
+      }
+      // Don't make new commands wait out a hanging poll.
+      cosmo_rpc_abort(instance, hanging_rpc);
+      free_rpc = hanging_rpc;
+      in_flight = false;
+      for (size_t i = 0; i < instance->num_rpcs; i++) {
+        in_flight |= instance->rpcs[i].in_flight;
+      }
     }
 
-    cosmo_complete_rpc(instance, command_iter, command_response);
-
-    json_decref(command_iter->command);
-    free(command_iter);
-    command_iter = command_next;
+    struct cosmo_command *commands = cosmo_take_commands(instance);
+    if (in_flight && !commands) {
+      // Everything queued is waiting on an RPC in flight.
+      instance->next_rpc_ms = now + CYCLE_MS;
+      return CYCLE_MS;
+    }
+    cosmo_rpc_due(instance, free_rpc, commands);
+    if (!instance->command_queue_head) {
+      // Stay due while a batch limit leaves commands queued, so they can
+      // take another slot; otherwise new commands linger from here.
+      instance->next_rpc_ms = now + instance->next_delay_ms;
+    }
   }
+  return instance->next_rpc_ms - now;
+}
 
-  json_decref(received);
-
-  return to_retry_head;
+// Called on the loop thread with the instance locked; the loop forgets the
+// instance afterwards.
+static void cosmo_loop_detach(cosmo *instance) {
+  for (size_t i = 0; i < instance->num_rpcs; i++) {
+    if (instance->rpcs[i].in_flight) {
+      // Hand commands back to cosmo_shutdown() for cleanup.
+      cosmo_rpc_abort(instance, &instance->rpcs[i]);
+    }
+  }
+  instance->detached = true;
+  assert(!pthread_cond_signal(&instance->cond));
 }
 
-static void *cosmo_thread_main(void *arg) {
-  cosmo *instance = arg;
+static void *cosmo_loop_thread_main(void *arg) {
+  struct cosmo_loop_thread *loop_thread = arg;
+
+  while (true) {
+    assert(!pthread_mutex_lock(&loop_thread->lock));
+    bool shutdown = loop_thread->shutdown;
+    while (loop_thread->attach_head) {
+      cosmo *instance = loop_thread->attach_head;
+      loop_thread->attach_head = instance->loop_next;
+      instance->loop_next = loop_thread->instances;
+      loop_thread->instances = instance;
+    }
+    assert(!pthread_mutex_unlock(&loop_thread->lock));
+    if (shutdown) {
+      assert(!loop_thread->instances);
+      break;
+    }
 
-  assert(!pthread_mutex_lock(&instance->lock));
-  while (!instance->shutdown) {
-    struct cosmo_command *commands = instance->command_queue_head;
-    instance->command_queue_head = instance->command_queue_tail = NULL;
-    json_t *ack = instance->ack;
-    instance->ack = json_array();
-
-    instance->next_delay_ms = CYCLE_MS;
-    instance->next_delay_ms += cosmo_random() % (instance->next_delay_ms / CYCLE_STAGGER_FACTOR);
-
-    struct cosmo_command *to_retry = cosmo_send_rpc(instance, commands, ack);
-    {
-      struct timespec now;
-      assert(timespec_get(&now, TIME_UTC) == TIME_UTC);
-      if (now.tv_sec - instance->last_success.tv_sec > CONNECT_TIMEOUT_S) {
-        cosmo_handle_disconnect(instance);
+    // Start due RPCs, retire shut down instances, and find the next deadline.
+    uint64_t now = cosmo_now_ms();
+    uint64_t timeout_ms = CYCLE_MS;
+    cosmo **instance_iter = &loop_thread->instances;
+    while (*instance_iter) {
+      cosmo *instance = *instance_iter;
+      cosmo_lock(instance);
+      if (instance->shutdown) {
+        *instance_iter = instance->loop_next;
+        cosmo_loop_detach(instance);
+        cosmo_unlock(instance);
+        continue;
       }
+      timeout_ms = min(timeout_ms, cosmo_start_due_rpcs(instance, now));
+      cosmo_unlock(instance);
+      instance_iter = &instance->loop_next;
     }
 
-    if (to_retry) {
-      to_retry->prev = instance->command_queue_tail;
-      if (to_retry->prev) {
-        to_retry->prev->next = to_retry;
-      }
-      instance->command_queue_tail = to_retry;
-      if (!instance->command_queue_head) {
-        instance->command_queue_head = to_retry;
+    int running;
+    assert(!curl_multi_perform(loop_thread->multi, &running));
+
+    bool completed = false;
+    CURLMsg *msg;
+    int queued;
+    while ((msg = curl_multi_info_read(loop_thread->multi, &queued))) {
+      if (msg->msg != CURLMSG_DONE) {
+        continue;
       }
+      // msg doesn't survive curl_multi_remove_handle().
+      CURL *curl = msg->easy_handle;
+      CURLcode res = msg->data.result;
+      struct cosmo_rpc *rpc;
+      assert(curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **) &rpc) == CURLE_OK);
+      assert(!curl_multi_remove_handle(loop_thread->multi, curl));
+
+      cosmo *instance = rpc->instance;
+      cosmo_lock(instance);
+      cosmo_rpc_done(instance, rpc, res);
+      cosmo_unlock(instance);
+      completed = true;
+    }
+    if (completed) {
+      // Instances may be due again immediately.
+      continue;
     }
 
-#define MS_PER_S 1000
-#define NS_PER_MS 1000000
-    struct timespec ts;
-    assert(timespec_get(&ts, TIME_UTC) == TIME_UTC);
-    uint64_t target_ms = (ts.tv_sec * MS_PER_S) + (ts.tv_nsec / NS_PER_MS) + instance->next_delay_ms;
-    ts.tv_sec = target_ms / MS_PER_S;
-    ts.tv_nsec = (target_ms % MS_PER_S) * NS_PER_MS;
-    pthread_cond_timedwait(&instance->cond, &instance->lock, &ts);
+    struct curl_waitfd wakeup = {
+      .fd = loop_thread->wakeup_fds[0],
+      .events = CURL_WAIT_POLLIN,
+    };
+    assert(!curl_multi_wait(loop_thread->multi, &wakeup, 1, timeout_ms, NULL));
+    char buf[64];
+    while (read(loop_thread->wakeup_fds[0], buf, sizeof(buf)) > 0) {
+    }
   }
-  assert(!pthread_mutex_unlock(&instance->lock));
+
   return NULL;
 }
 
+static void cosmo_loop_attach(cosmo *instance) {
+  cosmo_loop *loop = instance->loop;
+  assert(!pthread_mutex_lock(&loop->lock));
+  instance->loop_thread = &loop->threads[loop->next_thread];
+  loop->next_thread = (loop->next_thread + 1) % loop->num_threads;
+  assert(!pthread_mutex_unlock(&loop->lock));
+
+  struct cosmo_loop_thread *loop_thread = instance->loop_thread;
+  assert(!pthread_mutex_lock(&loop_thread->lock));
+  instance->loop_next = loop_thread->attach_head;
+  loop_thread->attach_head = instance;
+  cosmo_loop_wakeup(loop_thread);
+  assert(!pthread_mutex_unlock(&loop_thread->lock));
+}
+
+
+// Whether url is plain HTTP to this host.
+static bool cosmo_loopback_http(const char *url) {
+  const char *scheme = "http://";
+  if (strncasecmp(url, scheme, strlen(scheme))) {
+    return false;
+  }
+  const char *host = url + strlen(scheme);
+  size_t host_len = host[0] == '[' ? strcspn(host, "]") + 1 : strcspn(host, ":/");
+  char host_buf[host_len + 1];
+  memcpy(host_buf, host, host_len);
+  host_buf[host_len] = '\0';
+  if (!strcasecmp(host_buf, "localhost") || !strcmp(host_buf, "[::1]")) {
+    return true;
+  }
+  struct in_addr addr;
+  return inet_pton(AF_INET, host_buf, &addr) == 1 && (ntohl(addr.s_addr) >> 24) == 127;
+}
+
+static void cosmo_rpc_init(cosmo *instance, struct cosmo_rpc *rpc, const char *api_url) {
+  rpc->instance = instance;
+  rpc->in_flight = false;
+  rpc->hanging = false;
+  rpc->request_buf = NULL;
+  rpc->request_buf_capacity = 0;
+  rpc->request = NULL;
+  rpc->commands = NULL;
+  rpc->transfer.recv_buf = NULL;
+  rpc->transfer.recv_buf_capacity = 0;
+
+  rpc->curl = curl_easy_init();
+  assert(rpc->curl);
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_URL, api_url));
+  long protocols = CURLPROTO_HTTPS;
+  if (instance->options.allow_http_loopback && cosmo_loopback_http(api_url)) {
+    protocols |= CURLPROTO_HTTP;
+  }
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_PROTOCOLS, protocols));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTPS));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_SSL_CIPHER_LIST, "EECDH+AESGCM:EDH+AESGCM:AES256+EECDH:AES256+EDH"));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_TIMEOUT_MS, CYCLE_MS));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_POST, 1L));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_READFUNCTION, cosmo_read_callback));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_READDATA, &rpc->transfer));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_WRITEFUNCTION, cosmo_write_callback));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_WRITEDATA, rpc));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_HEADERFUNCTION, cosmo_header_callback));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_HEADERDATA, &rpc->transfer));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_PRIVATE, rpc));
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_NOSIGNAL, 1L));
+  // Concurrent RPCs share one HTTP/2 connection where possible.
+  assert(!curl_easy_setopt(rpc->curl, CURLOPT_PIPEWAIT, 1L));
+  if (instance->options.compress) {
+    // Whatever this libcurl can decode.
+    assert(!curl_easy_setopt(rpc->curl, CURLOPT_ACCEPT_ENCODING, ""));
+  }
+}
+
 
 // Public interface below
 
@@ -608,28 +2663,80 @@ void cosmo_uuid(char *uuid) {
   uuid_unparse_lower(uu, uuid);
 }
 
+cosmo_loop *cosmo_loop_create(size_t num_threads) {
+  assert(num_threads);
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  cosmo_loop *loop = malloc(sizeof(*loop) + num_threads * sizeof(*loop->threads));
+  assert(loop);
+  assert(!pthread_mutex_init(&loop->lock, NULL));
+  loop->next_thread = 0;
+  loop->num_threads = num_threads;
+
+  for (size_t i = 0; i < num_threads; i++) {
+    struct cosmo_loop_thread *loop_thread = &loop->threads[i];
+    loop_thread->multi = curl_multi_init();
+    assert(loop_thread->multi);
+    assert(!curl_multi_setopt(loop_thread->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX));
+    assert(!pipe(loop_thread->wakeup_fds));
+    assert(!fcntl(loop_thread->wakeup_fds[0], F_SETFL, O_NONBLOCK));
+    assert(!fcntl(loop_thread->wakeup_fds[1], F_SETFL, O_NONBLOCK));
+    loop_thread->instances = NULL;
+    assert(!pthread_mutex_init(&loop_thread->lock, NULL));
+    loop_thread->attach_head = NULL;
+    loop_thread->shutdown = false;
+    assert(!pthread_create(&loop_thread->thread, NULL, cosmo_loop_thread_main, loop_thread));
+  }
+
+  return loop;
+}
+
+void cosmo_loop_destroy(cosmo_loop *loop) {
+  for (size_t i = 0; i < loop->num_threads; i++) {
+    struct cosmo_loop_thread *loop_thread = &loop->threads[i];
+    assert(!pthread_mutex_lock(&loop_thread->lock));
+    loop_thread->shutdown = true;
+    cosmo_loop_wakeup(loop_thread);
+    assert(!pthread_mutex_unlock(&loop_thread->lock));
+  }
+
+  for (size_t i = 0; i < loop->num_threads; i++) {
+    struct cosmo_loop_thread *loop_thread = &loop->threads[i];
+    assert(!pthread_join(loop_thread->thread, NULL));
+    assert(!loop_thread->attach_head);
+    assert(!pthread_mutex_destroy(&loop_thread->lock));
+    assert(!curl_multi_cleanup(loop_thread->multi));
+    assert(!close(loop_thread->wakeup_fds[0]));
+    assert(!close(loop_thread->wakeup_fds[1]));
+  }
+
+  assert(!pthread_mutex_destroy(&loop->lock));
+  free(loop);
+
+  curl_global_cleanup();
+}
+
 void cosmo_get_profile(cosmo *instance, promise *promise_obj) {
-  assert(!pthread_mutex_lock(&instance->lock));
+  cosmo_lock(instance);
   if (json_is_string(instance->profile)) {
     json_t *profile = instance->profile;
     json_incref(profile);
-    assert(!pthread_mutex_unlock(&instance->lock));
+    cosmo_unlock(instance);
     promise_succeed(promise_obj, instance->profile, (promise_cleanup)json_decref);
     return;
   }
-  struct cosmo_get_profile *entry = malloc(sizeof(*entry));
-  assert(entry);
+  struct cosmo_get_profile *entry = cosmo_alloc(&instance->allocator, sizeof(*entry));
   entry->next = instance->get_profile_head;
   entry->promise = promise_obj;
   instance->get_profile_head = entry;
-  assert(!pthread_mutex_unlock(&instance->lock));
+  cosmo_unlock(instance);
 }
 
 json_t *cosmo_current_profile(cosmo *instance) {
-  assert(!pthread_mutex_lock(&instance->lock));
+  cosmo_lock(instance);
   json_t *profile = instance->profile;
   json_incref(profile);
-  assert(!pthread_mutex_unlock(&instance->lock));
+  cosmo_unlock(instance);
   return profile;
 }
 
@@ -644,6 +2751,67 @@ json_t *cosmo_subject(const char *name, const char *readable_only_by, const char
   return ret;
 }
 
+// Whether a cache holding history to depth (as cosmo_subscribe()'s messages)
+// has everything a subscription asking for messages or last_id needs.
+static bool cosmo_cache_covers(json_int_t depth, json_int_t messages, json_int_t last_id) {
+  if (depth < 0) {
+    return true;
+  }
+  return !last_id && messages >= 0 && messages <= depth;
+}
+
+// Loads a new subscription's messages from its cache file, which then keeps
+// a record of those that arrive. The file is a journal whose first record is a
+// header (the subject, the depth of history it holds and raw_messages) and the
+// rest message events; nothing is ever marked done. Each open rewrites it to
+// what its depth needs, and starts it over if it can't serve this subscription;
+// so does outgrowing that depth (see cosmo_cache_append()).
+static void cosmo_cache_open(cosmo *instance, struct cosmo_subscription *subscription, json_int_t messages, json_int_t last_id) {
+  char path[strlen(instance->options.cache_dir) + 24];
+  sprintf(path, "%s/%016jx.cache", instance->options.cache_dir, (uintmax_t) subscription->hash);
+  struct cosmo_journal *cache = cosmo_alloc(&instance->allocator, sizeof(*cache));
+  if (!cosmo_journal_open(cache, path, &instance->allocator)) {
+    // No usable cache_dir, or another instance is caching this subject.
+    cosmo_dealloc(&instance->allocator, cache);
+    return;
+  }
+
+  size_t offset = 0, record_offset;
+  json_t *header = cosmo_journal_next(cache, &offset, &record_offset);
+  json_t *subject = json_object_get(header, "subject");
+  if (subject && !json_equal(subject, subscription->subject)) {
+    // Hash collision; that subject keeps the file.
+    json_decref(header);
+    cosmo_journal_close(cache);
+    cosmo_dealloc(&instance->allocator, cache);
+    return;
+  }
+  json_int_t depth = json_integer_value(json_object_get(header, "messages"));
+  bool usable = subject &&
+      json_is_true(json_object_get(header, "raw_messages")) == instance->options.raw_messages &&
+      cosmo_cache_covers(depth, messages, last_id);
+  json_decref(header);
+
+  if (usable) {
+    json_t *event;
+    while ((event = cosmo_journal_next(cache, &offset, &record_offset))) {
+      json_int_t id;
+      if (!json_unpack(event, "{sI}", "id", &id)) {
+        cosmo_message_store_insert(&subscription->messages, id, event);
+      }
+      json_decref(event);
+    }
+  } else {
+    // What the server will send: messages since last_id are no particular
+    // depth of history.
+    depth = last_id ? 0 : messages;
+  }
+
+  subscription->cache = cache;
+  subscription->cache_depth = depth;
+  cosmo_cache_write(instance, subscription);
+}
+
 void cosmo_subscribe(cosmo *instance, json_t *subjects, const json_int_t messages, const json_int_t last_id, promise *promise_obj) {
   if (json_is_array(subjects)) {
     json_incref(subjects);
@@ -652,92 +2820,202 @@ void cosmo_subscribe(cosmo *instance, json_t *subjects, const json_int_t message
     assert(subjects);
   }
 
-  assert(!pthread_mutex_lock(&instance->lock));
+  // One promise for several subjects completes once they all have.
+  struct cosmo_command_group *group = NULL;
+  if (promise_obj && json_array_size(subjects) != 1) {
+    if (!json_array_size(subjects)) {
+      json_decref(subjects);
+      promise_succeed(promise_obj, NULL, NULL);
+      return;
+    }
+    group = cosmo_alloc(&instance->allocator, sizeof(*group));
+    group->remaining = json_array_size(subjects);
+    group->failed = false;
+    group->promise = promise_obj;
+    promise_obj = NULL;
+  }
+
+  cosmo_lock(instance);
   size_t i;
   json_t *subject;
   json_array_foreach(subjects, i, subject) {
-    json_t *subscription = cosmo_find_subscription(instance, subject);
+    struct cosmo_subscription *subscription = cosmo_subscriptions_find(&instance->subscriptions, subject);
+    const struct cosmo_message *cached_message = NULL;
     if (!subscription) {
-      subscription = json_pack("{sOs[]si}", "subject", subject, "messages", "state", SUBSCRIPTION_PENDING);
-      json_array_append_new(instance->subscriptions, subscription);
+      subscription = cosmo_subscriptions_add(&instance->subscriptions, subject);
+      if (instance->options.cache_dir) {
+        cosmo_cache_open(instance, subscription, messages, last_id);
+        cached_message = cosmo_message_store_last(&subscription->messages);
+      }
     }
 
     json_t *arguments = json_pack("{sO}", "subject", subject);
     if (messages) {
-      json_object_set_new(arguments, "messages", json_integer(messages));
-      json_object_set_new(subscription, "num_messages", json_integer(messages));
+      subscription->num_messages = messages;
     }
     if (last_id) {
-      json_object_set_new(arguments, "last_id", json_integer(last_id));
-      json_object_set_new(subscription, "last_id", json_integer(last_id));
+      subscription->last_id = last_id;
     }
-    cosmo_send_command_locked(instance, cosmo_command("subscribe", arguments), promise_obj);
+    if (cached_message && cached_message->id > last_id) {
+      // Only ask for what's newer than the cache, as cosmo_resubscribe() does.
+      json_object_set_new(arguments, "last_id", json_integer(cached_message->id));
+    } else {
+      if (messages) {
+        json_object_set_new(arguments, "messages", json_integer(messages));
+      }
+      if (last_id) {
+        json_object_set_new(arguments, "last_id", json_integer(last_id));
+      }
+    }
+    struct cosmo_command *command = cosmo_send_command_locked(instance, cosmo_command("subscribe", arguments), promise_obj);
+    command->group = group;
   }
-  assert(!pthread_cond_signal(&instance->cond));
-  assert(!pthread_mutex_unlock(&instance->lock));
+  cosmo_loop_wakeup(instance->loop_thread);
+  cosmo_unlock(instance);
 
   json_decref(subjects);
 }
 
 void cosmo_unsubscribe(cosmo *instance, json_t *subject, promise *promise_obj) {
-  assert(!pthread_mutex_lock(&instance->lock));
-  cosmo_remove_subscription(instance, subject);
+  cosmo_lock(instance);
+  struct cosmo_subscription *subscription = cosmo_subscriptions_find(&instance->subscriptions, subject);
+  if (subscription && subscription->cache) {
+    // Nothing will keep it current now. Someone may have beaten us to it.
+    if (unlink(subscription->cache->path) && errno != ENOENT) {
+      cosmo_log(instance, "can't remove cache %s: %s", subscription->cache->path, strerror(errno));
+    }
+  }
+  cosmo_subscriptions_remove(&instance->subscriptions, subject);
   json_t *arguments = json_pack("{sO}", "subject", subject);
   cosmo_send_command_locked(instance, cosmo_command("unsubscribe", arguments), promise_obj);
-  assert(!pthread_mutex_unlock(&instance->lock));
+  cosmo_unlock(instance);
 }
 
 void cosmo_send_message(cosmo *instance, json_t *subject, json_t *message, promise *promise_obj) {
   char sender_message_id[COSMO_UUID_SIZE];
   cosmo_uuid(sender_message_id);
-  char *encoded = json_dumps(message, JSON_ENCODE_ANY);
-  json_t *arguments = json_pack("{sOssss}",
+  // A copy, since the loop thread encodes it later and the caller may change
+  // or reuse theirs after the call.
+  json_t *arguments = json_pack("{sOsoss}",
       "subject", subject,
-      "message", encoded,
+      "message", json_deep_copy(message),
       "sender_message_id", sender_message_id);
   cosmo_send_command(instance, cosmo_command("sendMessage", arguments), promise_obj);
-  free(encoded);
+}
+
+void cosmo_send_messages(cosmo *instance, size_t num_messages, json_t **subjects, json_t **messages, promise *promise_obj, promise **promises) {
+  if (!num_messages) {
+    promise_succeed(promise_obj, NULL, NULL);
+    return;
+  }
+
+  struct cosmo_command_group *group = NULL;
+  if (promise_obj) {
+    group = cosmo_alloc(&instance->allocator, sizeof(*group));
+    group->remaining = num_messages;
+    group->failed = false;
+    group->promise = promise_obj;
+  }
+
+  // One UUID for the call; an index suffix keeps each message's ID unique.
+  char sender_message_id[COSMO_UUID_SIZE + 17];
+  cosmo_uuid(sender_message_id);
+  char *suffix = sender_message_id + COSMO_UUID_SIZE - 1;
+
+  cosmo_lock(instance);
+  for (size_t i = 0; i < num_messages; i++) {
+    sprintf(suffix, "-%zx", i);
+    json_t *arguments = json_object();
+    assert(arguments);
+    assert(!json_object_set(arguments, "subject", subjects[i]));
+    assert(!json_object_set_new(arguments, "message", json_deep_copy(messages[i])));
+    assert(!json_object_set_new(arguments, "sender_message_id", json_string(sender_message_id)));
+    struct cosmo_command *command = cosmo_send_command_locked(instance, cosmo_command("sendMessage", arguments), promises ? promises[i] : NULL);
+    command->group = group;
+  }
+  cosmo_sync_journal_locked(instance);
+  cosmo_loop_wakeup(instance->loop_thread);
+  cosmo_unlock(instance);
 }
 
 json_t *cosmo_get_messages(cosmo *instance, json_t *subject) {
-  assert(!pthread_mutex_lock(&instance->lock));
-  json_t *subscription = cosmo_find_subscription(instance, subject);
-  if (!subscription) {
-    assert(!pthread_mutex_unlock(&instance->lock));
+  cosmo_snapshot *snapshot = cosmo_get_snapshot(instance, subject);
+  if (!snapshot) {
     return NULL;
   }
-  json_t *messages = json_object_get(subscription, "messages");
-  json_t *ret = json_deep_copy(messages);
-  assert(!pthread_mutex_unlock(&instance->lock));
+
+  // Copy outside the lock.
+  json_t *ret = json_array();
+  assert(ret);
+  for (size_t i = 0; i < snapshot->length; i++) {
+    json_array_append_new(ret, json_deep_copy(snapshot->block->messages[i].event));
+  }
+  cosmo_snapshot_destroy(snapshot);
 
   return ret;
 }
 
 json_t *cosmo_get_last_message(cosmo *instance, json_t *subject) {
-  assert(!pthread_mutex_lock(&instance->lock));
-  json_t *subscription = cosmo_find_subscription(instance, subject);
-  if (!subscription) {
-    assert(!pthread_mutex_unlock(&instance->lock));
+  cosmo_snapshot *snapshot = cosmo_get_snapshot(instance, subject);
+  if (!snapshot) {
     return NULL;
   }
-  json_t *messages = json_object_get(subscription, "messages");
-  json_t *last_message = json_array_get(messages, json_array_size(messages) - 1);
-  json_t *ret = json_deep_copy(last_message);
-  assert(!pthread_mutex_unlock(&instance->lock));
 
+  json_t *ret = snapshot->length ? json_deep_copy(snapshot->block->messages[snapshot->length - 1].event) : NULL;
+  cosmo_snapshot_destroy(snapshot);
+
+  return ret;
+}
+
+json_t *cosmo_message_decode(const json_t *event) {
+  return json_loads(cosmo_message_raw(event), JSON_DECODE_ANY, NULL);
+}
+
+const char *cosmo_message_raw(const json_t *event) {
+  return json_string_value(json_object_get(event, "message"));
+}
+
+cosmo_snapshot *cosmo_get_snapshot(cosmo *instance, json_t *subject) {
+  cosmo_lock(instance);
+  struct cosmo_subscription *subscription = cosmo_subscriptions_find(&instance->subscriptions, subject);
+  cosmo_snapshot *ret = subscription ? cosmo_message_store_snapshot(&subscription->messages) : NULL;
+  cosmo_unlock(instance);
   return ret;
 }
 
+size_t cosmo_snapshot_length(const cosmo_snapshot *snapshot) {
+  return snapshot->length;
+}
+
+const json_t *cosmo_snapshot_get(const cosmo_snapshot *snapshot, size_t index) {
+  return index < snapshot->length ? snapshot->block->messages[index].event : NULL;
+}
+
+void cosmo_snapshot_destroy(cosmo_snapshot *snapshot) {
+  cosmo_message_block_decref(snapshot->block);
+  snapshot->free_func(snapshot);
+}
+
 cosmo *cosmo_create(const char *base_url, const char *client_id, const cosmo_callbacks *callbacks, const cosmo_options *options, void *passthrough) {
   curl_global_init(CURL_GLOBAL_DEFAULT);
 
-  cosmo *instance = malloc(sizeof(cosmo));
-  assert(instance);
+  struct cosmo_allocator allocator = cosmo_default_allocator;
+  if (options && options->malloc_func) {
+    assert(options->realloc_func && options->free_func);
+    allocator.malloc_func = options->malloc_func;
+    allocator.realloc_func = options->realloc_func;
+    allocator.free_func = options->free_func;
+  } else {
+    assert(!options || (!options->realloc_func && !options->free_func));
+  }
+  cosmo *instance = cosmo_alloc(&allocator, sizeof(cosmo));
+  instance->allocator = allocator;
 
+  memset(&instance->counters, 0, sizeof(instance->counters));
   assert(!pthread_mutex_init(&instance->lock, NULL));
   assert(!pthread_cond_init(&instance->cond, NULL));
 
-  assert(!pthread_mutex_lock(&instance->lock));
+  cosmo_lock(instance);
 
   instance->debug = getenv("COSMO_DEBUG");
 
@@ -749,6 +3027,18 @@ cosmo *cosmo_create(const char *base_url, const char *client_id, const cosmo_cal
   }
   instance->passthrough = passthrough;
 
+  instance->batch = NULL;
+  instance->batch_length = instance->batch_capacity = instance->batch_groups = 0;
+  instance->batch_generation = 1;
+
+  instance->dispatcher = NULL;
+  if (instance->options.dispatch_fd && !instance->options.dispatch_queue_size) {
+    instance->options.dispatch_queue_size = DISPATCH_FD_QUEUE_SIZE;
+  }
+  if (instance->options.dispatch_queue_size) {
+    cosmo_dispatcher_create(instance);
+  }
+
   cosmo_uuid(instance->instance_id);
   if (client_id) {
     strcpy(instance->client_id, client_id);
@@ -756,74 +3046,162 @@ cosmo *cosmo_create(const char *base_url, const char *client_id, const cosmo_cal
     cosmo_uuid(instance->client_id);
     cosmo_handle_client_id_change(instance);
   }
+  instance->envelope = NULL;
+
+  instance->gzip_headers = NULL;
+  instance->server_accepts_gzip = false;
+  if (instance->options.compress) {
+    instance->gzip_headers = curl_slist_append(NULL, "Content-Encoding: gzip");
+    assert(instance->gzip_headers);
+    if (!instance->options.compress_min_bytes) {
+      instance->options.compress_min_bytes = COMPRESS_MIN_BYTES;
+    }
+  }
 
-  instance->curl = curl_easy_init();
-  assert(instance->curl);
+  if (!instance->options.max_rpcs_in_flight) {
+    instance->options.max_rpcs_in_flight = 1;
+  }
+  instance->num_rpcs = instance->options.max_rpcs_in_flight;
+  instance->rpcs = cosmo_zalloc(&instance->allocator, instance->num_rpcs * sizeof(*instance->rpcs));
   char api_url[strlen(base_url) + 5];
   sprintf(api_url, "%s/api", base_url);
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_URL, api_url));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_PROTOCOLS, CURLPROTO_HTTPS));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_REDIR_PROTOCOLS, CURLPROTO_HTTPS));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_SSLVERSION, CURL_SSLVERSION_TLSv1_2));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_SSL_CIPHER_LIST, "EECDH+AESGCM:EDH+AESGCM:AES256+EECDH:AES256+EDH"));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_TIMEOUT_MS, CYCLE_MS));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_POST, 1L));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_READFUNCTION, cosmo_read_callback));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_WRITEFUNCTION, cosmo_write_callback));
-  assert(!curl_easy_setopt(instance->curl, CURLOPT_HEADERFUNCTION, cosmo_header_callback));
+  for (size_t i = 0; i < instance->num_rpcs; i++) {
+    cosmo_rpc_init(instance, &instance->rpcs[i], api_url);
+  }
 
   instance->shutdown = false;
   instance->profile = json_null();
   instance->get_profile_head = NULL;
   instance->generation = json_null();
   instance->command_queue_head = instance->command_queue_tail = NULL;
+  instance->command_queue_length = instance->command_queue_bytes = 0;
+  instance->next_command_id = instance->completing_command_id = 0;
+  instance->command_slabs = instance->command_slabs_tail = NULL;
+  memset(&instance->blocked_subjects, 0, sizeof(instance->blocked_subjects));
+  instance->blocked_subjects.allocator = &instance->allocator;
+  instance->journal = NULL;
+  if (instance->options.journal_path) {
+    instance->journal = cosmo_alloc(&instance->allocator, sizeof(*instance->journal));
+    if (!cosmo_journal_open(instance->journal, instance->options.journal_path, &instance->allocator)) {
+      // Unusable path, or another instance has it: carry on without one.
+      cosmo_log(instance, "can't open journal %s", instance->options.journal_path);
+      cosmo_dealloc(&instance->allocator, instance->journal);
+      instance->journal = NULL;
+    }
+  }
+  if (instance->journal) {
+    // Replay what the last instance on this journal didn't get acknowledged.
+    // The server drops any it did receive as duplicates.
+    size_t offset = 0, record_offset;
+    json_t *command;
+    while ((command = cosmo_journal_next(instance->journal, &offset, &record_offset))) {
+      struct cosmo_command *command_obj = cosmo_command_create(instance, command, NULL);
+      command_obj->journal_offset = record_offset;
+      cosmo_enqueue_command_locked(instance, command_obj);
+    }
+  }
   instance->ack = json_array();
   assert(instance->ack);
-  instance->subscriptions = json_array();
-  assert(instance->subscriptions);
+  instance->ack_cursors = json_object();
+  assert(instance->ack_cursors);
+  cosmo_subscriptions_init(&instance->subscriptions, &instance->allocator);
   instance->next_delay_ms = 0;
+  instance->next_rpc_ms = 0;
+  if (instance->options.min_poll_ms <= 0) {
+    instance->options.min_poll_ms = MIN_POLL_MS;
+  }
+  if (instance->options.max_poll_ms <= 0) {
+    instance->options.max_poll_ms = MAX_POLL_MS;
+  }
+  instance->options.max_poll_ms = max(instance->options.max_poll_ms, instance->options.min_poll_ms);
+  instance->poll_interval_ms = instance->options.min_poll_ms;
+  instance->messages_received = 0;
+  instance->max_subscribe_subjects = 0;
+  instance->embed_messages = false;
+  if (!instance->options.hanging_poll_ms) {
+    instance->options.hanging_poll_ms = HANGING_POLL_MS;
+  }
+  // Assume support until a hanging poll comes back without it.
+  instance->hanging_poll_supported = instance->options.hanging_poll_ms > 0;
 
   instance->connect_state = INITIAL_CONNECT;
   instance->login_state = LOGIN_UNKNOWN;
-  instance->last_success.tv_sec = 0;
+  instance->last_success_ms = 0;
 
-  assert(!pthread_mutex_unlock(&instance->lock));
+  instance->detached = false;
+  instance->owns_loop = !instance->options.loop;
+  instance->loop = instance->owns_loop ? cosmo_loop_create(1) : instance->options.loop;
 
-  assert(!pthread_create(&instance->thread, NULL, cosmo_thread_main, instance));
+  cosmo_unlock(instance);
+
+  cosmo_loop_attach(instance);
   return instance;
 }
 
 void cosmo_shutdown(cosmo *instance) {
-  pthread_mutex_lock(&instance->lock);
+  cosmo_lock(instance);
   instance->shutdown = true;
-  instance->next_delay_ms = 0;
-  pthread_cond_signal(&instance->cond);
-  pthread_mutex_unlock(&instance->lock);
-  assert(!pthread_join(instance->thread, NULL));
+  cosmo_loop_wakeup(instance->loop_thread);
+  while (!instance->detached) {
+    assert(!pthread_cond_wait(&instance->cond, &instance->lock));
+    instance->counters.locked_us = cosmo_now_us();
+  }
+  cosmo_unlock(instance);
+
+  if (instance->owns_loop) {
+    cosmo_loop_destroy(instance->loop);
+  }
+
+  if (instance->dispatcher) {
+    cosmo_dispatcher_destroy(instance);
+  }
+  cosmo_dealloc(&instance->allocator, instance->batch);
 
   assert(!pthread_mutex_destroy(&instance->lock));
   assert(!pthread_cond_destroy(&instance->cond));
   struct cosmo_command *command_iter = instance->command_queue_head;
   while (command_iter) {
-    json_decref(command_iter->command);
     struct cosmo_command *next = command_iter->next;
-    free(command_iter);
+    cosmo_group_release(instance, command_iter, false, false);
+    cosmo_command_free(instance, command_iter);
     command_iter = next;
   }
+  struct cosmo_command_slab *slab_iter = instance->command_slabs;
+  while (slab_iter) {
+    struct cosmo_command_slab *next = slab_iter->next;
+    cosmo_dealloc(&instance->allocator, slab_iter);
+    slab_iter = next;
+  }
+  if (instance->journal) {
+    // Commands still queued stay in the journal for the next instance.
+    cosmo_journal_close(instance->journal);
+    cosmo_dealloc(&instance->allocator, instance->journal);
+  }
   json_decref(instance->ack);
-  json_decref(instance->subscriptions);
+  json_decref(instance->ack_cursors);
+  cosmo_subscriptions_destroy(&instance->subscriptions);
+  cosmo_dealloc(&instance->allocator, instance->blocked_subjects.slots);
   json_decref(instance->profile);
   struct cosmo_get_profile *get_profile_iter = instance->get_profile_head;
   while (get_profile_iter) {
     struct cosmo_get_profile *next = get_profile_iter->next;
     promise_fail(get_profile_iter->promise, NULL, NULL);
-    free(get_profile_iter);
+    cosmo_dealloc(&instance->allocator, get_profile_iter);
     get_profile_iter = next;
   }
   json_decref(instance->generation);
-  curl_easy_cleanup(instance->curl);
+  for (size_t i = 0; i < instance->num_rpcs; i++) {
+    cosmo_dealloc(&instance->allocator, instance->rpcs[i].transfer.recv_buf);
+    cosmo_dealloc(&instance->allocator, instance->rpcs[i].request_buf);
+    curl_easy_cleanup(instance->rpcs[i].curl);
+  }
+  cosmo_dealloc(&instance->allocator, instance->rpcs);
+  curl_slist_free_all(instance->gzip_headers);
+  cosmo_json_free(instance->envelope);
 
-  free(instance);
+  // The instance holds the allocator.
+  struct cosmo_allocator allocator = instance->allocator;
+  cosmo_dealloc(&allocator, instance);
 
   curl_global_cleanup();
 }
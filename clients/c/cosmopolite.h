@@ -1,6 +1,8 @@
 #ifndef _COSMOPOLITE_H
 #define _COSMOPOLITE_H
 
+#include <stdint.h>
+
 #include <jansson.h>
 
 #include "promise.h"
@@ -13,31 +15,214 @@ typedef struct {
   void (*disconnect)(void *);
   void (*login)(void *);
   void (*logout)(void *);
+  // Messages an RPC brings are delivered before its profile change and its
+  // commands' promises complete, whether or not its response was streamed.
   void (*message)(const json_t *, void *);
+  // If set, called instead of message, once per RPC with an array of all the
+  // new messages it brought: grouped by subject, in id order within each.
+  void (*messages_batch)(const json_t *, void *);
 } cosmo_callbacks;
 
+typedef struct cosmo_loop cosmo_loop;
+
+// Stages of a command's life, and message events arriving, for options.trace.
+typedef enum {
+  COSMO_TRACE_ENQUEUE,   // Queued
+  COSMO_TRACE_SEND,      // Left in an RPC; again for each retry
+  COSMO_TRACE_RESPONSE,  // That RPC's response arrived
+  COSMO_TRACE_COMPLETE,  // Its result is being handled
+  COSMO_TRACE_CALLBACK,  // Its promise finished completing
+  COSMO_TRACE_RECEIVE,   // A new message event arrived
+} cosmo_trace_stage;
+
+typedef struct {
+  cosmo_trace_stage stage;
+  // Monotonic, in microseconds.
+  uint64_t time_us;
+  // Identifies a command across its stages; 0 for COSMO_TRACE_RECEIVE.
+  uint64_t command_id;
+  // Command name; NULL for COSMO_TRACE_CALLBACK and COSMO_TRACE_RECEIVE.
+  const char *command;
+  // Of a sendMessage or a received message, so our own can be matched up when
+  // they come back; otherwise NULL.
+  const char *sender_message_id;
+} cosmo_trace_event;
+
 typedef struct {
-  int placeholder;
+  // Run on a shared loop instead of a private thread. The loop must outlive the
+  // instance.
+  cosmo_loop *loop;
+  // Allow plain HTTP too, when base_url is on this host (localhost, [::1] or
+  // 127.0.0.0/8), as for a local test server.
+  bool allow_http_loopback;
+  // How long the server may hold an idle poll open waiting for events. 0
+  // selects the default; negative disables hanging polls.
+  int hanging_poll_ms;
+  // Bounds on the interval between polls, when hanging polls aren't in use.
+  // Polls come every min_poll_ms while messages are arriving, and back off
+  // exponentially towards max_poll_ms while idle or failing. 0 selects the
+  // defaults, 1 and 30 seconds.
+  int min_poll_ms;
+  int max_poll_ms;
+  // Leave message bodies as the JSON text they were sent as, for consumers
+  // that forward them unchanged; see cosmo_message_raw(). Otherwise they're
+  // decoded, and carried as embedded JSON when the server supports it.
+  bool raw_messages;
+  // Accept compressed responses, and gzip requests of at least
+  // compress_min_bytes (0 selects the default) once the server says it takes
+  // them.
+  bool compress;
+  size_t compress_min_bytes;
+  // How many RPCs may be in flight at once (0 selects 1). Commands for a
+  // subject still go out in order, waiting for any in flight before them.
+  size_t max_rpcs_in_flight;
+  // Batching of commands into RPCs. A command queued when none are waiting is
+  // held up to linger_ms (0 sends at once) for others to join it, unless the
+  // queue fills a batch sooner. An RPC carries at most max_batch_commands
+  // commands and, beyond its first, about max_batch_bytes of them; 0 is no
+  // limit.
+  int linger_ms;
+  size_t max_batch_commands;
+  size_t max_batch_bytes;
+  // File to record sent messages in until the server acknowledges them. An
+  // instance created on it resends those a previous one didn't finish. With
+  // journal_sync, each send waits for its record to reach the disk. If the
+  // file can't be opened, or another instance has it, there's no journal.
+  const char *journal_path;
+  bool journal_sync;
+  // Directory to keep each subscription's messages in. Subscribing to a
+  // subject cached there loads its messages and fetches only newer ones, if
+  // the cache holds as much history as asked for; otherwise it starts over.
+  // Unsubscribing deletes it. Caching is skipped if the file can't be opened.
+  const char *cache_dir;
+  // Run callbacks and promise completions off the network thread, through a
+  // ring of dispatch_queue_size of them (0 runs them inline); any more wait in
+  // a list, so a slow consumer never holds up the network thread. They run
+  // on a thread of the instance's own, unless dispatch_notify is set: then
+  // it's called (with the passthrough) when the queue becomes non-empty, and
+  // the caller runs them with cosmo_dispatch(). With dispatch_fd, the caller
+  // instead polls cosmo_get_fd() for readability and then runs them with
+  // cosmo_process_events(); the queue size defaults to 1024.
+  size_t dispatch_queue_size;
+  void (*dispatch_notify)(void *);
+  bool dispatch_fd;
+  // Called (with the passthrough) at each cosmo_trace_stage. It runs with the
+  // instance locked, except for COSMO_TRACE_CALLBACK, which comes from wherever
+  // the promise completed, so it must be quick and mustn't call into the
+  // instance. Strings are only valid during the call.
+  void (*trace)(const cosmo_trace_event *, void *);
+  // Allocator for the instance's own memory: the instance itself, its
+  // subscriptions and message stores, request and response buffers, journals,
+  // batches and dispatch queue. All three or none; NULL selects malloc(),
+  // realloc() and free(). They're called from the instance's threads and the
+  // caller's, and snapshots free through free_func even after shutdown.
+  // Loops, and libcurl's and zlib's internals, use the default allocator. JSON
+  // values are jansson's, whose allocator is process-wide: route those through
+  // json_set_alloc_funcs() before any values exist. Strings jansson allocates
+  // are freed with its free function.
+  void *(*malloc_func)(size_t);
+  void *(*realloc_func)(void *, size_t);
+  void (*free_func)(void *);
 } cosmo_options;
 
+typedef struct {
+  // Callbacks waiting to run now, and the most ever.
+  size_t queue_depth;
+  size_t max_queue_depth;
+  // How long the last callback to run waited, and the longest any did.
+  uint64_t lag_ms;
+  uint64_t max_lag_ms;
+} cosmo_dispatch_stats;
+
+#define COSMO_HISTOGRAM_BUCKETS 32
+
+// Durations in microseconds. buckets[i] counts those under 2^i (buckets[0],
+// zero), except the last, which takes everything longer.
+typedef struct {
+  uint64_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+  uint64_t buckets[COSMO_HISTOGRAM_BUCKETS];
+} cosmo_histogram;
+
+typedef struct {
+  // RPCs completed, and those that failed (no usable response).
+  uint64_t rpcs;
+  uint64_t rpc_failures;
+  // Of each completed RPC except hanging polls, which wait by design.
+  cosmo_histogram rpc_latency;
+  // On the wire, request bodies after compression.
+  uint64_t bytes_sent;
+  uint64_t bytes_received;
+  // Commands sent again, after a "retry" result or a failed RPC.
+  uint64_t retries;
+  // Commands waiting to go out now, and how long the oldest has waited.
+  size_t command_queue_length;
+  uint64_t command_queue_age_ms;
+  size_t subscriptions;
+  size_t messages;
+  // Time in callbacks and promise completions, wherever they run.
+  cosmo_histogram callback_time;
+  // Time spent waiting for the instance lock, and holding it.
+  cosmo_histogram lock_wait;
+  cosmo_histogram lock_hold;
+  cosmo_dispatch_stats dispatch;
+} cosmo_stats;
+
 typedef struct cosmo cosmo;
+typedef struct cosmo_snapshot cosmo_snapshot;
 
 void cosmo_uuid(char *uuid);
 
+// A set of threads, each driving many instances' RPCs through one curl multi
+// handle. Instances are assigned to threads round-robin.
+cosmo_loop *cosmo_loop_create(size_t num_threads);
+// All instances using the loop must be shut down first.
+void cosmo_loop_destroy(cosmo_loop *loop);
+
 cosmo *cosmo_create(const char *base_url, const char *client_id, const cosmo_callbacks *callbacks, const cosmo_options *options, void *passthrough);
 void cosmo_shutdown(cosmo *instance);
 
+// With dispatch_notify: runs queued callbacks. Call from one thread at a time.
+// Returns how many ran.
+size_t cosmo_dispatch(cosmo *instance);
+// With dispatch_fd: an fd, readable while callbacks are queued, for the
+// caller's poll loop (-1 otherwise). cosmo_process_events() runs them, like
+// cosmo_dispatch(); without dispatch_fd, it does nothing and returns 0.
+int cosmo_get_fd(cosmo *instance);
+size_t cosmo_process_events(cosmo *instance);
+void cosmo_get_dispatch_stats(cosmo *instance, cosmo_dispatch_stats *stats);
+// Counters since the instance was created, cheap enough to keep on.
+void cosmo_get_stats(cosmo *instance, cosmo_stats *stats);
+
 void cosmo_get_profile(cosmo *instance, promise *promise_obj);
 json_t *cosmo_current_profile(cosmo *instance);
 
 json_t *cosmo_subject(const char *name, const char *readable_only_by, const char *writeable_only_by);
 void cosmo_subscribe(cosmo *instance, json_t *subjects, const json_int_t messages, const json_int_t last_id, promise *promise_obj);
 void cosmo_unsubscribe(cosmo *instance, json_t *subject, promise *promise_obj);
+// The message is copied; the caller keeps ownership of theirs.
 void cosmo_send_message(cosmo *instance, json_t *subject, json_t *message, promise *promise_obj);
+// Sends messages[i] to subjects[i], queueing them all at once. promise_obj (if
+// any) succeeds once all are sent, or fails if any can't be; promises (if any)
+// holds one per message, as for cosmo_send_message().
+void cosmo_send_messages(cosmo *instance, size_t num_messages, json_t **subjects, json_t **messages, promise *promise_obj, promise **promises);
 
 json_t *cosmo_get_messages(cosmo *instance, json_t *subject);
 json_t *cosmo_get_last_message(cosmo *instance, json_t *subject);
 
+// Body of a message event from an instance with raw_messages, decoded (caller
+// owns the reference) or as JSON text.
+json_t *cosmo_message_decode(const json_t *event);
+const char *cosmo_message_raw(const json_t *event);
+
+// Immutable view of a subject's history at the time of the call. O(1); shares
+// message objects with the instance rather than copying them.
+cosmo_snapshot *cosmo_get_snapshot(cosmo *instance, json_t *subject);
+size_t cosmo_snapshot_length(const cosmo_snapshot *snapshot);
+const json_t *cosmo_snapshot_get(const cosmo_snapshot *snapshot, size_t index);
+void cosmo_snapshot_destroy(cosmo_snapshot *snapshot);
+
 // TODO
 json_t *cosmo_get_pins(cosmo *instance, json_t *subject, promise *promise_obj);
 void cosmo_pin(cosmo *instance, json_t *subject, json_t *message, promise *promise_obj);
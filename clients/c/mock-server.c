@@ -0,0 +1,609 @@
+// For clock_gettime(), pthread_condattr_setclock() and MSG_NOSIGNAL.
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <jansson.h>
+
+#include "mock-server.h"
+
+#define MAX_SUBSCRIBE_SUBJECTS 500
+#define READ_CHUNK 16384
+
+#define MS_PER_S 1000
+#define NS_PER_MS 1000000
+
+struct mock_connection {
+  struct mock_connection *next;
+  mock_server *server;
+  pthread_t thread;
+  int fd;
+};
+
+struct mock_server {
+  mock_server_options options;
+  char base_url[64];
+  char *padding;
+  int listen_fd;
+  // Readable once the server is shutting down.
+  int shutdown_fds[2];
+  pthread_t accept_thread;
+
+  pthread_mutex_t lock;
+  // Signalled on new events, and at shutdown.
+  pthread_cond_t cond;
+  bool shutdown;
+  struct mock_connection *connections;
+  // Subject key -> {next_id, messages: [message]}. A message is the event in
+  // both encodings: {text, json}.
+  json_t *subjects;
+  // Instance ID -> {generation, subscriptions: {subject key: true}, seq,
+  // events: [{event_id, seq, message}]}
+  json_t *instances;
+  // sender_message_id -> message
+  json_t *sent;
+  // Client ID -> profile
+  json_t *profiles;
+  json_int_t next_event_id;
+  json_int_t next_generation;
+  size_t retry_subscribes;
+  size_t fail_bulk_subscribes;
+};
+
+static char *mock_subject_key(const json_t *subject) {
+  char *key = json_dumps(subject, JSON_COMPACT | JSON_SORT_KEYS);
+  assert(key);
+  return key;
+}
+
+// The event of a message as a client asked for it: with the body as JSON
+// text, or embedded. Borrowed.
+static json_t *mock_message_event(const json_t *message, bool embed) {
+  return json_object_get(message, embed ? "json" : "text");
+}
+
+static json_t *mock_get_subject(mock_server *server, const char *key) {
+  json_t *subject = json_object_get(server->subjects, key);
+  if (!subject) {
+    subject = json_pack("{sIs[]}", "next_id", (json_int_t) 1, "messages");
+    assert(subject);
+    assert(!json_object_set_new(server->subjects, key, subject));
+  }
+  return subject;
+}
+
+static json_t *mock_get_instance(mock_server *server, const char *instance_id) {
+  json_t *instance = json_object_get(server->instances, instance_id);
+  if (!instance) {
+    char generation[32];
+    sprintf(generation, "%jd", (intmax_t) server->next_generation++);
+    instance = json_pack("{sss{}sIs[]}", "generation", generation, "subscriptions", "seq", (json_int_t) 0, "events");
+    assert(instance);
+    assert(!json_object_set_new(server->instances, instance_id, instance));
+  }
+  return instance;
+}
+
+static json_t *mock_get_profile(mock_server *server, const char *client_id) {
+  json_t *profile = json_object_get(server->profiles, client_id);
+  if (!profile) {
+    char name[32];
+    sprintf(name, "profile-%zu", json_object_size(server->profiles) + 1);
+    profile = json_string(name);
+    assert(!json_object_set_new(server->profiles, client_id, profile));
+  }
+  return profile;
+}
+
+static json_t *mock_poll(mock_server *server, json_t *instance, const char *instance_id, const json_t *arguments, json_t *events, bool embed) {
+  json_t *acked = json_object();
+  size_t index;
+  json_t *value;
+  json_array_foreach(json_object_get(arguments, "ack"), index, value) {
+    if (json_is_string(value)) {
+      json_object_set(acked, json_string_value(value), json_true());
+    }
+  }
+  json_int_t cursor = json_integer_value(json_object_get(json_object_get(arguments, "ack_cursors"), instance_id));
+
+  json_t *kept = json_array();
+  json_array_foreach(json_object_get(instance, "events"), index, value) {
+    if (json_integer_value(json_object_get(value, "seq")) > cursor &&
+        !json_object_get(acked, json_string_value(json_object_get(value, "event_id")))) {
+      json_array_append(kept, value);
+    }
+  }
+  json_object_set_new(instance, "events", kept);
+  json_decref(acked);
+
+  json_int_t timeout_ms = json_integer_value(json_object_get(arguments, "timeout_ms"));
+  if (timeout_ms > 0) {
+    struct timespec deadline;
+    assert(!clock_gettime(CLOCK_MONOTONIC, &deadline));
+    deadline.tv_sec += timeout_ms / MS_PER_S;
+    deadline.tv_nsec += (timeout_ms % MS_PER_S) * NS_PER_MS;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    while (!json_array_size(json_object_get(instance, "events")) && !server->shutdown) {
+      if (pthread_cond_timedwait(&server->cond, &server->lock, &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+  }
+
+  json_array_foreach(json_object_get(instance, "events"), index, value) {
+    json_t *event = json_copy(mock_message_event(json_object_get(value, "message"), embed));
+    json_object_set(event, "event_id", json_object_get(value, "event_id"));
+    json_object_set_new(event, "ack_cursor", json_pack("{sssO}", "subscription", instance_id, "seq", json_object_get(value, "seq")));
+    json_array_append_new(events, event);
+  }
+
+  json_t *response = json_pack("{sssOsi}",
+      "result", "ok",
+      "instance_generation", json_object_get(instance, "generation"),
+      "max_subscribe_subjects", MAX_SUBSCRIBE_SUBJECTS);
+  if (timeout_ms > 0) {
+    // Says hanging polls are supported.
+    json_object_set_new(response, "timeout_ms", json_integer(timeout_ms));
+  }
+  return response;
+}
+
+static const char *mock_subscribe_one(mock_server *server, json_t *instance, const json_t *arguments, json_t *events, bool embed) {
+  json_t *subject = json_object_get(arguments, "subject");
+  if (!json_is_object(subject)) {
+    return "error";
+  }
+  if (server->retry_subscribes) {
+    server->retry_subscribes--;
+    return "retry";
+  }
+  char *key = mock_subject_key(subject);
+  json_t *messages = json_object_get(mock_get_subject(server, key), "messages");
+  json_object_set_new(json_object_get(instance, "subscriptions"), key, json_true());
+  free(key);
+
+  // Message IDs count up from 1, so an ID is one more than its index.
+  size_t length = json_array_size(messages), start = length;
+  json_int_t num_messages = json_integer_value(json_object_get(arguments, "messages"));
+  if (num_messages < 0) {
+    start = 0;
+  } else if ((size_t) num_messages < length) {
+    start = length - num_messages;
+  }
+  json_t *last_id = json_object_get(arguments, "last_id");
+  if (json_is_integer(last_id) && json_integer_value(last_id) >= 0 && (size_t) json_integer_value(last_id) < start) {
+    start = json_integer_value(last_id);
+  }
+  for (size_t i = start; i < length; i++) {
+    json_array_append(events, mock_message_event(json_array_get(messages, i), embed));
+  }
+  return "ok";
+}
+
+static json_t *mock_subscribe(mock_server *server, json_t *instance, const json_t *arguments, json_t *events, bool embed) {
+  json_t *subjects = json_object_get(arguments, "subjects");
+  if (!subjects) {
+    return json_pack("{ss}", "result", mock_subscribe_one(server, instance, arguments, events, embed));
+  }
+  if (json_array_size(subjects) > MAX_SUBSCRIBE_SUBJECTS) {
+    return json_pack("{ss}", "result", "too_many_subjects");
+  }
+  if (server->fail_bulk_subscribes) {
+    server->fail_bulk_subscribes--;
+    return json_pack("{ss}", "result", "error");
+  }
+  json_t *results = json_array();
+  size_t index;
+  json_t *subject_arguments;
+  json_array_foreach(subjects, index, subject_arguments) {
+    json_array_append_new(results, json_pack("{ss}", "result", mock_subscribe_one(server, instance, subject_arguments, events, embed)));
+  }
+  return json_pack("{ssso}", "result", "ok", "results", results);
+}
+
+static json_t *mock_unsubscribe(mock_server *server, json_t *instance, const json_t *arguments) {
+  json_t *subject = json_object_get(arguments, "subject");
+  if (!json_is_object(subject)) {
+    return json_pack("{ss}", "result", "error");
+  }
+  char *key = mock_subject_key(subject);
+  json_object_del(json_object_get(instance, "subscriptions"), key);
+  free(key);
+  return json_pack("{ss}", "result", "ok");
+}
+
+static json_t *mock_send_message(mock_server *server, json_t *profile, const json_t *arguments, bool embed) {
+  json_t *subject = json_object_get(arguments, "subject");
+  const char *sender_message_id = json_string_value(json_object_get(arguments, "sender_message_id"));
+  json_t *text = json_object_get(arguments, "message");
+  json_t *body = json_object_get(arguments, "message_json");
+  if (!json_is_object(subject) || !sender_message_id || (!json_is_string(text) && !body)) {
+    return json_pack("{ss}", "result", "error");
+  }
+
+  json_t *message = json_object_get(server->sent, sender_message_id);
+  if (message) {
+    return json_pack("{sssO}", "result", "duplicate_message", "message", mock_message_event(message, embed));
+  }
+
+  // Kept in both encodings, so neither is redone per delivery.
+  if (body) {
+    char *encoded = json_dumps(body, JSON_ENCODE_ANY);
+    text = json_string(encoded);
+    free(encoded);
+    json_incref(body);
+  } else {
+    json_incref(text);
+    body = json_loads(json_string_value(text), JSON_DECODE_ANY, NULL);
+  }
+
+  char *key = mock_subject_key(subject);
+  json_t *subject_state = mock_get_subject(server, key);
+  json_int_t id = json_integer_value(json_object_get(subject_state, "next_id"));
+  json_object_set_new(subject_state, "next_id", json_integer(id + 1));
+
+  struct timespec now;
+  assert(timespec_get(&now, TIME_UTC) == TIME_UTC);
+  json_t *text_event = json_pack("{sssIsOsOsfssso}",
+      "event_type", "message",
+      "id", id,
+      "sender", profile,
+      "subject", subject,
+      "created", now.tv_sec + now.tv_nsec / 1e9,
+      "sender_message_id", sender_message_id,
+      "message", text);
+  assert(text_event);
+  json_t *json_event = text_event;
+  if (body) {
+    json_event = json_copy(text_event);
+    json_object_del(json_event, "message");
+    json_object_set_new(json_event, "message_json", body);
+  } else {
+    json_incref(json_event);
+  }
+  message = json_pack("{soso}", "text", text_event, "json", json_event);
+  assert(message);
+  json_array_append(json_object_get(subject_state, "messages"), message);
+  json_object_set(server->sent, sender_message_id, message);
+
+  const char *instance_id;
+  json_t *instance;
+  json_object_foreach(server->instances, instance_id, instance) {
+    if (!json_object_get(json_object_get(instance, "subscriptions"), key)) {
+      continue;
+    }
+    json_int_t seq = json_integer_value(json_object_get(instance, "seq")) + 1;
+    json_object_set_new(instance, "seq", json_integer(seq));
+    char event_id[32];
+    sprintf(event_id, "%jd", (intmax_t) server->next_event_id++);
+    json_array_append_new(json_object_get(instance, "events"), json_pack("{sssIsO}", "event_id", event_id, "seq", seq, "message", message));
+  }
+  assert(!pthread_cond_broadcast(&server->cond));
+  free(key);
+
+  json_t *response = json_pack("{sssO}", "result", "ok", "message", mock_message_event(message, embed));
+  json_decref(message);
+  return response;
+}
+
+// Returns NULL if request isn't a valid RPC.
+static json_t *mock_handle_rpc(mock_server *server, const json_t *request) {
+  const char *client_id, *instance_id;
+  json_t *commands;
+  if (json_unpack((json_t *) request, "{ssssso}", "client_id", &client_id, "instance_id", &instance_id, "commands", &commands) ||
+      !json_is_array(commands)) {
+    return NULL;
+  }
+  const char *encoding = json_string_value(json_object_get(request, "message_encoding"));
+  bool embed = encoding && !strcmp(encoding, "json");
+
+  json_t *responses = json_array();
+  json_t *events = json_array();
+  assert(!pthread_mutex_lock(&server->lock));
+  json_t *profile = mock_get_profile(server, client_id);
+  json_t *instance = mock_get_instance(server, instance_id);
+  size_t index;
+  json_t *command;
+  json_array_foreach(commands, index, command) {
+    const char *name = json_string_value(json_object_get(command, "command"));
+    json_t *arguments = json_object_get(command, "arguments");
+    json_t *response;
+    if (!name) {
+      response = json_pack("{ss}", "result", "error");
+    } else if (!strcmp(name, "poll")) {
+      response = mock_poll(server, instance, instance_id, arguments, events, embed);
+    } else if (!strcmp(name, "subscribe")) {
+      response = mock_subscribe(server, instance, arguments, events, embed);
+    } else if (!strcmp(name, "unsubscribe")) {
+      response = mock_unsubscribe(server, instance, arguments);
+    } else if (!strcmp(name, "sendMessage")) {
+      response = mock_send_message(server, profile, arguments, embed);
+    } else {
+      response = json_pack("{ss}", "result", "error");
+    }
+    json_array_append_new(responses, response);
+  }
+  json_t *ret = json_pack("{sOsoso}", "profile", profile, "responses", responses, "events", events);
+  assert(!pthread_mutex_unlock(&server->lock));
+
+  if (embed) {
+    json_object_set_new(ret, "message_encoding", json_string("json"));
+  }
+  if (server->padding) {
+    json_object_set_new(ret, "padding", json_string(server->padding));
+  }
+  return ret;
+}
+
+static bool mock_send(int fd, const char *buf, size_t len) {
+  while (len) {
+    ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (sent <= 0) {
+      return false;
+    }
+    buf += sent;
+    len -= sent;
+  }
+  return true;
+}
+
+// Reads more of the connection onto buf, keeping it NUL-terminated. Returns
+// false at EOF, on error, or at shutdown.
+static bool mock_read_more(struct mock_connection *connection, char **buf, size_t *len, size_t *capacity) {
+  struct pollfd fds[] = {
+    {.fd = connection->fd, .events = POLLIN},
+    {.fd = connection->server->shutdown_fds[0], .events = POLLIN},
+  };
+  while (poll(fds, 2, -1) < 0) {
+    assert(errno == EINTR);
+  }
+  if (fds[1].revents) {
+    return false;
+  }
+
+  if (*capacity - *len < READ_CHUNK) {
+    *capacity = *capacity * 2 + READ_CHUNK;
+    *buf = realloc(*buf, *capacity);
+    assert(*buf);
+  }
+  ssize_t received = recv(connection->fd, *buf + *len, *capacity - *len - 1, 0);
+  if (received <= 0) {
+    return false;
+  }
+  *len += received;
+  (*buf)[*len] = '\0';
+  return true;
+}
+
+// Serves HTTP/1.1 requests, kept alive, until the client goes away.
+static void *mock_connection_main(void *arg) {
+  struct mock_connection *connection = arg;
+  mock_server *server = connection->server;
+  size_t capacity = READ_CHUNK, len = 0;
+  char *buf = malloc(capacity);
+  assert(buf);
+  buf[0] = '\0';
+
+  while (true) {
+    char *headers_end;
+    while (!(headers_end = strstr(buf, "\r\n\r\n"))) {
+      if (!mock_read_more(connection, &buf, &len, &capacity)) {
+        goto done;
+      }
+    }
+    size_t headers_len = headers_end + 4 - buf;
+    size_t content_length = 0;
+    bool expect_continue = false;
+    for (char *line = strstr(buf, "\r\n") + 2; line < headers_end; line = strstr(line, "\r\n") + 2) {
+      if (!strncasecmp(line, "Content-Length:", 15)) {
+        content_length = strtoul(line + 15, NULL, 10);
+      } else if (!strncasecmp(line, "Expect:", 7)) {
+        // Only ever 100-continue.
+        expect_continue = true;
+      }
+    }
+    size_t request_len = headers_len + content_length;
+    if (expect_continue && len < request_len) {
+      const char *to_continue = "HTTP/1.1 100 Continue\r\n\r\n";
+      if (!mock_send(connection->fd, to_continue, strlen(to_continue))) {
+        goto done;
+      }
+    }
+    while (len < request_len) {
+      if (!mock_read_more(connection, &buf, &len, &capacity)) {
+        goto done;
+      }
+    }
+
+    json_t *request = json_loadb(buf + headers_len, content_length, 0, NULL);
+    json_t *response = request ? mock_handle_rpc(server, request) : NULL;
+    json_decref(request);
+    memmove(buf, buf + request_len, len - request_len + 1);
+    len -= request_len;
+
+    if (server->options.latency_ms > 0) {
+      struct timespec latency = {
+        .tv_sec = server->options.latency_ms / MS_PER_S,
+        .tv_nsec = (server->options.latency_ms % MS_PER_S) * NS_PER_MS,
+      };
+      nanosleep(&latency, NULL);
+    }
+
+    bool sent;
+    if (response) {
+      char *body = json_dumps(response, JSON_COMPACT);
+      assert(body);
+      json_decref(response);
+      size_t body_len = strlen(body);
+      char *out = malloc(body_len + 128);
+      assert(out);
+      int out_len = sprintf(out, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", body_len);
+      memcpy(out + out_len, body, body_len);
+      free(body);
+      sent = mock_send(connection->fd, out, out_len + body_len);
+      free(out);
+    } else {
+      const char *bad_request = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+      sent = mock_send(connection->fd, bad_request, strlen(bad_request));
+    }
+    if (!sent) {
+      break;
+    }
+  }
+
+done:
+  free(buf);
+  assert(!close(connection->fd));
+  return NULL;
+}
+
+static void *mock_accept_main(void *arg) {
+  mock_server *server = arg;
+  struct pollfd fds[] = {
+    {.fd = server->listen_fd, .events = POLLIN},
+    {.fd = server->shutdown_fds[0], .events = POLLIN},
+  };
+  while (true) {
+    if (poll(fds, 2, -1) < 0) {
+      assert(errno == EINTR);
+      continue;
+    }
+    if (fds[1].revents) {
+      break;
+    }
+    int fd = accept(server->listen_fd, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    int one = 1;
+    assert(!setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)));
+
+    struct mock_connection *connection = malloc(sizeof(*connection));
+    assert(connection);
+    connection->server = server;
+    connection->fd = fd;
+    assert(!pthread_mutex_lock(&server->lock));
+    connection->next = server->connections;
+    server->connections = connection;
+    assert(!pthread_mutex_unlock(&server->lock));
+    assert(!pthread_create(&connection->thread, NULL, mock_connection_main, connection));
+  }
+  return NULL;
+}
+
+mock_server *mock_server_create(const mock_server_options *options) {
+  mock_server *server = malloc(sizeof(*server));
+  assert(server);
+  if (options) {
+    memcpy(&server->options, options, sizeof(server->options));
+  } else {
+    memset(&server->options, 0, sizeof(server->options));
+  }
+  server->padding = NULL;
+  if (server->options.padding_bytes) {
+    server->padding = malloc(server->options.padding_bytes + 1);
+    assert(server->padding);
+    memset(server->padding, 'x', server->options.padding_bytes);
+    server->padding[server->options.padding_bytes] = '\0';
+  }
+
+  assert(!pthread_mutex_init(&server->lock, NULL));
+  pthread_condattr_t cond_attr;
+  assert(!pthread_condattr_init(&cond_attr));
+  assert(!pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC));
+  assert(!pthread_cond_init(&server->cond, &cond_attr));
+  assert(!pthread_condattr_destroy(&cond_attr));
+  server->shutdown = false;
+  server->connections = NULL;
+  server->subjects = json_object();
+  server->instances = json_object();
+  server->sent = json_object();
+  server->profiles = json_object();
+  server->next_event_id = 1;
+  server->next_generation = 1;
+  server->retry_subscribes = 0;
+  server->fail_bulk_subscribes = 0;
+
+  server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  assert(server->listen_fd >= 0);
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port = 0,
+  };
+  assert(!bind(server->listen_fd, (struct sockaddr *) &addr, sizeof(addr)));
+  assert(!listen(server->listen_fd, SOMAXCONN));
+  socklen_t addr_len = sizeof(addr);
+  assert(!getsockname(server->listen_fd, (struct sockaddr *) &addr, &addr_len));
+  sprintf(server->base_url, "http://127.0.0.1:%d/cosmopolite", ntohs(addr.sin_port));
+
+  assert(!pipe(server->shutdown_fds));
+  assert(!pthread_create(&server->accept_thread, NULL, mock_accept_main, server));
+  return server;
+}
+
+const char *mock_server_base_url(const mock_server *server) {
+  return server->base_url;
+}
+
+void mock_server_retry_subscribes(mock_server *server, size_t count) {
+  assert(!pthread_mutex_lock(&server->lock));
+  server->retry_subscribes = count;
+  assert(!pthread_mutex_unlock(&server->lock));
+}
+
+void mock_server_fail_bulk_subscribes(mock_server *server, size_t count) {
+  assert(!pthread_mutex_lock(&server->lock));
+  server->fail_bulk_subscribes = count;
+  assert(!pthread_mutex_unlock(&server->lock));
+}
+
+void mock_server_destroy(mock_server *server) {
+  assert(!pthread_mutex_lock(&server->lock));
+  server->shutdown = true;
+  assert(!pthread_cond_broadcast(&server->cond));
+  assert(!pthread_mutex_unlock(&server->lock));
+  assert(write(server->shutdown_fds[1], "", 1) == 1);
+
+  assert(!pthread_join(server->accept_thread, NULL));
+  struct mock_connection *connection = server->connections;
+  while (connection) {
+    struct mock_connection *next = connection->next;
+    assert(!pthread_join(connection->thread, NULL));
+    free(connection);
+    connection = next;
+  }
+
+  assert(!close(server->listen_fd));
+  assert(!close(server->shutdown_fds[0]));
+  assert(!close(server->shutdown_fds[1]));
+  json_decref(server->subjects);
+  json_decref(server->instances);
+  json_decref(server->sent);
+  json_decref(server->profiles);
+  free(server->padding);
+  assert(!pthread_cond_destroy(&server->cond));
+  assert(!pthread_mutex_destroy(&server->lock));
+  free(server);
+}
@@ -0,0 +1,32 @@
+#ifndef _MOCK_SERVER_H
+#define _MOCK_SERVER_H
+
+#include <stddef.h>
+
+// In-process stand-in for a Cosmopolite server, for benchmarks and tests that
+// shouldn't depend on the network. It speaks the /api command protocol (poll,
+// with acks and hanging polls; subscribe, singly or in bulk; unsubscribe;
+// sendMessage) over plain HTTP on 127.0.0.1, keeping everything in memory.
+// There's no authentication or ACL checking; every client is anonymous.
+typedef struct mock_server mock_server;
+
+typedef struct {
+  // Added before every response.
+  int latency_ms;
+  // Filler added to every response, to model bulkier ones.
+  size_t padding_bytes;
+} mock_server_options;
+
+mock_server *mock_server_create(const mock_server_options *options);
+// For cosmo_create(), with allow_http_loopback.
+const char *mock_server_base_url(const mock_server *server);
+// Answers the next count subjects subscribed to, singly or in bulk, with
+// "retry", as a server does while an instance isn't active yet.
+void mock_server_retry_subscribes(mock_server *server, size_t count);
+// Answers the next count bulk subscribes with a top-level "error", and no
+// per-subject results.
+void mock_server_fail_bulk_subscribes(mock_server *server, size_t count);
+// Clients should be shut down first.
+void mock_server_destroy(mock_server *server);
+
+#endif
@@ -1,9 +1,31 @@
+// For clock_gettime() and pthread_condattr_setclock().
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
+#include <errno.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
 
 #include "promise.h"
 
+#define MS_PER_S 1000
+#define NS_PER_MS 1000000
+#define NS_PER_S 1000000000
+
+// Counts completions of the promises passed to promise_all() or promise_any(),
+// and completes the combined promise once the outcome is known. Freed when the
+// last of them completes.
+struct promise_group {
+  pthread_mutex_t lock;
+  bool any;
+  // Completions still needed: successes for all, failures for any.
+  size_t remaining;
+  // Promises that haven't completed yet.
+  size_t refs;
+  promise *combined;
+};
+
 struct promise {
   promise_callback on_success;
   promise_callback on_failure;
@@ -16,6 +38,8 @@ struct promise {
   bool success;
   void *result;
   promise_cleanup cleanup;
+
+  struct promise_group *group;
 };
 
 promise *promise_create(promise_callback on_success, promise_callback on_failure, void *passthrough) {
@@ -25,8 +49,14 @@ promise *promise_create(promise_callback on_success, promise_callback on_failure
   promise_obj->passthrough = passthrough;
 
   promise_obj->fulfilled = false;
+  promise_obj->group = NULL;
   assert(!pthread_mutex_init(&promise_obj->lock, NULL));
-  assert(!pthread_cond_init(&promise_obj->cond, NULL));
+  // Timeouts shouldn't move with the wall clock.
+  pthread_condattr_t cond_attr;
+  assert(!pthread_condattr_init(&cond_attr));
+  assert(!pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC));
+  assert(!pthread_cond_init(&promise_obj->cond, &cond_attr));
+  assert(!pthread_condattr_destroy(&cond_attr));
   return promise_obj;
 }
 
@@ -55,6 +85,108 @@ bool promise_wait(promise *promise_obj, void **result) {
   return success;
 }
 
+bool promise_wait_timeout(promise *promise_obj, uint64_t timeout_ms, bool *success, void **result) {
+  assert(promise_obj);
+  struct timespec deadline;
+  assert(!clock_gettime(CLOCK_MONOTONIC, &deadline));
+  deadline.tv_sec += timeout_ms / MS_PER_S;
+  deadline.tv_nsec += (timeout_ms % MS_PER_S) * NS_PER_MS;
+  if (deadline.tv_nsec >= NS_PER_S) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= NS_PER_S;
+  }
+
+  assert(!pthread_mutex_lock(&promise_obj->lock));
+  while (!promise_obj->fulfilled) {
+    int err = pthread_cond_timedwait(&promise_obj->cond, &promise_obj->lock, &deadline);
+    if (err == ETIMEDOUT) {
+      break;
+    }
+    assert(!err);
+  }
+  bool fulfilled = promise_obj->fulfilled;
+  assert(!pthread_mutex_unlock(&promise_obj->lock));
+
+  if (fulfilled) {
+    if (success) {
+      *success = promise_obj->success;
+    }
+    if (result) {
+      *result = promise_obj->result;
+    }
+  }
+  return fulfilled;
+}
+
+// Called once per promise in the group, as it completes.
+static void promise_group_update(struct promise_group *group, bool success) {
+  promise *to_complete = NULL;
+  assert(!pthread_mutex_lock(&group->lock));
+  if (group->combined && (success == group->any || !--group->remaining)) {
+    // The first success decides any, and the first failure all; otherwise
+    // it's decided by the last completion.
+    to_complete = group->combined;
+    group->combined = NULL;
+  }
+  bool last = !--group->refs;
+  assert(!pthread_mutex_unlock(&group->lock));
+
+  promise_complete(to_complete, NULL, NULL, success);
+  if (last) {
+    assert(!pthread_mutex_destroy(&group->lock));
+    free(group);
+  }
+}
+
+static promise *promise_group_create(promise **promises, size_t num_promises, bool any) {
+  promise *combined = promise_create(NULL, NULL, NULL);
+  if (!num_promises) {
+    promise_complete(combined, NULL, NULL, !any);
+    return combined;
+  }
+
+  struct promise_group *group = malloc(sizeof(*group));
+  assert(group);
+  assert(!pthread_mutex_init(&group->lock, NULL));
+  group->any = any;
+  group->remaining = num_promises;
+  // One extra, so that promises completing during setup can't free it.
+  group->refs = num_promises + 1;
+  group->combined = combined;
+
+  for (size_t i = 0; i < num_promises; i++) {
+    promise *promise_obj = promises[i];
+    assert(!pthread_mutex_lock(&promise_obj->lock));
+    // A promise can only feed one group.
+    assert(!promise_obj->group);
+    bool fulfilled = promise_obj->fulfilled;
+    if (!fulfilled) {
+      promise_obj->group = group;
+    }
+    assert(!pthread_mutex_unlock(&promise_obj->lock));
+    if (fulfilled) {
+      promise_group_update(group, promise_obj->success);
+    }
+  }
+
+  assert(!pthread_mutex_lock(&group->lock));
+  bool last = !--group->refs;
+  assert(!pthread_mutex_unlock(&group->lock));
+  if (last) {
+    assert(!pthread_mutex_destroy(&group->lock));
+    free(group);
+  }
+  return combined;
+}
+
+promise *promise_all(promise **promises, size_t num_promises) {
+  return promise_group_create(promises, num_promises, false);
+}
+
+promise *promise_any(promise **promises, size_t num_promises) {
+  return promise_group_create(promises, num_promises, true);
+}
+
 void promise_complete(promise *promise_obj, void *result, promise_cleanup cleanup, bool success) {
   if (!promise_obj) {
     if (result && cleanup) {
@@ -75,8 +207,14 @@ void promise_complete(promise *promise_obj, void *result, promise_cleanup cleanu
   promise_obj->cleanup = cleanup;
   promise_obj->success = success;
   promise_obj->fulfilled = true;
+  struct promise_group *group = promise_obj->group;
   assert(!pthread_cond_signal(&promise_obj->cond));
   assert(!pthread_mutex_unlock(&promise_obj->lock));
+
+  // The waiter may destroy promise_obj from here on.
+  if (group) {
+    promise_group_update(group, success);
+  }
 }
 
 void promise_succeed(promise *promise_obj, void *result, promise_cleanup cleanup) {
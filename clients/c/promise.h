@@ -2,6 +2,8 @@
 #define _PROMISE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 typedef struct promise promise;
 
@@ -11,8 +13,19 @@ typedef void (*promise_cleanup)(void *);
 
 promise *promise_create(promise_callback on_success, promise_callback on_failure, void *passthrough);
 bool promise_wait(promise *promise_obj, void **result);
+// Returns false if promise_obj isn't fulfilled within timeout_ms. Otherwise
+// sets *success (what promise_wait() returns) and *result, if not NULL.
+bool promise_wait_timeout(promise *promise_obj, uint64_t timeout_ms, bool *success, void **result);
 void promise_destroy(promise *promise_obj);
 
+// New promises, with no result, that complete once: promise_all() succeeds
+// when all of promises have and fails with the first that fails;
+// promise_any() succeeds with the first success and fails when all have
+// failed. Each of promises can be passed to only one of these, and must
+// outlive its own completion as usual.
+promise *promise_all(promise **promises, size_t num_promises);
+promise *promise_any(promise **promises, size_t num_promises);
+
 void promise_complete(promise *promise_obj, void *result, promise_cleanup cleanup, bool success);
 // Shortcuts for promise_complete()
 void promise_succeed(promise *promise_obj, void *result, promise_cleanup cleanup);
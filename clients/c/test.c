@@ -1,9 +1,14 @@
 #include <assert.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
 #include <unistd.h>
 
 #include "cosmopolite.h"
 #include "cosmopolite-int.h"
+#include "mock-server.h"
 
 #define RUN_TEST(func) run_test(#func, func)
 
@@ -22,6 +27,9 @@ typedef struct {
   bool logout_fired;
   bool connect_fired;
   bool disconnect_fired;
+  bool dispatch_notified;
+  json_t *messages_batch;
+  json_t *traces;
 } test_state;
 
 
@@ -68,6 +76,34 @@ static void on_message(const json_t *message, void *passthrough) {
   assert(!pthread_mutex_unlock(&state->lock));
 }
 
+static void on_messages_batch(const json_t *messages, void *passthrough) {
+  test_state *state = passthrough;
+  assert(!pthread_mutex_lock(&state->lock));
+  json_array_append_new(state->messages_batch, json_deep_copy(messages));
+  assert(!pthread_cond_signal(&state->cond));
+  assert(!pthread_mutex_unlock(&state->lock));
+}
+
+static void on_trace(const cosmo_trace_event *event, void *passthrough) {
+  test_state *state = passthrough;
+  assert(!pthread_mutex_lock(&state->lock));
+  json_array_append_new(state->traces, json_pack("{sisIsIss?}",
+      "stage", event->stage,
+      "time_us", (json_int_t) event->time_us,
+      "command_id", (json_int_t) event->command_id,
+      "sender_message_id", event->sender_message_id));
+  assert(!pthread_cond_signal(&state->cond));
+  assert(!pthread_mutex_unlock(&state->lock));
+}
+
+static void on_dispatch_notify(void *passthrough) {
+  test_state *state = passthrough;
+  assert(!pthread_mutex_lock(&state->lock));
+  state->dispatch_notified = true;
+  assert(!pthread_cond_signal(&state->cond));
+  assert(!pthread_mutex_unlock(&state->lock));
+}
+
 static void wait_for_client_id_change(test_state *state) {
   assert(!pthread_mutex_lock(&state->lock));
   while (!state->client_id_change_fired) {
@@ -122,6 +158,16 @@ static void wait_for_disconnect(test_state *state) {
   assert(!pthread_mutex_unlock(&state->lock));
 }
 
+static void wait_for_dispatch_notify(test_state *state) {
+  assert(!pthread_mutex_lock(&state->lock));
+  while (!state->dispatch_notified) {
+    assert(!pthread_cond_wait(&state->cond, &state->lock));
+  }
+
+  state->dispatch_notified = false;
+  assert(!pthread_mutex_unlock(&state->lock));
+}
+
 static test_state *create_test_state() {
   test_state *ret = malloc(sizeof(test_state));
   assert(ret);
@@ -134,16 +180,21 @@ static test_state *create_test_state() {
   ret->logout_fired = false;
   ret->connect_fired = false;
   ret->disconnect_fired = false;
+  ret->dispatch_notified = false;
+  ret->messages_batch = json_array();
+  ret->traces = json_array();
   return ret;
 }
 
 static void destroy_test_state(test_state *state) {
+  json_decref(state->messages_batch);
+  json_decref(state->traces);
   assert(!pthread_mutex_destroy(&state->lock));
   assert(!pthread_cond_destroy(&state->cond));
   free(state);
 }
 
-static cosmo *create_client(test_state *state) {
+static cosmo *create_client_at(test_state *state, const char *base_url, const cosmo_options *options) {
   cosmo_callbacks callbacks = {
     .client_id_change = on_client_id_change,
     .connect = on_connect,
@@ -152,10 +203,30 @@ static cosmo *create_client(test_state *state) {
     .message = on_message,
   };
 
-  cosmo *ret = cosmo_create("https://playground.cosmopolite.org/cosmopolite", NULL, &callbacks, NULL, state);
+  cosmo *ret = cosmo_create(base_url, NULL, &callbacks, options, state);
   return ret;
 }
 
+static cosmo *create_client_with_options(test_state *state, const cosmo_options *options) {
+  return create_client_at(state, "https://playground.cosmopolite.org/cosmopolite", options);
+}
+
+static cosmo *create_client(test_state *state) {
+  return create_client_with_options(state, NULL);
+}
+
+// For tests of timing and protocol shape, which shouldn't depend on the
+// network or the playground's load.
+static cosmo *create_mock_client_with_options(test_state *state, mock_server *server, const cosmo_options *options) {
+  cosmo_options mock_options = options ? *options : (cosmo_options){NULL};
+  mock_options.allow_http_loopback = true;
+  return create_client_at(state, mock_server_base_url(server), &mock_options);
+}
+
+static cosmo *create_mock_client(test_state *state, mock_server *server) {
+  return create_mock_client_with_options(state, server, NULL);
+}
+
 static json_t *random_subject(const char *readable_only_by, const char *writeable_only_by) {
   char uuid[COSMO_UUID_SIZE];
   cosmo_uuid(uuid);
@@ -205,6 +276,114 @@ static bool test_message_round_trip(test_state *state) {
   return true;
 }
 
+static bool test_shared_loop(test_state *state) {
+  cosmo_loop *loop = cosmo_loop_create(2);
+  cosmo_options options = {
+    .loop = loop,
+  };
+
+#define SHARED_LOOP_CLIENTS 3
+  cosmo *clients[SHARED_LOOP_CLIENTS];
+  for (int i = 0; i < SHARED_LOOP_CLIENTS; i++) {
+    clients[i] = create_client_with_options(state, &options);
+  }
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(clients[0], subject, -1, 0, NULL);
+
+  json_t *message_out = random_message();
+  cosmo_send_message(clients[SHARED_LOOP_CLIENTS - 1], subject, message_out, NULL);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+
+  json_decref(subject);
+  json_decref(message_out);
+
+  for (int i = 0; i < SHARED_LOOP_CLIENTS; i++) {
+    cosmo_shutdown(clients[i]);
+  }
+  cosmo_loop_destroy(loop);
+  return true;
+}
+
+static bool test_hanging_poll(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo *client1 = create_mock_client(state, server);
+  cosmo *client2 = create_mock_client(state, server);
+
+  json_t *subject = random_subject(NULL, NULL);
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client1, subject, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+
+  struct timespec start, end;
+  assert(timespec_get(&start, TIME_UTC) == TIME_UTC);
+  json_t *message_out = random_message();
+  cosmo_send_message(client2, subject, message_out, NULL);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  assert(timespec_get(&end, TIME_UTC) == TIME_UTC);
+  // Delivered by the hanging poll, well inside the 10 second poll cycle.
+  assert(end.tv_sec - start.tv_sec < 5);
+
+  json_decref(subject);
+  json_decref(message_out);
+
+  cosmo_shutdown(client1);
+  cosmo_shutdown(client2);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_poll_backoff(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_options options = {
+    .hanging_poll_ms = -1,
+    .min_poll_ms = 100,
+    .max_poll_ms = 1000,
+  };
+  cosmo *client1 = create_mock_client_with_options(state, server, &options);
+  // Also without hanging polls, so that its sends don't wait behind one.
+  cosmo *client2 = create_mock_client_with_options(state, server, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client1, subject, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+
+  // Idle long enough to back off all the way.
+  thrd_sleep(&(struct timespec){ .tv_sec = 3 }, NULL);
+
+  for (int i = 0; i < 5; i++) {
+    struct timespec start, end;
+    assert(timespec_get(&start, TIME_UTC) == TIME_UTC);
+    json_t *message_out = random_message();
+    cosmo_send_message(client2, subject, message_out, NULL);
+    const json_t *message_in = wait_for_message(state);
+    assert(json_equal(message_out, json_object_get(message_in, "message")));
+    assert(timespec_get(&end, TIME_UTC) == TIME_UTC);
+    json_decref(message_out);
+    int64_t elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if (i == 0) {
+      // Picked up by a poll at max_poll_ms, well inside the 10 second poll
+      // cycle.
+      assert(elapsed_ms < 5000);
+    } else {
+      // The last poll brought a message, so the next comes at min_poll_ms.
+      assert(elapsed_ms < 4 * options.min_poll_ms);
+    }
+  }
+
+  json_decref(subject);
+
+  cosmo_shutdown(client1);
+  cosmo_shutdown(client2);
+  mock_server_destroy(server);
+  return true;
+}
+
 static bool test_client_id_change_fires(test_state *state) {
   cosmo *client = create_client(state);
   wait_for_client_id_change(state);
@@ -223,9 +402,13 @@ static bool test_connect_logout_fires(test_state *state) {
 static bool test_reconnect(test_state *state) {
   cosmo *client = create_client(state);
   wait_for_connect(state);
-  assert(!curl_easy_setopt(client->curl, CURLOPT_PORT, 444));
+  for (size_t i = 0; i < client->num_rpcs; i++) {
+    assert(!curl_easy_setopt(client->rpcs[i].curl, CURLOPT_PORT, 444));
+  }
   wait_for_disconnect(state);
-  assert(!curl_easy_setopt(client->curl, CURLOPT_PORT, 443));
+  for (size_t i = 0; i < client->num_rpcs; i++) {
+    assert(!curl_easy_setopt(client->rpcs[i].curl, CURLOPT_PORT, 443));
+  }
   wait_for_connect(state);
   cosmo_shutdown(client);
   return true;
@@ -243,8 +426,8 @@ static bool test_resubscribe_after_reconnect(test_state *state) {
   assert(json_equal(message_out, json_object_get(message_in, "message")));
   json_decref(message_out);
 
-  // Reach in and reset the instance ID so we look new.
-  cosmo_uuid(client->instance_id);
+  // Reset the instance ID so we look new.
+  cosmo_force_new_instance(client);
 
   message_out = random_message();
   cosmo_send_message(client, subject, message_out, NULL);
@@ -284,6 +467,41 @@ static bool test_bulk_subscribe(test_state *state) {
   return true;
 }
 
+static bool test_bulk_resubscribe(test_state *state) {
+  cosmo *client = create_client(state);
+
+  // More than fit in one resubscribe command.
+  json_t *subjects = json_array();
+  for (int i = 0; i < 300; i++) {
+    json_array_append_new(subjects, random_subject(NULL, NULL));
+  }
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subjects, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+
+  // Reach in and reset the instance ID so we look new.
+  cosmo_force_new_instance(client);
+
+  json_t *subject = json_array_get(subjects, 0);
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  json_decref(message_out);
+
+  subject = json_array_get(subjects, json_array_size(subjects) - 1);
+  message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  json_decref(message_out);
+
+  json_decref(subjects);
+  cosmo_shutdown(client);
+  return true;
+}
+
 static bool test_complex_object(test_state *state) {
   cosmo *client = create_client(state);
 
@@ -348,6 +566,115 @@ static bool test_subscribe_unsubscribe_promise(test_state *state) {
   return true;
 }
 
+static bool test_promise_combinators(test_state *state) {
+  promise *promises[3];
+  for (int i = 0; i < 3; i++) {
+    promises[i] = promise_create(NULL, NULL, NULL);
+  }
+  promise *all = promise_all(promises, 3);
+  promise_succeed(promises[0], NULL, NULL);
+  assert(!promise_wait_timeout(all, 10, NULL, NULL));
+  promise_succeed(promises[1], NULL, NULL);
+  promise_succeed(promises[2], NULL, NULL);
+  bool success = false;
+  assert(promise_wait_timeout(all, 1000, &success, NULL));
+  assert(success);
+  promise_destroy(all);
+  for (int i = 0; i < 3; i++) {
+    promise_destroy(promises[i]);
+    promises[i] = promise_create(NULL, NULL, NULL);
+  }
+
+  promise_fail(promises[0], NULL, NULL);
+  promise *any = promise_any(promises, 3);
+  assert(!promise_wait_timeout(any, 10, NULL, NULL));
+  promise_succeed(promises[1], NULL, NULL);
+  assert(promise_wait(any, NULL));
+  promise_destroy(any);
+  promise_fail(promises[2], NULL, NULL);
+  for (int i = 0; i < 3; i++) {
+    promise_destroy(promises[i]);
+  }
+
+  // One wait for a fan-out of subscribes.
+  cosmo *client = create_client(state);
+  json_t *subjects[20];
+  promise *subscribed[20];
+  for (int i = 0; i < 20; i++) {
+    subjects[i] = random_subject(NULL, NULL);
+    subscribed[i] = promise_create(NULL, NULL, NULL);
+    cosmo_subscribe(client, subjects[i], -1, 0, subscribed[i]);
+  }
+  all = promise_all(subscribed, 20);
+  assert(promise_wait_timeout(all, 30000, &success, NULL));
+  assert(success);
+  promise_destroy(all);
+  for (int i = 0; i < 20; i++) {
+    promise_destroy(subscribed[i]);
+    json_decref(subjects[i]);
+  }
+
+  cosmo_shutdown(client);
+  return true;
+}
+
+static bool test_raw_messages(test_state *state) {
+  cosmo_options options = {
+    .raw_messages = true,
+  };
+  cosmo *client = create_client_with_options(state, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+
+  json_t *message_out = json_pack("{sis[ss]}", "foo", 5, "bar", "zig", "zag");
+  cosmo_send_message(client, subject, message_out, NULL);
+  const json_t *message_in = wait_for_message(state);
+  const char *raw = cosmo_message_raw(message_in);
+  assert(raw);
+  json_t *decoded = json_loads(raw, 0, NULL);
+  assert(json_equal(message_out, decoded));
+  json_decref(decoded);
+  decoded = cosmo_message_decode(message_in);
+  assert(json_equal(message_out, decoded));
+  json_decref(decoded);
+
+  json_decref(subject);
+  json_decref(message_out);
+
+  cosmo_shutdown(client);
+  return true;
+}
+
+static bool test_compression(test_state *state) {
+  cosmo_options options = {
+    .compress = true,
+    .compress_min_bytes = 1,
+  };
+  cosmo *client = create_client_with_options(state, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  json_decref(message_out);
+
+  // By now the server has said it takes gzip, so this goes compressed.
+  assert(client->server_accepts_gzip);
+  message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  json_decref(message_out);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  return true;
+}
+
 static bool test_getmessages_subscribe(test_state *state) {
   cosmo *client = create_client(state);
 
@@ -363,6 +690,42 @@ static bool test_getmessages_subscribe(test_state *state) {
   return true;
 }
 
+static bool test_snapshot(test_state *state) {
+  cosmo *client = create_client(state);
+
+  json_t *subject = random_subject(NULL, NULL);
+  assert(!cosmo_get_snapshot(client, subject));
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  wait_for_message(state);
+
+  cosmo_snapshot *snapshot1 = cosmo_get_snapshot(client, subject);
+  assert(snapshot1);
+  assert(cosmo_snapshot_length(snapshot1) == 1);
+  assert(json_equal(json_object_get(cosmo_snapshot_get(snapshot1, 0), "message"), message_out));
+  json_decref(message_out);
+
+  message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  wait_for_message(state);
+
+  cosmo_snapshot *snapshot2 = cosmo_get_snapshot(client, subject);
+  assert(cosmo_snapshot_length(snapshot2) == 2);
+  assert(json_equal(json_object_get(cosmo_snapshot_get(snapshot2, 1), "message"), message_out));
+  // Earlier snapshot is unaffected.
+  assert(cosmo_snapshot_length(snapshot1) == 1);
+  assert(!cosmo_snapshot_get(snapshot1, 1));
+  cosmo_snapshot_destroy(snapshot1);
+  cosmo_snapshot_destroy(snapshot2);
+  json_decref(message_out);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  return true;
+}
+
 static bool test_subscribe_barrier(test_state *state) {
   cosmo *client = create_client(state);
 
@@ -450,6 +813,1038 @@ static bool test_message_ordering(test_state *state) {
   return true;
 }
 
+static bool test_rpc_window(test_state *state) {
+  cosmo_options options = {
+    .max_rpcs_in_flight = 4,
+  };
+  cosmo *client = create_client_with_options(state, &options);
+
+#define WINDOW_SUBJECTS 2
+#define WINDOW_MESSAGES 20
+  json_t *subjects[WINDOW_SUBJECTS];
+  for (int i = 0; i < WINDOW_SUBJECTS; i++) {
+    subjects[i] = random_subject(NULL, NULL);
+  }
+
+  // Don't wait between sends, so later ones go out while earlier ones are in
+  // flight.
+  promise *promises[WINDOW_MESSAGES];
+  for (int i = 0; i < WINDOW_MESSAGES; i++) {
+    json_t *message_out = json_integer(i);
+    promises[i] = promise_create(NULL, NULL, NULL);
+    cosmo_send_message(client, subjects[i % WINDOW_SUBJECTS], message_out, promises[i]);
+    json_decref(message_out);
+  }
+  for (int i = 0; i < WINDOW_MESSAGES; i++) {
+    assert(promise_wait(promises[i], NULL));
+    promise_destroy(promises[i]);
+  }
+
+  for (int i = 0; i < WINDOW_SUBJECTS; i++) {
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_subscribe(client, subjects[i], -1, 0, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+
+    // Each subject's messages arrive in the order they were sent.
+    json_t *messages_in = cosmo_get_messages(client, subjects[i]);
+    assert(json_array_size(messages_in) == WINDOW_MESSAGES / WINDOW_SUBJECTS);
+    size_t index;
+    json_t *message_in;
+    json_array_foreach(messages_in, index, message_in) {
+      assert(json_integer_value(json_object_get(message_in, "message")) == (json_int_t) (index * WINDOW_SUBJECTS + i));
+    }
+    json_decref(messages_in);
+    json_decref(subjects[i]);
+  }
+
+  cosmo_shutdown(client);
+  return true;
+}
+
+static bool test_batch_limits(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_options options = {
+    .linger_ms = 60 * 1000,
+    .max_batch_commands = 4,
+  };
+  cosmo *client = create_mock_client_with_options(state, server, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  struct timespec start, end;
+  assert(timespec_get(&start, TIME_UTC) == TIME_UTC);
+  promise *promises[8];
+  for (int i = 0; i < 8; i++) {
+    json_t *message_out = json_integer(i);
+    promises[i] = promise_create(NULL, NULL, NULL);
+    cosmo_send_message(client, subject, message_out, promises[i]);
+    json_decref(message_out);
+  }
+  for (int i = 0; i < 8; i++) {
+    assert(promise_wait(promises[i], NULL));
+    promise_destroy(promises[i]);
+  }
+  assert(timespec_get(&end, TIME_UTC) == TIME_UTC);
+  // Full batches don't wait out the linger.
+  assert(end.tv_sec - start.tv_sec < 5);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_linger_under_load(test_state *state) {
+  mock_server_options server_options = {
+    .latency_ms = 200,
+  };
+  mock_server *server = mock_server_create(&server_options);
+  cosmo_callbacks callbacks = {NULL};
+  cosmo_options options = {
+    .allow_http_loopback = true,
+    .linger_ms = 300,
+    .trace = on_trace,
+  };
+  cosmo *client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+
+  // The second command is queued while the first is in flight; that RPC
+  // completing doesn't cut its linger short.
+  json_t *subject = random_subject(NULL, NULL);
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  json_decref(message_out);
+  thrd_sleep(&(struct timespec){ .tv_nsec = 350000000 }, NULL);
+  message_out = random_message();
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message_out, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  json_decref(message_out);
+
+  assert(!pthread_mutex_lock(&state->lock));
+  json_int_t enqueue_us = -1, send_us = -1;
+  size_t index;
+  json_t *trace;
+  json_array_foreach(state->traces, index, trace) {
+    // Commands are numbered from 1.
+    if (json_integer_value(json_object_get(trace, "command_id")) != 2) {
+      continue;
+    }
+    json_int_t time_us = json_integer_value(json_object_get(trace, "time_us"));
+    switch (json_integer_value(json_object_get(trace, "stage"))) {
+      case COSMO_TRACE_ENQUEUE:
+        enqueue_us = time_us;
+        break;
+      case COSMO_TRACE_SEND:
+        send_us = send_us < 0 ? time_us : send_us;
+        break;
+    }
+  }
+  assert(!pthread_mutex_unlock(&state->lock));
+  assert(enqueue_us >= 0 && send_us >= 0);
+  assert(send_us - enqueue_us >= 250 * 1000);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_send_message_copies(test_state *state) {
+  cosmo *client = create_client(state);
+
+  json_t *subject = random_subject(NULL, NULL);
+  json_t *message_out = json_pack("{si}", "n", 1);
+  json_t *expected = json_deep_copy(message_out);
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message_out, promise_obj);
+  // Changing ours after the call mustn't change what's sent.
+  json_object_set_new(message_out, "n", json_integer(2));
+  json_t *message_in;
+  assert(promise_wait(promise_obj, (void **) &message_in));
+  assert(json_equal(expected, json_object_get(message_in, "message")));
+  promise_destroy(promise_obj);
+
+  json_decref(expected);
+  json_decref(message_out);
+  json_decref(subject);
+  cosmo_shutdown(client);
+  return true;
+}
+
+static bool test_send_messages(test_state *state) {
+  cosmo *client = create_client(state);
+
+#define BULK_SUBJECTS 2
+#define BULK_MESSAGES 10
+  json_t *subjects[BULK_SUBJECTS];
+  for (int i = 0; i < BULK_SUBJECTS; i++) {
+    subjects[i] = random_subject(NULL, NULL);
+  }
+
+  json_t *message_subjects[BULK_MESSAGES], *messages_out[BULK_MESSAGES];
+  promise *promises[BULK_MESSAGES];
+  for (int i = 0; i < BULK_MESSAGES; i++) {
+    message_subjects[i] = subjects[i % BULK_SUBJECTS];
+    messages_out[i] = json_integer(i);
+    promises[i] = promise_create(NULL, NULL, NULL);
+  }
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_messages(client, BULK_MESSAGES, message_subjects, messages_out, promise_obj, promises);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  for (int i = 0; i < BULK_MESSAGES; i++) {
+    json_t *message_in;
+    assert(promise_wait(promises[i], (void **) &message_in));
+    assert(json_equal(messages_out[i], json_object_get(message_in, "message")));
+    promise_destroy(promises[i]);
+    json_decref(messages_out[i]);
+  }
+
+  for (int i = 0; i < BULK_SUBJECTS; i++) {
+    promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_subscribe(client, subjects[i], -1, 0, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+
+    json_t *messages_in = cosmo_get_messages(client, subjects[i]);
+    assert(json_array_size(messages_in) == BULK_MESSAGES / BULK_SUBJECTS);
+    size_t index;
+    json_t *message_in;
+    json_array_foreach(messages_in, index, message_in) {
+      assert(json_integer_value(json_object_get(message_in, "message")) == (json_int_t) (index * BULK_SUBJECTS + i));
+    }
+    json_decref(messages_in);
+    json_decref(subjects[i]);
+  }
+
+  cosmo_shutdown(client);
+  return true;
+}
+
+static void journal_path(char *path) {
+  char uuid[COSMO_UUID_SIZE];
+  cosmo_uuid(uuid);
+  sprintf(path, "/tmp/cosmo-test-%s.journal", uuid);
+}
+
+static bool test_journal(test_state *state) {
+  char path[COSMO_UUID_SIZE + 32];
+  journal_path(path);
+
+  struct cosmo_journal journal;
+  assert(cosmo_journal_open(&journal, path, NULL));
+  json_t *commands[3];
+  size_t offsets[3];
+  for (int i = 0; i < 3; i++) {
+    commands[i] = json_pack("{sss{si}}", "command", "sendMessage", "arguments", "seq", i);
+    offsets[i] = cosmo_journal_append(&journal, commands[i]);
+  }
+  cosmo_journal_complete(&journal, offsets[1]);
+  cosmo_journal_sync(&journal);
+  cosmo_journal_close(&journal);
+
+  // Only the unacknowledged commands come back, in order.
+  assert(cosmo_journal_open(&journal, path, NULL));
+  size_t offset = 0, record_offset;
+  json_t *command = cosmo_journal_next(&journal, &offset, &record_offset);
+  assert(json_equal(command, commands[0]) && record_offset == offsets[0]);
+  json_decref(command);
+  command = cosmo_journal_next(&journal, &offset, &record_offset);
+  assert(json_equal(command, commands[2]) && record_offset == offsets[2]);
+  json_decref(command);
+  assert(!cosmo_journal_next(&journal, &offset, &record_offset));
+
+  cosmo_journal_complete(&journal, offsets[0]);
+  cosmo_journal_complete(&journal, offsets[2]);
+  cosmo_journal_close(&journal);
+
+  assert(cosmo_journal_open(&journal, path, NULL));
+  offset = 0;
+  assert(!cosmo_journal_next(&journal, &offset, &record_offset));
+  cosmo_journal_close(&journal);
+
+  for (int i = 0; i < 3; i++) {
+    json_decref(commands[i]);
+  }
+  assert(!unlink(path));
+  return true;
+}
+
+static bool test_journal_compact(test_state *state) {
+  char path[COSMO_UUID_SIZE + 32];
+  journal_path(path);
+
+#define COMPACT_COMMANDS 1000
+#define COMPACT_PENDING 10
+  struct cosmo_journal journal;
+  assert(cosmo_journal_open(&journal, path, NULL));
+  json_t *commands[COMPACT_COMMANDS];
+  size_t offsets[COMPACT_COMMANDS];
+  char padding[101];
+  memset(padding, 'x', sizeof(padding) - 1);
+  padding[sizeof(padding) - 1] = '\0';
+  for (int i = 0; i < COMPACT_COMMANDS; i++) {
+    commands[i] = json_pack("{sss{siss}}", "command", "sendMessage", "arguments", "seq", i, "padding", padding);
+    offsets[i] = cosmo_journal_append(&journal, commands[i]);
+  }
+  // Nothing to drop while the first is pending.
+  for (int i = 1; i < COMPACT_COMMANDS - COMPACT_PENDING; i++) {
+    cosmo_journal_complete(&journal, offsets[i]);
+  }
+  assert(!cosmo_journal_compact(&journal));
+  cosmo_journal_complete(&journal, offsets[0]);
+  size_t moved = cosmo_journal_compact(&journal);
+  assert(moved == offsets[COMPACT_COMMANDS - COMPACT_PENDING]);
+  char tmp_path[sizeof(path) + 4];
+  sprintf(tmp_path, "%s.tmp", path);
+  assert(access(tmp_path, F_OK));
+
+  // Moved offsets still identify their records.
+  cosmo_journal_complete(&journal, offsets[COMPACT_COMMANDS - COMPACT_PENDING] - moved);
+  cosmo_journal_close(&journal);
+
+  assert(cosmo_journal_open(&journal, path, NULL));
+  size_t offset = 0, record_offset;
+  for (int i = COMPACT_COMMANDS - COMPACT_PENDING + 1; i < COMPACT_COMMANDS; i++) {
+    json_t *command = cosmo_journal_next(&journal, &offset, &record_offset);
+    assert(json_equal(command, commands[i]) && record_offset == offsets[i] - moved);
+    json_decref(command);
+  }
+  assert(!cosmo_journal_next(&journal, &offset, &record_offset));
+  cosmo_journal_close(&journal);
+
+  for (int i = 0; i < COMPACT_COMMANDS; i++) {
+    json_decref(commands[i]);
+  }
+  assert(!unlink(path));
+  return true;
+}
+
+static bool test_journal_replay(test_state *state) {
+  char path[COSMO_UUID_SIZE + 32];
+  journal_path(path);
+
+  // Held back by the linger until shutdown, as if the process had died.
+  cosmo_options options = {
+    .linger_ms = 60 * 1000,
+    .journal_path = path,
+    .journal_sync = true,
+  };
+  cosmo *client = create_client_with_options(state, &options);
+  json_t *subject = random_subject(NULL, NULL);
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  cosmo_shutdown(client);
+
+  options.linger_ms = 0;
+  client = create_client_with_options(state, &options);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  cosmo_shutdown(client);
+
+  json_decref(subject);
+  json_decref(message_out);
+  assert(!unlink(path));
+  return true;
+}
+
+static bool test_journal_unusable(test_state *state) {
+  char path[COSMO_UUID_SIZE + 32];
+  journal_path(path);
+  cosmo_options options = {
+    .journal_path = path,
+  };
+  cosmo *client = create_client_with_options(state, &options);
+  // Held by client; both of these go without one.
+  cosmo *locked_out = create_client_with_options(state, &options);
+  options.journal_path = "/nonexistent/cosmo-test.journal";
+  cosmo *no_dir = create_client_with_options(state, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  json_t *message = random_message();
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(locked_out, subject, message, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(no_dir, subject, message, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  json_decref(message);
+  json_decref(subject);
+
+  cosmo_shutdown(no_dir);
+  cosmo_shutdown(locked_out);
+  cosmo_shutdown(client);
+  assert(!unlink(path));
+  return true;
+}
+
+static bool test_subscription_cache(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  char dir[COSMO_UUID_SIZE + 32];
+  char uuid[COSMO_UUID_SIZE];
+  cosmo_uuid(uuid);
+  sprintf(dir, "/tmp/cosmo-test-%s", uuid);
+  assert(!mkdir(dir, 0700));
+
+  cosmo_options options = {
+    .cache_dir = dir,
+  };
+  cosmo *client = create_mock_client_with_options(state, server, &options);
+  json_t *subject = random_subject(NULL, NULL);
+  for (int i = 0; i < 3; i++) {
+    json_t *message_out = json_integer(i);
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_send_message(client, subject, message_out, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+    json_decref(message_out);
+  }
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  char path[sizeof(dir) + 24];
+  sprintf(path, "%s/%016jx.cache", dir, (uintmax_t) cosmo_subscriptions_find(&client->subscriptions, subject)->hash);
+  cosmo_shutdown(client);
+
+  // The cached history is there before the server answers.
+  client = create_mock_client_with_options(state, server, &options);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  json_t *messages_in = cosmo_get_messages(client, subject);
+  assert(json_array_size(messages_in) == 3);
+  json_decref(messages_in);
+
+  // The first client's deliveries may still be in state; wait for this one.
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  while (!json_equal(message_out, json_object_get(wait_for_message(state), "message")));
+  json_decref(message_out);
+  messages_in = cosmo_get_messages(client, subject);
+  assert(json_array_size(messages_in) == 4);
+  json_decref(messages_in);
+
+  // Unsubscribing deletes it.
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_unsubscribe(client, subject, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  assert(access(path, F_OK));
+  cosmo_shutdown(client);
+
+  // A cache of the last message isn't taken for the whole history.
+  client = create_mock_client_with_options(state, server, &options);
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subject, 1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  cosmo_shutdown(client);
+  client = create_mock_client_with_options(state, server, &options);
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  messages_in = cosmo_get_messages(client, subject);
+  assert(json_array_size(messages_in) == 4);
+  json_decref(messages_in);
+  cosmo_unsubscribe(client, subject, NULL);
+  cosmo_shutdown(client);
+
+  // Without a usable directory, subscriptions just aren't cached.
+  char missing[sizeof(dir) + 8];
+  sprintf(missing, "%s/absent", dir);
+  options.cache_dir = missing;
+  client = create_mock_client_with_options(state, server, &options);
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  messages_in = cosmo_get_messages(client, subject);
+  assert(json_array_size(messages_in) == 4);
+  json_decref(messages_in);
+  cosmo_shutdown(client);
+
+  json_decref(subject);
+  assert(!rmdir(dir));
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_subscription_cache_bound(test_state *state) {
+  char dir[COSMO_UUID_SIZE + 32];
+  char uuid[COSMO_UUID_SIZE];
+  cosmo_uuid(uuid);
+  sprintf(dir, "/tmp/cosmo-test-%s", uuid);
+  assert(!mkdir(dir, 0700));
+
+  mock_server *server = mock_server_create(NULL);
+  cosmo_callbacks callbacks = {NULL};
+  cosmo_options options = {
+    .allow_http_loopback = true,
+    .cache_dir = dir,
+  };
+  cosmo *client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+  json_t *subject = random_subject(NULL, NULL);
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subject, 1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  char path[sizeof(dir) + 24];
+  sprintf(path, "%s/%016jx.cache", dir, (uintmax_t) cosmo_subscriptions_find(&client->subscriptions, subject)->hash);
+
+  // A cache of the last message stays small however many arrive.
+#define CACHE_BOUND_MESSAGES (CACHE_REWRITE_MIN_MESSAGES * 3)
+  json_t *subjects[CACHE_BOUND_MESSAGES], *messages[CACHE_BOUND_MESSAGES];
+  for (size_t i = 0; i < CACHE_BOUND_MESSAGES; i++) {
+    subjects[i] = subject;
+    messages[i] = json_integer(i);
+  }
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_messages(client, CACHE_BOUND_MESSAGES, subjects, messages, promise_obj, NULL);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  for (size_t i = 0; i < CACHE_BOUND_MESSAGES; i++) {
+    json_decref(messages[i]);
+  }
+  json_t *messages_in;
+  while (json_array_size(messages_in = cosmo_get_messages(client, subject)) < CACHE_BOUND_MESSAGES) {
+    json_decref(messages_in);
+    thrd_sleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+  }
+  json_decref(messages_in);
+  cosmo_shutdown(client);
+
+  struct cosmo_journal journal;
+  assert(cosmo_journal_open(&journal, path, NULL));
+  size_t offset = 0, record_offset, records = 0;
+  json_t *record;
+  while ((record = cosmo_journal_next(&journal, &offset, &record_offset))) {
+    json_decref(record);
+    records++;
+  }
+  cosmo_journal_close(&journal);
+  // The header, and no more than the rewrite allows.
+  assert(records >= 2 && records <= 1 + CACHE_REWRITE_MIN_MESSAGES);
+
+  // Unsubscribing doesn't mind the file having gone already.
+  client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+  cosmo_subscribe(client, subject, 1, 0, NULL);
+  assert(!unlink(path));
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_unsubscribe(client, subject, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  cosmo_shutdown(client);
+
+  json_decref(subject);
+  mock_server_destroy(server);
+  assert(!rmdir(dir));
+  return true;
+}
+
+static bool test_dispatch_thread(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_options options = {
+    .dispatch_queue_size = 4,
+  };
+  cosmo *client = create_mock_client_with_options(state, server, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  json_decref(message_out);
+
+  cosmo_dispatch_stats stats;
+  cosmo_get_dispatch_stats(client, &stats);
+  assert(stats.max_queue_depth >= 1);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_dispatch_executor(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_options options = {
+    .dispatch_queue_size = 4,
+    .dispatch_notify = on_dispatch_notify,
+  };
+  cosmo *client = create_mock_client_with_options(state, server, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+
+  // Callbacks only run here, on this thread.
+  while (true) {
+    wait_for_dispatch_notify(state);
+    cosmo_dispatch(client);
+    assert(!pthread_mutex_lock(&state->lock));
+    const json_t *message_in = state->last_message;
+    state->last_message = NULL;
+    assert(!pthread_mutex_unlock(&state->lock));
+    if (message_in) {
+      assert(json_equal(message_out, json_object_get(message_in, "message")));
+      break;
+    }
+  }
+  json_decref(message_out);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_dispatch_overflow(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_options options = {
+    .dispatch_queue_size = 1,
+    .dispatch_notify = on_dispatch_notify,
+  };
+  cosmo *client = create_mock_client_with_options(state, server, &options);
+
+  // Nothing is dispatched until all are sent: the network thread carries on
+  // past the full ring.
+  json_t *subject = random_subject(NULL, NULL);
+  promise *promises[4];
+  for (int i = 0; i < 4; i++) {
+    json_t *message_out = random_message();
+    promises[i] = promise_create(NULL, NULL, NULL);
+    cosmo_send_message(client, subject, message_out, promises[i]);
+    json_decref(message_out);
+  }
+  cosmo_dispatch_stats stats;
+  while (cosmo_get_dispatch_stats(client, &stats), stats.queue_depth < 4) {
+    thrd_sleep(&(struct timespec){ .tv_nsec = 10000000 }, NULL);
+  }
+  assert(stats.max_queue_depth >= 4);
+
+  // Then all of them run here.
+  assert(cosmo_dispatch(client) >= 4);
+  for (int i = 0; i < 4; i++) {
+    assert(promise_wait_timeout(promises[i], 0, NULL, NULL));
+    promise_destroy(promises[i]);
+  }
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_dispatch_fd(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_options options = {
+    .dispatch_fd = true,
+  };
+  cosmo *client = create_mock_client_with_options(state, server, &options);
+  struct pollfd pfd = {
+    .fd = cosmo_get_fd(client),
+    .events = POLLIN,
+  };
+  assert(pfd.fd >= 0);
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  json_t *message_out = random_message();
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message_out, promise_obj);
+
+  // Callbacks and promise completions only happen here, on this thread.
+  bool sent = false;
+  while (true) {
+    assert(poll(&pfd, 1, -1) == 1);
+    cosmo_process_events(client);
+    sent = sent || promise_wait_timeout(promise_obj, 0, NULL, NULL);
+    assert(!pthread_mutex_lock(&state->lock));
+    const json_t *message_in = state->last_message;
+    state->last_message = NULL;
+    assert(!pthread_mutex_unlock(&state->lock));
+    if (message_in) {
+      assert(json_equal(message_out, json_object_get(message_in, "message")));
+      break;
+    }
+  }
+  while (!sent) {
+    assert(poll(&pfd, 1, -1) == 1);
+    cosmo_process_events(client);
+    sent = promise_wait_timeout(promise_obj, 0, NULL, NULL);
+  }
+  promise_destroy(promise_obj);
+  json_decref(message_out);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+
+  // Without dispatch_fd there's nothing to process.
+  client = create_mock_client(state, server);
+  assert(cosmo_get_fd(client) == -1);
+  assert(!cosmo_process_events(client));
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_stats(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo *client = create_mock_client(state, server);
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  json_t *message_out = random_message();
+  cosmo_send_message(client, subject, message_out, NULL);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+  json_decref(message_out);
+
+  cosmo_stats stats;
+  cosmo_get_stats(client, &stats);
+  assert(stats.rpcs > 0);
+  assert(stats.rpc_latency.count > 0);
+  assert(stats.rpc_latency.max_us <= stats.rpc_latency.total_us);
+  uint64_t bucketed = 0;
+  for (int i = 0; i < COSMO_HISTOGRAM_BUCKETS; i++) {
+    bucketed += stats.rpc_latency.buckets[i];
+  }
+  assert(bucketed == stats.rpc_latency.count);
+  assert(stats.bytes_sent > 0);
+  assert(stats.bytes_received > 0);
+  assert(stats.subscriptions == 1);
+  assert(stats.messages == 1);
+  assert(stats.callback_time.count > 0);
+  assert(stats.lock_wait.count > 0);
+  assert(stats.lock_hold.count > 0);
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+// First trace event at stage, matching command_id and sender_message_id if
+// they're set. Call with the state locked.
+static const json_t *find_trace(test_state *state, cosmo_trace_stage stage, json_int_t command_id, const char *sender_message_id) {
+  size_t index;
+  json_t *trace;
+  json_array_foreach(state->traces, index, trace) {
+    const char *trace_sender_message_id = json_string_value(json_object_get(trace, "sender_message_id"));
+    if (json_integer_value(json_object_get(trace, "stage")) == stage &&
+        (!command_id || json_integer_value(json_object_get(trace, "command_id")) == command_id) &&
+        (!sender_message_id || (trace_sender_message_id && !strcmp(trace_sender_message_id, sender_message_id)))) {
+      return trace;
+    }
+  }
+  return NULL;
+}
+
+static bool test_trace(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_options options = {
+    .trace = on_trace,
+  };
+  cosmo *client = create_mock_client_with_options(state, server, &options);
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  json_t *message_out = random_message();
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message_out, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  const json_t *message_in = wait_for_message(state);
+  const char *sender_message_id = json_string_value(json_object_get(message_in, "sender_message_id"));
+  json_decref(message_out);
+
+  assert(!pthread_mutex_lock(&state->lock));
+  const json_t *enqueue = find_trace(state, COSMO_TRACE_ENQUEUE, 0, sender_message_id);
+  assert(enqueue);
+  json_int_t command_id = json_integer_value(json_object_get(enqueue, "command_id"));
+  // The callback stage follows the promise completing.
+  while (!find_trace(state, COSMO_TRACE_CALLBACK, command_id, NULL)) {
+    assert(!pthread_cond_wait(&state->cond, &state->lock));
+  }
+  json_int_t last_us = 0;
+  cosmo_trace_stage stages[] = {COSMO_TRACE_ENQUEUE, COSMO_TRACE_SEND, COSMO_TRACE_RESPONSE, COSMO_TRACE_COMPLETE, COSMO_TRACE_CALLBACK};
+  for (size_t i = 0; i < sizeof(stages) / sizeof(*stages); i++) {
+    const json_t *trace = find_trace(state, stages[i], command_id, NULL);
+    assert(trace);
+    json_int_t time_us = json_integer_value(json_object_get(trace, "time_us"));
+    assert(time_us >= last_us);
+    last_us = time_us;
+  }
+  const json_t *receive = find_trace(state, COSMO_TRACE_RECEIVE, 0, sender_message_id);
+  assert(receive);
+  assert(json_integer_value(json_object_get(receive, "time_us")) >= json_integer_value(json_object_get(enqueue, "time_us")));
+  assert(!pthread_mutex_unlock(&state->lock));
+
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static atomic_size_t allocs, frees;
+
+static void *counting_malloc(size_t size) {
+  atomic_fetch_add(&allocs, 1);
+  return malloc(size);
+}
+
+static void *counting_realloc(void *ptr, size_t size) {
+  if (!ptr) {
+    atomic_fetch_add(&allocs, 1);
+  }
+  return realloc(ptr, size);
+}
+
+static void counting_free(void *ptr) {
+  atomic_fetch_add(&frees, 1);
+  free(ptr);
+}
+
+static bool test_alloc_funcs(test_state *state) {
+  atomic_store(&allocs, 0);
+  atomic_store(&frees, 0);
+  cosmo_options options = {
+    .malloc_func = counting_malloc,
+    .realloc_func = counting_realloc,
+    .free_func = counting_free,
+  };
+  cosmo *client = create_client_with_options(state, &options);
+
+  // More commands than fit in one slab, with the messages coming back into a
+  // subscription's store.
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  for (size_t i = 0; i < COMMAND_SLAB_SIZE + 1; i++) {
+    json_t *message = random_message();
+    cosmo_send_message(client, subject, message, NULL);
+    json_decref(message);
+  }
+  json_t *message = random_message();
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  json_decref(message);
+
+  // Once those are all freed, the emptied slab goes back.
+  message = random_message();
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  json_decref(message);
+  json_decref(subject);
+  assert(cosmo_command_slab_count(client) == 1);
+
+  assert(atomic_load(&allocs) >= 2);
+  cosmo_shutdown(client);
+  assert(atomic_load(&allocs) == atomic_load(&frees));
+  return true;
+}
+
+static bool test_mock_server(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_callbacks callbacks = {
+    .message = on_message,
+  };
+  cosmo_options options = {
+    .allow_http_loopback = true,
+  };
+  cosmo *client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+
+  json_t *subject = random_subject(NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, NULL);
+  json_t *message_out = random_message();
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message_out, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  const json_t *message_in = wait_for_message(state);
+  assert(json_equal(message_out, json_object_get(message_in, "message")));
+
+  json_decref(message_out);
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_bulk_resubscribe_retry(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_callbacks callbacks = {
+    .message = on_message,
+  };
+  cosmo_options options = {
+    .allow_http_loopback = true,
+  };
+  cosmo *client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+
+  json_t *subjects = json_array();
+  for (int i = 0; i < 3; i++) {
+    json_array_append_new(subjects, random_subject(NULL, NULL));
+  }
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subjects, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+
+  // Look new, to a server that isn't ready for some of the resubscribes.
+  mock_server_retry_subscribes(server, 2);
+  cosmo_force_new_instance(client);
+
+  // None are dropped.
+  size_t index;
+  json_t *subject;
+  json_array_foreach(subjects, index, subject) {
+    json_t *message_out = random_message();
+    cosmo_send_message(client, subject, message_out, NULL);
+    const json_t *message_in = wait_for_message(state);
+    assert(json_equal(message_out, json_object_get(message_in, "message")));
+    json_decref(message_out);
+  }
+  cosmo_stats stats;
+  cosmo_get_stats(client, &stats);
+  assert(stats.subscriptions == 3);
+
+  // Nor when the whole resubscribe fails.
+  mock_server_fail_bulk_subscribes(server, 1);
+  cosmo_force_new_instance(client);
+  json_array_foreach(subjects, index, subject) {
+    json_t *message_out = random_message();
+    cosmo_send_message(client, subject, message_out, NULL);
+    const json_t *message_in = wait_for_message(state);
+    assert(json_equal(message_out, json_object_get(message_in, "message")));
+    json_decref(message_out);
+  }
+  cosmo_get_stats(client, &stats);
+  assert(stats.subscriptions == 3);
+
+  json_decref(subjects);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_events_before_responses(test_state *state) {
+  mock_server *server = mock_server_create(NULL);
+  cosmo_callbacks callbacks = {
+    .message = on_message,
+  };
+  cosmo_options options = {
+    .allow_http_loopback = true,
+  };
+  cosmo *client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+  json_t *subject = random_subject(NULL, NULL);
+  json_t *message = random_message();
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_send_message(client, subject, message, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  cosmo_shutdown(client);
+
+  // The history comes back in the same response as the subscribe result, and is
+  // delivered first.
+  client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+  promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subject, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+  assert(!pthread_mutex_lock(&state->lock));
+  assert(state->last_message);
+  assert(json_equal(json_object_get(state->last_message, "message"), message));
+  state->last_message = NULL;
+  assert(!pthread_mutex_unlock(&state->lock));
+
+  json_decref(message);
+  json_decref(subject);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
+static bool test_messages_batch(test_state *state) {
+  cosmo_callbacks callbacks = {
+    .messages_batch = on_messages_batch,
+  };
+  cosmo_options options = {
+    .allow_http_loopback = true,
+  };
+  mock_server *server = mock_server_create(NULL);
+  cosmo *client = cosmo_create(mock_server_base_url(server), NULL, &callbacks, &options, state);
+
+#define BATCH_SUBJECTS 2
+#define BATCH_MESSAGES 10
+  json_t *subjects = json_array();
+  for (int i = 0; i < BATCH_SUBJECTS; i++) {
+    json_array_append_new(subjects, random_subject(NULL, NULL));
+  }
+  for (int i = 0; i < BATCH_MESSAGES; i++) {
+    json_t *message_out = json_integer(i);
+    promise *promise_obj = promise_create(NULL, NULL, NULL);
+    cosmo_send_message(client, json_array_get(subjects, i % BATCH_SUBJECTS), message_out, promise_obj);
+    assert(promise_wait(promise_obj, NULL));
+    promise_destroy(promise_obj);
+    json_decref(message_out);
+  }
+
+  promise *promise_obj = promise_create(NULL, NULL, NULL);
+  cosmo_subscribe(client, subjects, -1, 0, promise_obj);
+  assert(promise_wait(promise_obj, NULL));
+  promise_destroy(promise_obj);
+
+  // Each batch holds each subject's messages together, in order.
+  assert(!pthread_mutex_lock(&state->lock));
+  size_t received = 0, batch_index;
+  json_t *batch;
+  json_array_foreach(state->messages_batch, batch_index, batch) {
+    json_t *seen = json_array();
+    json_t *last_subject = NULL;
+    json_int_t last_id = 0;
+    size_t index;
+    json_t *message;
+    json_array_foreach(batch, index, message) {
+      json_t *subject = json_object_get(message, "subject");
+      json_int_t id = json_integer_value(json_object_get(message, "id"));
+      if (last_subject && json_equal(subject, last_subject)) {
+        assert(id > last_id);
+      } else {
+        size_t seen_index;
+        json_t *seen_subject;
+        json_array_foreach(seen, seen_index, seen_subject) {
+          assert(!json_equal(subject, seen_subject));
+        }
+        json_array_append(seen, subject);
+      }
+      last_subject = subject;
+      last_id = id;
+      received++;
+    }
+    json_decref(seen);
+  }
+  assert(received == BATCH_MESSAGES);
+  assert(!pthread_mutex_unlock(&state->lock));
+
+  json_decref(subjects);
+  cosmo_shutdown(client);
+  mock_server_destroy(server);
+  return true;
+}
+
 static bool test_subscribe_acl(test_state *state) {
   cosmo *client = create_client(state);
   promise *promise_obj = promise_create(NULL, NULL, NULL);
@@ -496,16 +1891,46 @@ int main(int argc, char *argv[]) {
   RUN_TEST(test_client_id_change_fires);
   RUN_TEST(test_connect_logout_fires);
   RUN_TEST(test_message_round_trip);
+  RUN_TEST(test_shared_loop);
+  RUN_TEST(test_hanging_poll);
+  RUN_TEST(test_poll_backoff);
   RUN_TEST(test_resubscribe_after_reconnect);
   RUN_TEST(test_reconnect);
   RUN_TEST(test_bulk_subscribe);
+  RUN_TEST(test_bulk_resubscribe);
   RUN_TEST(test_complex_object);
+  RUN_TEST(test_raw_messages);
+  RUN_TEST(test_compression);
   RUN_TEST(test_send_message_promise);
   RUN_TEST(test_subscribe_unsubscribe_promise);
+  RUN_TEST(test_promise_combinators);
   RUN_TEST(test_getmessages_subscribe);
+  RUN_TEST(test_snapshot);
   RUN_TEST(test_subscribe_barrier);
   RUN_TEST(test_resubscribe);
   RUN_TEST(test_message_ordering);
+  RUN_TEST(test_rpc_window);
+  RUN_TEST(test_batch_limits);
+  RUN_TEST(test_linger_under_load);
+  RUN_TEST(test_send_messages);
+  RUN_TEST(test_send_message_copies);
+  RUN_TEST(test_journal);
+  RUN_TEST(test_journal_compact);
+  RUN_TEST(test_journal_replay);
+  RUN_TEST(test_journal_unusable);
+  RUN_TEST(test_subscription_cache);
+  RUN_TEST(test_subscription_cache_bound);
+  RUN_TEST(test_dispatch_thread);
+  RUN_TEST(test_dispatch_executor);
+  RUN_TEST(test_dispatch_overflow);
+  RUN_TEST(test_dispatch_fd);
+  RUN_TEST(test_stats);
+  RUN_TEST(test_trace);
+  RUN_TEST(test_alloc_funcs);
+  RUN_TEST(test_mock_server);
+  RUN_TEST(test_bulk_resubscribe_retry);
+  RUN_TEST(test_events_before_responses);
+  RUN_TEST(test_messages_batch);
   RUN_TEST(test_subscribe_acl);
 
   return 0;
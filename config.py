@@ -4,6 +4,20 @@ NAMESPACE = 'cosmopolite'
 
 # Timings
 CHANNEL_DURATION_SECONDS = 60 * 60 * 2  # 2 hours
+# Each hanging poll holds a request thread for up to this long, so serving
+# them needs threadsafe: true and instances with threads to spare. 0 turns
+# them off; polls then return at once.
+HANGING_POLL_MAX_MS = 50 * 1000  # under the 60 second request deadline
+HANGING_POLL_INTERVAL_SECONDS = 0.5  # between memcache checks
+HANGING_POLL_RESCAN_SECONDS = 10  # between datastore scans without a signal
+
+# Compression
+GZIP_LEVEL = 6
+GZIP_MIN_RESPONSE_BYTES = 1024
+MAX_REQUEST_BYTES = 16 * 1024 * 1024  # after decompression
+
+# Limits
+MAX_SUBSCRIBE_SUBJECTS = 500  # per subscribe command
 
 # Probabilities
 CHAOS_PROBABILITY = 0.05
@@ -21,6 +21,7 @@ import struct
 import uuid
 
 from google.appengine.api import channel
+from google.appengine.api import memcache
 from google.appengine.api import users
 from google.appengine.ext import db
 
@@ -136,6 +137,19 @@ class Instance(db.Model):
         Subscription.all()
         .filter('instance =', self))
 
+  @classmethod
+  def _EventsVersionKey(cls, instance_id):
+    return 'events_version:%s' % instance_id
+
+  @classmethod
+  def NotifyEvents(cls, instance_key):
+    """Tells hanging polls for the instance that it has new events."""
+    memcache.incr(cls._EventsVersionKey(instance_key.name()), initial_value=0)
+
+  def GetEventsVersion(self):
+    """Changes whenever NotifyEvents() is called; None if memcache lost it."""
+    return memcache.get(self._EventsVersionKey(self.key().name()))
+
 
 class Subject(db.Model):
 
@@ -146,6 +160,8 @@ class Subject(db.Model):
       reference_class=Profile, collection_name='writable_subject_set')
 
   next_message_id = db.IntegerProperty(required=True, default=1)
+  # Numbers events queued for polling subscriptions; see _PutEvents().
+  next_event_seq = db.IntegerProperty(required=True, default=1)
 
   _cache = {}
 
@@ -164,7 +180,7 @@ class Subject(db.Model):
     return hashobj.hexdigest()
 
   @classmethod
-  def FindOrCreate(cls, subject, client):
+  def _AccessKeys(cls, subject, client):
     if 'readable_only_by' in subject:
       if subject['readable_only_by'] == 'admin':
         readable_only_by = Profile.ADMIN_KEY
@@ -185,19 +201,37 @@ class Subject(db.Model):
     else:
       writable_only_by = None
 
-    key_name = cls._KeyName(subject)
-    obj = cls._cache.get(key_name)
-    if obj:
-      return obj
+    return (readable_only_by, writable_only_by)
 
-    obj = cls.get_or_insert(
-        key_name,
-        name=subject['name'],
-        readable_only_by=readable_only_by,
-        writable_only_by=writable_only_by)
+  @classmethod
+  def FindOrCreate(cls, subject, client):
+    return cls.FindOrCreateMulti([subject], client)[0]
 
-    cls._cache[key_name] = obj
-    return obj
+  @classmethod
+  def FindOrCreateMulti(cls, subjects, client):
+    """Existing subjects that aren't cached are read in one batch; only new
+    ones cost a transaction each."""
+    access_keys = [cls._AccessKeys(subject, client) for subject in subjects]
+    key_names = [cls._KeyName(subject) for subject in subjects]
+    uncached = [key_name for key_name in key_names if key_name not in cls._cache]
+    if uncached:
+      for key_name, obj in zip(uncached, cls.get_by_key_name(uncached)):
+        if obj:
+          cls._cache[key_name] = obj
+
+    ret = []
+    for subject, (readable_only_by, writable_only_by), key_name in zip(
+        subjects, access_keys, key_names):
+      obj = cls._cache.get(key_name)
+      if not obj:
+        obj = cls.get_or_insert(
+            key_name,
+            name=subject['name'],
+            readable_only_by=readable_only_by,
+            writable_only_by=writable_only_by)
+        cls._cache[key_name] = obj
+      ret.append(obj)
+    return ret
 
   @classmethod
   def ReadThrough(cls, key):
@@ -260,7 +294,6 @@ class Subject(db.Model):
 
     message_id = subject.next_message_id
     subject.next_message_id += 1
-    subject.put()
 
     obj = Message(
         parent=subject,
@@ -270,9 +303,51 @@ class Subject(db.Model):
         sender_address=sender_address,
         random_value=random.randint(0, 2 ** 32 - 1),
         id_=message_id)
-    obj.put()
 
-    return (obj, list(Subscription.all().ancestor(subject)))
+    event = obj.ToEvent()
+    subscriptions = list(Subscription.all().ancestor(subject))
+    subject._PutEvents([event], subscriptions, to_put=[obj])
+    return (event, subscriptions)
+
+  def _PutEvents(self, events, subscriptions, translate=True, to_put=()):
+    """Queues events for the polling subscriptions.
+
+    Called inside the transaction that stores what they describe, on the
+    subject loaded there; subscriptions removed meanwhile aren't in the list.
+    Each event takes the subject's next sequence number, so that it's in order
+    within every subscription and a client can ack all of them up to one with
+    a single cursor. The subject, the Events and to_put are written in one
+    batch; however many subscribe, no subscription is rewritten.
+    """
+    to_put = list(to_put)
+    polling = [s for s in subscriptions if s.polling]
+    # Subscriptions numbered their own events before; start past those.
+    self.next_event_seq = max(
+        [self.next_event_seq] + [s.last_event_seq + 1 for s in polling])
+    for event in events:
+      seq = self.next_event_seq
+      self.next_event_seq += 1
+      for subscription in polling:
+        to_put.append(Event(
+            parent=subscription,
+            key_name=Event.KeyName(seq),
+            json=subscription.EncodeEvent(event, translate)))
+    to_put.append(self)
+    db.put(to_put)
+
+  def _SendEvents(self, events, subscriptions, translate=True):
+    """Delivers events queued by _PutEvents(), once its transaction is done."""
+    polling_instances = set()
+    for subscription in subscriptions:
+      instance_key = Subscription.instance.get_value_for_datastore(subscription)
+      if subscription.polling:
+        polling_instances.add(instance_key)
+        continue
+      for event in events:
+        channel.send_message(
+            str(instance_key.name()), subscription.EncodeEvent(event, translate))
+    for instance_key in polling_instances:
+      Instance.NotifyEvents(instance_key)
 
   def VerifyWritable(self, sender):
     writable_only_by = Subject.writable_only_by.get_value_for_datastore(self)
@@ -294,29 +369,27 @@ class Subject(db.Model):
     readable_only_by_me = (request.get('readable_only_by') == 'me')
     writable_only_by_me = (request.get('writable_only_by') == 'me')
     try:
-      obj, subscriptions = self.PutMessage(
+      event, subscriptions = self.PutMessage(
           message, sender, sender_message_id, sender_address)
     except DuplicateMessage as e:
       e.original = self.TranslateEvent(
           e.original, readable_only_by_me, writable_only_by_me)
       raise e
-    event = obj.ToEvent()
-    for subscription in subscriptions:
-      subscription.SendMessage(self.TranslateEvent(
-          event,
-          subscription.readable_only_by_me,
-          subscription.writable_only_by_me))
+    self._SendEvents([event], subscriptions)
     return self.TranslateEvent(event, readable_only_by_me, writable_only_by_me)
 
   @db.transactional()
   def PutPin(self, message, sender, sender_message_id,
              instance, sender_address):
     """Internal helper for Pin()."""
+    # Reloaded inside the transaction for its next_event_seq.
+    subject = Subject.get(self.key())
+
     # sender_message_id should be universal across all subjects, but we check
     # it within just this subject to allow in-transaction verification.
     pins = (
         Pin.all()
-        .ancestor(self)
+        .ancestor(subject)
         .filter('sender_message_id =', sender_message_id)
         .filter('instance =', instance)
         .fetch(1))
@@ -324,15 +397,19 @@ class Subject(db.Model):
       raise DuplicateMessage(pins[0].ToEvent())
 
     obj = Pin(
-        parent=self,
+        parent=subject,
         message=message,
         sender=sender,
         sender_message_id=sender_message_id,
         sender_address=sender_address,
         instance=instance)
+    # Put now: the event carries its ID.
     obj.put()
 
-    return (obj, list(Subscription.all().ancestor(self)))
+    event = obj.ToEvent()
+    subscriptions = list(Subscription.all().ancestor(subject))
+    subject._PutEvents([event], subscriptions)
+    return (event, subscriptions)
 
   def Pin(self, message, sender, sender_message_id, sender_address, instance,
           request):
@@ -340,25 +417,21 @@ class Subject(db.Model):
     readable_only_by_me = (request.get('readable_only_by') == 'me')
     writable_only_by_me = (request.get('writable_only_by') == 'me')
     try:
-      obj, subscriptions = self.PutPin(
+      event, subscriptions = self.PutPin(
           message, sender, sender_message_id, instance, sender_address)
     except DuplicateMessage as e:
       e.original = self.TranslateEvent(
           e.original, readable_only_by_me, writable_only_by_me)
       raise e
-    event = obj.ToEvent()
-    for subscription in subscriptions:
-      subscription.SendMessage(self.TranslateEvent(
-          event,
-          subscription.readable_only_by_me,
-          subscription.writable_only_by_me))
+    self._SendEvents([event], subscriptions)
     return self.TranslateEvent(event, readable_only_by_me, writable_only_by_me)
 
   @db.transactional()
   def RemovePin(self, sender, sender_message_id, instance_key):
+    subject = Subject.get(self.key())
     pins = (
         Pin.all()
-        .ancestor(self)
+        .ancestor(subject)
         .filter('sender =', sender)
         .filter('sender_message_id =', sender_message_id)
         .filter('instance =', instance_key))
@@ -369,14 +442,14 @@ class Subject(db.Model):
       events.append(pin.ToEvent(event_type='unpin'))
       pin.delete()
 
-    return (events, list(Subscription.all().ancestor(self)))
+    subscriptions = list(Subscription.all().ancestor(subject))
+    subject._PutEvents(events, subscriptions, translate=False)
+    return (events, subscriptions)
 
   def Unpin(self, sender, sender_message_id, instance_key):
     self.VerifyWritable(sender)
     events, subscriptions = self.RemovePin(sender, sender_message_id, instance_key)
-    for event in events:
-      for subscription in subscriptions:
-        subscription.SendMessage(event)
+    self._SendEvents(events, subscriptions, translate=False)
 
   def ToDict(self):
     ret = {
@@ -424,6 +497,50 @@ class Subject(db.Model):
     return self.TranslateEvents(
         events, readable_only_by_me, writable_only_by_me)
 
+  @classmethod
+  def GetEventsMulti(cls, requests):
+    """GetEvents() for many (subject, messages, last_id, request, pins) at once.
+
+    Each subject is its own entity group, so instead of a transaction per
+    subject, their ancestor queries (strongly consistent on their own) are all
+    started before any is read.
+    """
+    pending = []
+    for subject, messages, last_id, request, pins in requests:
+      # (results, newest first)
+      queries = []
+      if pins:
+        queries.append((Pin.all().ancestor(subject).run(), False))
+      if messages:
+        query = (
+            Message.all()
+            .ancestor(subject)
+            .order('-id_'))
+        queries.append(
+            (query.run(limit=messages if messages > 0 else None), True))
+      if last_id is not None:
+        query = (
+            Message.all()
+            .ancestor(subject)
+            .filter('id_ >', last_id)
+            .order('id_'))
+        queries.append((query.run(), False))
+      pending.append((request, queries))
+
+    events = []
+    for request, queries in pending:
+      subject_events = []
+      for results, newest_first in queries:
+        entities = list(results)
+        if newest_first:
+          entities.reverse()
+        subject_events.extend(entity.ToEvent() for entity in entities)
+      events.extend(cls.TranslateEvents(
+          subject_events,
+          request.get('readable_only_by') == 'me',
+          request.get('writable_only_by') == 'me'))
+    return events
+
 
 class Subscription(db.Model):
   # parent=Subject
@@ -432,6 +549,16 @@ class Subscription(db.Model):
   readable_only_by_me = db.BooleanProperty(required=True, default=False)
   writable_only_by_me = db.BooleanProperty(required=True, default=False)
   polling = db.BooleanProperty(required=True, default=False)
+  # Only read now: the last event number from before the subject numbered
+  # them (see Subject._PutEvents()).
+  last_event_seq = db.IntegerProperty(required=True, default=0)
+
+  @classmethod
+  def _KeyName(cls, instance, readable_only_by_me, writable_only_by_me):
+    # One subscription per instance and view of the subject, so that lookups
+    # can be by key, which is strongly consistent without a transaction.
+    return '%s:%d:%d' % (
+        instance.key().name(), readable_only_by_me, writable_only_by_me)
 
   @classmethod
   @db.transactional()
@@ -439,21 +566,60 @@ class Subscription(db.Model):
                    messages=0, last_id=None, polling=False):
     readable_only_by_me = (request.get('readable_only_by') == 'me')
     writable_only_by_me = (request.get('writable_only_by') == 'me')
-    subscriptions = (
-        cls.all(keys_only=True)
-        .ancestor(subject)
-        .filter('instance =', instance)
-        .filter('readable_only_by_me =', readable_only_by_me)
-        .filter('writable_only_by_me =', writable_only_by_me)
-        .fetch(1))
-    if not subscriptions:
-      cls(parent=subject,
-          instance=instance,
-          readable_only_by_me=readable_only_by_me,
-          writable_only_by_me=writable_only_by_me,
-          polling=polling).put()
+    key_name = cls._KeyName(
+        instance, readable_only_by_me, writable_only_by_me)
+    if not cls.get_by_key_name(key_name, parent=subject):
+      # Also look for one from before subscriptions were keyed.
+      subscriptions = (
+          cls.all(keys_only=True)
+          .ancestor(subject)
+          .filter('instance =', instance)
+          .filter('readable_only_by_me =', readable_only_by_me)
+          .filter('writable_only_by_me =', writable_only_by_me)
+          .fetch(1))
+      if not subscriptions:
+        cls(parent=subject,
+            key_name=key_name,
+            instance=instance,
+            readable_only_by_me=readable_only_by_me,
+            writable_only_by_me=writable_only_by_me,
+            polling=polling).put()
     return subject.GetEvents(messages, last_id, request)
 
+  @classmethod
+  def FindOrCreateMulti(cls, subscribes, instance):
+    """FindOrCreate() for many (subject, request) pairs, without the events.
+
+    Existing subscriptions are found with one batched get by key, and new ones
+    put in one batch rather than a transaction each. Keys are deterministic, so
+    a subscribe racing with this one writes the same entity rather than a
+    second one.
+    """
+    keys = []
+    for subject, request in subscribes:
+      keys.append(db.Key.from_path(
+          cls.kind(),
+          cls._KeyName(
+              instance,
+              request.get('readable_only_by') == 'me',
+              request.get('writable_only_by') == 'me'),
+          parent=subject.key()))
+    to_put = []
+    seen = set()
+    for key, existing, (subject, request) in zip(
+        keys, db.get(keys), subscribes):
+      if existing or key in seen:
+        continue
+      seen.add(key)
+      to_put.append(cls(
+          parent=subject,
+          key_name=key.name(),
+          instance=instance,
+          readable_only_by_me=(request.get('readable_only_by') == 'me'),
+          writable_only_by_me=(request.get('writable_only_by') == 'me'),
+          polling=instance.polling))
+    db.put(to_put)
+
   @classmethod
   @db.transactional()
   def Remove(cls, subject, instance, request):
@@ -468,17 +634,21 @@ class Subscription(db.Model):
     for subscription in subscriptions:
       subscription.Delete()
 
-  def SendMessage(self, msg):
-    encoded = json.dumps(msg, default=utils.EncodeJSON)
-    if self.polling:
-      Event(parent=self,
-            key_name=str(uuid.uuid4()),
-            json=encoded).save()
-    else:
-      instance_key = Subscription.instance.get_value_for_datastore(self)
-      channel.send_message(str(instance_key.name()), encoded)
-
-  def GetEvents(self, acks):
+  def EncodeEvent(self, event, translate=True):
+    """Serializes event as this subscription's client should see it."""
+    if translate:
+      event = Subject.TranslateEvent(
+          event, self.readable_only_by_me, self.writable_only_by_me)
+    return json.dumps(event, default=utils.EncodeJSON)
+
+  def GetEvents(self, acks, ack_cursor=None):
+    if ack_cursor:
+      # One range delete for everything the client has seen.
+      db.delete(
+          Event.all(keys_only=True)
+          .ancestor(self)
+          .filter('__key__ >', Event.Key(self, 0))
+          .filter('__key__ <=', Event.Key(self, ack_cursor)))
     acks = set(acks)
     events = (
         Event.all()
@@ -504,12 +674,31 @@ class Subscription(db.Model):
 
 class Event(db.Model):
   # parent=Subscription
+  # key_name=KeyName(seq), or a uuid for events from before sequence numbers
+
+  _SEQ_PREFIX = 'seq-'
 
   json = db.StringProperty(required=True)
 
+  @classmethod
+  def KeyName(cls, seq):
+    # Zero-padded so that key order is sequence order.
+    return '%s%020d' % (cls._SEQ_PREFIX, seq)
+
+  @classmethod
+  def Key(cls, subscription, seq):
+    return db.Key.from_path(
+        cls.kind(), cls.KeyName(seq), parent=subscription.key())
+
   def ToEvent(self):
     ret = json.loads(self.json)
-    ret['event_id'] = str(self.key().name())
+    key_name = str(self.key().name())
+    ret['event_id'] = key_name
+    if key_name.startswith(self._SEQ_PREFIX):
+      ret['ack_cursor'] = {
+        'subscription': str(self.parent_key()),
+        'seq':          int(key_name[len(self._SEQ_PREFIX):]),
+      }
     return ret
 
 
@@ -18,6 +18,7 @@ import json
 import logging
 import random
 import time
+import zlib
 
 from google.appengine.api import namespace_manager
 
@@ -30,7 +31,18 @@ def expects_json(handler):
 
   @functools.wraps(handler)
   def ParseInput(self):
-    self.request_json = json.load(self.request.body_file)
+    if self.request.headers.get('Content-Encoding') == 'gzip':
+      # wbits + 16 expects a gzip wrapper.
+      decompressor = zlib.decompressobj(zlib.MAX_WBITS + 16)
+      body = decompressor.decompress(
+          self.request.body, config.MAX_REQUEST_BYTES)
+      if decompressor.unconsumed_tail:
+        logging.warning('Decompressed request too large')
+        self.error(413)
+        return
+      self.request_json = json.loads(body)
+    else:
+      self.request_json = json.load(self.request.body_file)
     return handler(self)
 
   return ParseInput
@@ -41,7 +53,17 @@ def returns_json(handler):
   @functools.wraps(handler)
   def SerializeResult(self):
     self.response.headers['Content-Type'] = 'application/json'
-    json.dump(handler(self), self.response.out, default=EncodeJSON)
+    # RFC 7694: tell clients they may gzip request bodies.
+    self.response.headers['Accept-Encoding'] = 'gzip'
+    body = json.dumps(handler(self), default=EncodeJSON)
+    if ('gzip' in self.request.headers.get('Accept-Encoding', '') and
+        len(body) >= config.GZIP_MIN_RESPONSE_BYTES):
+      # wbits + 16 writes a gzip wrapper.
+      compressor = zlib.compressobj(
+          config.GZIP_LEVEL, zlib.DEFLATED, zlib.MAX_WBITS + 16)
+      body = compressor.compress(body) + compressor.flush()
+      self.response.headers['Content-Encoding'] = 'gzip'
+    self.response.out.write(body)
 
   return SerializeResult
 
@@ -83,3 +105,26 @@ def EncodeJSON(o):
   if isinstance(o, datetime.datetime):
     return time.mktime(o.timetuple())
   return json.JSONEncoder.default(o)
+
+
+def MessageFromArgs(args):
+  """Message body from sendMessage/pin arguments, as stored: JSON text."""
+  if 'message_json' in args:
+    return json.dumps(args['message_json'])
+  return args['message']
+
+
+def EmbedMessage(event):
+  """Switch an event's message body from JSON text to an embedded value.
+
+  Embedded bodies go under a different key, so clients can tell them from
+  string bodies (which may themselves be JSON strings) event by event.
+  """
+  if not isinstance(event, dict) or 'message' not in event:
+    return
+  try:
+    event['message_json'] = json.loads(event['message'])
+  except ValueError:
+    # Not JSON; leave it as a string.
+    return
+  del event['message']